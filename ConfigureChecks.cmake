@@ -27,6 +27,7 @@ find_package(Mad REQUIRED)
 IF(UNIX)
     SET(OPENGL_LIBRARIES
         ${OPENGL_LIBRARIES}
+        X11
         xcb
         Xxf86vm
         dl
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <simulation.hpp>
+
+using namespace std;
+
+// Only built with HUES_COUNT_ALLOCATIONS: replacing the global allocator makes every allocation in
+// the process pay for the count, so the player proper goes without.
+
+static atomic<uint64_t> allocation_count{0};
+
+static void* CountedAlloc(const size_t size) {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+  void *p = CountedAlloc(size);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+static void* CountedAlignedAlloc(const size_t size, const align_val_t alignment) {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  // aligned_alloc() wants the size to be a multiple of the alignment.
+  size_t align = static_cast<size_t>(alignment);
+  return aligned_alloc(align, (max(size, (size_t) 1) + align - 1) / align * align);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+  void *p = CountedAlignedAlloc(size, alignment);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void operator delete(void *p, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, align_val_t, const nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, align_val_t, const nothrow_t&) noexcept {
+  free(p);
+}
+#endif
+
+uint64_t Simulation::GetAllocationCount() {
+  return allocation_count.load(memory_order_relaxed);
+}
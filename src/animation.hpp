@@ -0,0 +1,79 @@
+#ifndef HUES_ANIMATION_H_
+#define HUES_ANIMATION_H_
+
+#include <cmath>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * A value animated by a beat, written as a closed-form function of the time since the beat rather
+ * than stepped along by a timer. Evaluating it when a frame is drawn gives the exact value for that
+ * frame, however many frames came before, and nothing has to advance it in between.
+ *
+ * Values are in [0, 1]. Once an animation has settled it returns exactly its final value, so the
+ * renderer can tell when there's nothing left to redraw.
+ */
+class Animation {
+  public:
+
+    enum class Shape : uint8_t {
+      // Always 0.
+      NONE,
+      // Jumps to 1, then decays exponentially to 0.
+      DECAY,
+      // Rises exponentially from 0 to 1, and stays there.
+      RISE,
+      // 1 for the duration, then 0.
+      PULSE
+    };
+
+    /** Exponential shapes snap to their final value once they're this close to it. */
+    static constexpr double kSettledDistance = .001;
+
+    Animation() {}
+    ~Animation() {}
+
+    /**
+     * Starts the animation over.
+     *
+     * @param shape what the value does over time.
+     * @param start_usec when it starts, on the monotonic clock.
+     * @param duration_usec how long a pulse lasts, or the time constant (the time to get within
+     *     1/e of the final value) of an exponential shape.
+     */
+    void Start(const Shape shape, const int64_t start_usec, const int64_t duration_usec) {
+      this->shape = shape;
+      this->start_usec = start_usec;
+      this->duration_usec = duration_usec > 0 ? duration_usec : 1;
+    }
+
+    /** Sets the value back to 0 for good. */
+    void Stop() { this->shape = Shape::NONE; }
+
+    /** Returns the value at a point in time, on the monotonic clock. */
+    float GetValue(const int64_t now_usec) const {
+      double t = (double) (now_usec > this->start_usec ? now_usec - this->start_usec : 0)
+          / this->duration_usec;
+      switch (this->shape) {
+        case Shape::DECAY: {
+          double value = exp(-t);
+          return value < kSettledDistance ? 0.f : (float) value;
+        }
+        case Shape::RISE: {
+          double distance = exp(-t);
+          return distance < kSettledDistance ? 1.f : (float) (1 - distance);
+        }
+        case Shape::PULSE: return t < 1 ? 1.f : 0.f;
+        default: return 0.f;
+      }
+    }
+
+  private:
+
+    Shape shape = Shape::NONE;
+    int64_t start_usec = 0;
+    int64_t duration_usec = 1;
+};
+
+#endif // HUES_ANIMATION_H_
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include <audio_clock.hpp>
+
+using namespace std;
+
+const double AudioClock::kBandwidthHz = 0.5;
+
+/** How far the estimated rate may stray from nominal before we stop believing it. */
+static const double kMaxRateDeviation = 0.05;
+
+void AudioClock::Report(const int64_t position_usec, const int64_t now_usec) {
+  uint64_t report_count = this->reports.fetch_add(1, memory_order_relaxed) + 1;
+  double dt = (double) (now_usec - this->last_report_usec);
+  if (report_count > 1 && dt <= 0) {
+    return;
+  }
+  this->last_report_usec = now_usec;
+
+  int64_t estimate_usec = this->GetPositionUsec(now_usec);
+  int64_t error_usec = position_usec - estimate_usec;
+  if (report_count == 1 || error_usec > kResyncUsec) {
+    // First report, or we're way behind: jump to where the device is.
+    this->resyncs.fetch_add(report_count > 1 ? 1 : 0, memory_order_relaxed);
+    this->rate.store(1., memory_order_relaxed);
+    this->Publish(now_usec, position_usec, 1.);
+    return;
+  }
+  if (error_usec < -kResyncUsec) {
+    // Way ahead: hold still until the device catches up.
+    this->resyncs.fetch_add(1, memory_order_relaxed);
+    this->rate.store(1., memory_order_relaxed);
+    this->Publish(now_usec, estimate_usec, 0.);
+    return;
+  }
+
+  this->max_error_usec.store(max(this->max_error_usec.load(memory_order_relaxed),
+      (int64_t) abs(error_usec)), memory_order_relaxed);
+
+  // A second-order loop damped at 1/sqrt(2): the error nudges the rate (integral term), and the
+  // estimate slews to close the rest of the gap over about 1/omega reports (proportional term),
+  // settling with a few percent of overshoot.
+  double omega = 2 * M_PI * kBandwidthHz * dt / 1000 / 1000;
+  double rate = this->rate.load(memory_order_relaxed) + omega * omega * error_usec / dt;
+  rate = min(max(rate, 1 - kMaxRateDeviation), 1 + kMaxRateDeviation);
+  double slope = rate + M_SQRT2 * omega * error_usec / dt;
+
+  // If we're ahead by more than the loop can slew off, stop until we aren't. That isn't the rate
+  // being off, so don't learn from it.
+  if (slope < 0) {
+    this->Publish(now_usec, estimate_usec, 0.);
+    return;
+  }
+  this->rate.store(rate, memory_order_relaxed);
+  this->Publish(now_usec, estimate_usec, slope);
+}
+
+void AudioClock::Publish(const int64_t report_usec, const int64_t position_usec,
+    const double slope) {
+  uint32_t sequence = this->sequence.load(memory_order_relaxed);
+  this->sequence.store(sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  // Start the new line from now rather than from the report, so that a reader that saw the old
+  // line a moment ago can't see the new one start lower. We're the only writer, so we can read the
+  // old line directly.
+  int64_t publish_usec = max(MonotonicTimeUsec(), report_usec);
+  int64_t old_position_usec = this->base_position_usec.load(memory_order_relaxed) + (int64_t) (
+      max<int64_t>(publish_usec - this->base_usec.load(memory_order_relaxed), 0)
+          * this->slope.load(memory_order_relaxed));
+  int64_t new_position_usec =
+      position_usec + (int64_t) (max<int64_t>(publish_usec - report_usec, 0) * slope);
+
+  this->base_usec.store(publish_usec, memory_order_relaxed);
+  this->base_position_usec.store(max(old_position_usec, new_position_usec), memory_order_relaxed);
+  this->slope.store(slope, memory_order_relaxed);
+  this->sequence.store(sequence + 2, memory_order_release);
+}
+
+int64_t AudioClock::Read(int64_t *now_usec, const bool sample_now) const {
+  for (;;) {
+    uint32_t sequence = this->sequence.load(memory_order_acquire);
+    if (sequence & 1) {
+      continue;
+    }
+    if (sample_now) {
+      *now_usec = MonotonicTimeUsec();
+    }
+    int64_t base_usec = this->base_usec.load(memory_order_relaxed);
+    int64_t base_position_usec = this->base_position_usec.load(memory_order_relaxed);
+    double slope = this->slope.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (this->sequence.load(memory_order_relaxed) != sequence) {
+      continue;
+    }
+
+    return base_position_usec + (int64_t) (max<int64_t>(*now_usec - base_usec, 0) * slope);
+  }
+}
+
+int64_t AudioClock::NowUsec() const {
+  int64_t now_usec;
+  return this->Read(&now_usec, true);
+}
+
+int64_t AudioClock::GetPositionUsec(const int64_t now_usec) const {
+  int64_t at_usec = now_usec;
+  return this->Read(&at_usec, false);
+}
+
+void AudioClock::Dump() const {
+  LOG("Audio clock: [" + to_string(this->GetReportCount()) + "] reports, ["
+      + to_string(this->GetResyncCount()) + "] resyncs, max error ["
+      + to_string(this->GetMaxErrorUsec()) + "] usec, rate [" + to_string(this->GetRate())
+      + "].");
+}
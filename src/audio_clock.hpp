@@ -0,0 +1,95 @@
+#ifndef HUES_AUDIO_CLOCK_H_
+#define HUES_AUDIO_CLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * A smooth estimate of how much audio has been played, for animating against the music at frame
+ * rate. Audio devices only report their position once per period (tens of milliseconds), and late
+ * by however long the reporting thread took to wake up; this filters those reports against the
+ * monotonic clock with a second-order phase-locked loop, which tracks both the position and the
+ * device's actual sample rate.
+ *
+ * Errors are corrected by speeding up or slowing down rather than jumping, so the estimate never
+ * goes backwards. Only if it falls far behind (e.g. after the device skips ahead) does it jump
+ * forwards; if it gets far ahead (e.g. during an underrun) it holds still until the audio catches
+ * up.
+ *
+ * One thread, normally the audio device thread, calls Report(). Any thread can call NowUsec() at
+ * any time: it's a handful of loads, without locks or system calls besides reading the clock.
+ */
+class AudioClock {
+  DISALLOW_COPY_AND_ASSIGN(AudioClock)
+
+  public:
+
+    /** How quickly the loop follows the reports. Lower is smoother, but slower to lock on. */
+    static const double kBandwidthHz;
+    /** Errors bigger than this aren't smoothed over. */
+    static const int64_t kResyncUsec = 100 * 1000;
+
+    AudioClock() {}
+    ~AudioClock() {}
+
+    /**
+     * Feeds the loop a position report from the device. Reports should be made as soon as
+     * possible after the device's position changes.
+     *
+     * @param position_usec how much audio the device has played, in microseconds.
+     * @param now_usec when the position was read, on the monotonic clock.
+     */
+    void Report(const int64_t position_usec, const int64_t now_usec);
+
+    /**
+     * Returns the estimated amount of audio played by now, in microseconds, or 0 before the first
+     * report. Successive calls never go backwards.
+     */
+    int64_t NowUsec() const;
+
+    /** Returns the estimated position at some time since the latest report. May go backwards. */
+    int64_t GetPositionUsec(const int64_t now_usec) const;
+
+    /** Returns the estimated device playback rate: 1.0001 means it plays 0.01% fast. */
+    double GetRate() const { return this->rate.load(std::memory_order_relaxed); }
+
+    uint64_t GetReportCount() const { return this->reports.load(std::memory_order_relaxed); }
+    uint64_t GetResyncCount() const { return this->resyncs.load(std::memory_order_relaxed); }
+    /** Returns the biggest error smoothed over, i.e. how far off the estimate has been. */
+    int64_t GetMaxErrorUsec() const {
+      return this->max_error_usec.load(std::memory_order_relaxed);
+    }
+
+    /** Logs the loop's health. */
+    void Dump() const;
+
+  private:
+
+    /**
+     * Publishes a new estimate for readers: position_usec at report_usec, moving at slope from
+     * there. Never takes the estimate backwards from what it was just before.
+     */
+    void Publish(const int64_t report_usec, const int64_t position_usec, const double slope);
+
+    /** Reads the current estimate, and the time it was read at. */
+    int64_t Read(int64_t *now_usec, const bool sample_now) const;
+
+    // The estimate readers see, as a line through (base_usec, base_position_usec). Guarded by a
+    // sequence lock: odd while the writer is updating it.
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<int64_t> base_usec{0};
+    std::atomic<int64_t> base_position_usec{0};
+    std::atomic<double> slope{0.};
+
+    // Only written by the reporting thread.
+    std::atomic<double> rate{1.};
+    int64_t last_report_usec = 0;
+
+    std::atomic<uint64_t> reports{0};
+    std::atomic<uint64_t> resyncs{0};
+    std::atomic<int64_t> max_error_usec{0};
+};
+
+#endif // HUES_AUDIO_CLOCK_H_
@@ -1,27 +1,126 @@
 #ifndef HUES_AUDIO_RENDERER_H_
 #define HUES_AUDIO_RENDERER_H_
 
+#include <audio_clock.hpp>
+#include <audio_stats.hpp>
 #include <common.hpp>
+#include <output_stage.hpp>
+#include <pcm_stream.hpp>
+#include <realtime.hpp>
+#include <time_stretch.hpp>
 
 struct AudioRendererPrivate;
 
+/**
+ * Plays PCM audio through the platform's audio device. Everything is virtual so that simulations
+ * can swap in a renderer that only pretends to play (see NullAudioRenderer).
+ */
 class AudioRenderer {
   DISALLOW_COPY_AND_ASSIGN(AudioRenderer)
 
   public:
     AudioRenderer();
-    ~AudioRenderer();
+    virtual ~AudioRenderer();
 
     /**
-     * Initializes the platform's audio backend to play 16-bit little-endian PCM audio.
+     * Initializes the platform's audio backend to play 16-bit little-endian PCM audio, and starts
+     * the device thread that feeds it.
      *
      * @param channels the number of audio channels to expect (interleaved PCM).
      * @param sample_rate the sample rate of the audio.
      * @return <code>true</code> if initialization was successful, <code>false</code> otherwise.
      */
-    bool Init(const int channels, const int sample_rate);
+    virtual bool Init(const int channels, const int sample_rate);
 
-    void PlayAudio(const uint8_t* const pcm_data, const size_t len);
+    /**
+     * Sets the scheduling policy for the device thread. Must be called before Init().
+     */
+    virtual void SetThreadPolicy(const ThreadPolicy& policy);
+
+    /**
+     * Queues a PCM buffer to be played once, after whatever is already queued. The buffer is not
+     * copied, and must stay alive until it has finished playing.
+     *
+     * @return the buffer's number (see GetSegmentCount()), or 0 if the queue was full.
+     */
+    uint64_t PlayAudio(const uint8_t* const pcm_data, const size_t len);
+
+    /**
+     * Queues a PCM buffer to be played after whatever is already queued, repeating the region
+     * [loop_begin, loop_end) until something else is queued. The buffer is not copied, and must
+     * stay alive until it has finished playing.
+     *
+     * @param loop_begin the byte offset of the start of the loop region. Must be frame-aligned.
+     * @param loop_end the byte offset of the end of the loop region. Must be frame-aligned.
+     * @return the buffer's number (see GetSegmentCount()), or 0 if the queue was full.
+     */
+    virtual uint64_t PlayLoop(const uint8_t* const pcm_data, const size_t len,
+        const size_t loop_begin, const size_t loop_end);
+
+    /**
+     * Changes the playback speed without changing pitch. At a tempo of exactly 1, audio is played
+     * straight out of the queued buffers; otherwise it goes through a WSOLA time stretcher.
+     *
+     * @param tempo the playback speed: 1.05 plays 5% faster.
+     */
+    virtual void SetTempo(const float tempo);
+    virtual float GetTempo() const;
+
+    /**
+     * Sets the master volume. Changes are ramped in, so they never click. Until the volume or a
+     * song gain is set to something other than 1, audio bypasses the gain and limiter stage.
+     *
+     * @param volume the linear gain applied to everything played.
+     */
+    virtual void SetVolume(const float volume);
+
+    /**
+     * Sets the gain for buffers queued from now on, e.g. to even out loudness between songs. Gains
+     * above 1 are safe: a lookahead limiter keeps the result from clipping.
+     *
+     * @param gain the linear gain applied to subsequently queued buffers.
+     */
+    virtual void SetSongGain(const float gain);
+
+    /**
+     * Returns the number of loop iterations the device thread has started so far. This goes up by
+     * one every time the read cursor enters a loop region, including the first time.
+     */
+    virtual uint64_t GetLoopCount() const;
+
+    /**
+     * Returns the number of queued buffers the device thread has started playing so far. Buffers
+     * are numbered from 1, in the order they're queued.
+     */
+    virtual uint64_t GetSegmentCount() const;
+
+    /**
+     * Returns how long until the most recently started buffer (see GetSegmentCount()) becomes
+     * audible. Negative if it is already playing.
+     */
+    virtual int64_t GetSegmentStartDelayUsec() const;
+
+    /**
+     * Returns the measured output latency: how long audio handed to the device right now would
+     * take to become audible, i.e. the amount of audio written to the device but not yet played.
+     */
+    virtual int64_t GetOutputLatencyUsec() const;
+
+    /**
+     * Returns how long until the most recently started loop iteration (see GetLoopCount()) becomes
+     * audible. Negative if it is already playing.
+     */
+    virtual int64_t GetLoopStartDelayUsec() const;
+
+    /**
+     * Returns a smooth estimate of how much audio the device has played, fed by the device
+     * thread. The start delays above go by it, and beats are timed at the rate it measures. Safe
+     * to read from any thread.
+     */
+    virtual const AudioClock& GetClock() const;
+
+    /** Returns the output path's health counters. Safe to read from any thread. */
+    virtual const AudioStats& GetStats() const;
 
   private:
     /** Each platform can define their own version of the AudioRendererPrivate struct. */
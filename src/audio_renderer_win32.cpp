@@ -1,7 +1,10 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <mmsystem.h>
+#include <pthread.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <string>
@@ -10,9 +13,46 @@
 
 using namespace std;
 
+/** Number of WAVEHDRs kept in flight by the device thread. */
+static const int kBufferCount = 4;
+/** Size of each WAVEHDR, in sample frames. */
+static const int kFramesPerBuffer = 1024;
+
 struct AudioRendererPrivate {
   HWAVEOUT hout;
-  WAVEHDR wavebuf;
+  HANDLE buffer_done_event;
+  WAVEHDR wavebufs[kBufferCount];
+  size_t bytes_per_buffer;
+  size_t bytes_per_second;
+  size_t bytes_per_frame;
+
+  PcmStream stream;
+  AudioStats stats;
+  AudioClock clock;
+
+  TimeStretch stretch;
+  OutputStage output;
+  atomic<float> volume{1.f};
+  float song_gain = 1.f;
+
+  // Backing store for headers whose audio we had to process, rather than play straight from the
+  // stream.
+  int16_t *output_buffers[kBufferCount];
+
+  // Total bytes handed to waveOutWrite(), and the device offsets at which the most recent loop
+  // iteration and buffer start. The counts are published after the offsets so readers see matching
+  // pairs.
+  atomic<uint64_t> bytes_written{0};
+  atomic<uint64_t> loop_start_byte{0};
+  atomic<uint64_t> loop_count{0};
+  atomic<uint64_t> segment_start_byte{0};
+  atomic<uint64_t> segment_count{0};
+  // Buffers queued so far. Producer only.
+  uint64_t segments_queued = 0;
+
+  pthread_t device_thread;
+  ThreadPolicy device_thread_policy;
+  atomic<bool> running{false};
 };
 
 static void MMError(const string& function, const MMRESULT code) {
@@ -21,6 +61,219 @@ static void MMError(const string& function, const MMRESULT code) {
   ERR(function + ": " + errbuf);
 }
 
+/** Returns the number of bytes the device has actually played, out of the given bytes written. */
+static uint64_t GetBytesPlayed(AudioRendererPrivate *_, const uint64_t written) {
+  MMTIME position;
+  position.wType = TIME_BYTES;
+  if (waveOutGetPosition(_->hout, &position, sizeof(position)) != MMSYSERR_NOERROR
+      || position.wType != TIME_BYTES) {
+    return written;
+  }
+
+  // The device position is only 32 bits wide, but never more than 4GB behind what we've written.
+  uint32_t queued = (uint32_t) written - (uint32_t) position.u.cb;
+  return queued > written ? 0 : written - queued;
+}
+
+/**
+ * Returns how long until the device plays the given byte, going by the smoothed clock rather than
+ * the device's own position, which only moves once per period.
+ */
+static int64_t GetDelayUsec(AudioRendererPrivate *_, const uint64_t byte) {
+  return (int64_t) (byte * 1000 * 1000 / _->bytes_per_second) - _->clock.NowUsec();
+}
+
+/**
+ * If the stream started a new buffer or loop iteration since segments_before or loops_before,
+ * records that it will start playing bytes_ahead bytes past everything written to the device so
+ * far.
+ */
+static void PublishStarts(AudioRendererPrivate *_, const uint64_t segments_before,
+    const uint64_t loops_before, const uint64_t bytes_ahead) {
+  uint64_t segments_after = _->stream.GetSegmentCount();
+  uint64_t loops_after = _->stream.GetLoopCount();
+  if (segments_after == segments_before && loops_after == loops_before) {
+    return;
+  }
+
+  uint64_t output_delay = _->output.IsEngaged()
+      ? 2 * OutputStage::kLimiterBlockFrames * _->bytes_per_frame : 0;
+  uint64_t start_byte = _->bytes_written.load() + bytes_ahead + output_delay;
+  if (segments_after != segments_before) {
+    _->segment_start_byte.store(start_byte);
+    _->segment_count.store(segments_after);
+  }
+  if (loops_after != loops_before) {
+    _->loop_start_byte.store(start_byte);
+    _->loop_count.store(loops_after);
+  }
+}
+
+/** Points pcm_data at the next run of PCM straight out of the stream, without copying. */
+static size_t ReadDirect(AudioRendererPrivate *_, const uint8_t **pcm_data) {
+  uint64_t segments_before = _->stream.GetSegmentCount();
+  uint64_t loops_before = _->stream.GetLoopCount();
+  size_t len = _->stream.Read(_->bytes_per_buffer, pcm_data);
+
+  // Runs never straddle a seam or span two buffers, so a new buffer or iteration always starts at
+  // the start of this run.
+  PublishStarts(_, segments_before, loops_before, 0);
+  return len;
+}
+
+/** Fills a buffer with the stream's PCM, run through the time stretcher. */
+static size_t ReadStretched(AudioRendererPrivate *_, int16_t *buffer) {
+  const size_t frames = _->bytes_per_buffer / _->bytes_per_frame;
+  size_t produced = 0;
+
+  for (;;) {
+    produced += _->stretch.GetOutput(buffer + produced * 2, frames - produced);
+    if (produced == frames) {
+      break;
+    }
+
+    const uint8_t *pcm_data;
+    uint64_t segments_before = _->stream.GetSegmentCount();
+    uint64_t loops_before = _->stream.GetLoopCount();
+    size_t len = _->stream.Read(
+        min(_->stretch.GetInputSpace(), frames) * _->bytes_per_frame, &pcm_data);
+    if (!len) {
+      // Nothing follows, so there's no next window to overlap the last one's tail: let it and the
+      // input under it play out as they are, rather than sit in here until another song comes.
+      produced += _->stretch.Drain(buffer + produced * 2, frames - produced);
+      break;
+    }
+
+    PublishStarts(_, segments_before, loops_before,
+        (produced + _->stretch.GetLatencyFrames()) * _->bytes_per_frame);
+    _->stretch.PutInput(reinterpret_cast<const int16_t*>(pcm_data), len / _->bytes_per_frame);
+  }
+
+  return produced * _->bytes_per_frame;
+}
+
+/**
+ * Fills a buffer with what the time stretcher still holds, unstretched, so that the stream can be
+ * played directly again once it's empty. May come up short of a full buffer at the end.
+ */
+static size_t ReadDrained(AudioRendererPrivate *_, int16_t *buffer) {
+  return _->stretch.Drain(buffer, _->bytes_per_buffer / _->bytes_per_frame) * _->bytes_per_frame;
+}
+
+/**
+ * Runs a buffer through the output stage if there's any gain to apply, or has been before. Returns
+ * where the buffer to play now lives.
+ */
+static const uint8_t* ApplyOutputStage(AudioRendererPrivate *_, const uint8_t *pcm_data,
+    const size_t len, int16_t *buffer) {
+  float target_gain = _->volume.load() * _->stream.GetGain();
+  if (!_->output.IsEngaged() && target_gain == 1.f) {
+    return pcm_data;
+  }
+
+  if (pcm_data != reinterpret_cast<uint8_t*>(buffer)) {
+    memcpy(buffer, pcm_data, len);
+  }
+  _->output.SetTargetGain(target_gain);
+  _->output.Process(buffer, len / _->bytes_per_frame);
+  return reinterpret_cast<uint8_t*>(buffer);
+}
+
+/**
+ * Keeps every free WAVEHDR filled with the next run of PCM from the stream. At normal tempo and
+ * unity gain the headers point straight into the song's PCM buffer and nothing is copied; otherwise
+ * they point at our own buffers holding the stretched or gained audio.
+ */
+static void* DeviceThreadEntryPoint(void *renderer_private) {
+  AudioRendererPrivate *_ = static_cast<AudioRendererPrivate*>(renderer_private);
+  Realtime::ApplyThreadPolicy("audio", _->device_thread_policy);
+
+  bool playing = false;
+  int64_t drained_at_usec = 0;
+  uint64_t last_played = 0;
+
+  while (_->running.load()) {
+    int64_t pass_start_usec = MonotonicTimeUsec();
+    bool starved = playing;
+    for (const WAVEHDR& wavebuf : _->wavebufs) {
+      if ((wavebuf.dwFlags & WHDR_PREPARED) && !(wavebuf.dwFlags & WHDR_DONE)) {
+        starved = false;
+      }
+    }
+
+    uint64_t written_before = _->bytes_written.load();
+    for (int i = 0; i < kBufferCount; i++) {
+      WAVEHDR& wavebuf = _->wavebufs[i];
+      if ((wavebuf.dwFlags & WHDR_PREPARED) && !(wavebuf.dwFlags & WHDR_DONE)) {
+        continue;
+      }
+      if (wavebuf.dwFlags & WHDR_PREPARED) {
+        waveOutUnprepareHeader(_->hout, &wavebuf, sizeof(wavebuf));
+      }
+
+      // The stretcher always holds on to some audio while it's in use, and the stream never runs
+      // dry while looping, so once the tempo is back to 1 it's drained explicitly before going
+      // back to playing the stream directly.
+      const uint8_t *pcm_data;
+      size_t len;
+      if (_->stretch.IsDraining() || (_->stretch.GetTempo() == 1.f && !_->stretch.IsEmpty())) {
+        len = ReadDrained(_, _->output_buffers[i]);
+        pcm_data = reinterpret_cast<uint8_t*>(_->output_buffers[i]);
+      } else if (_->stretch.GetTempo() != 1.f) {
+        len = ReadStretched(_, _->output_buffers[i]);
+        pcm_data = reinterpret_cast<uint8_t*>(_->output_buffers[i]);
+      } else {
+        len = ReadDirect(_, &pcm_data);
+      }
+      if (!len) {
+        break;
+      }
+      pcm_data = ApplyOutputStage(_, pcm_data, len, _->output_buffers[i]);
+
+      wavebuf.lpData = reinterpret_cast<char*>(const_cast<uint8_t*>(pcm_data));
+      wavebuf.dwBufferLength = len;
+      wavebuf.dwFlags = 0;
+
+      MMRESULT result = waveOutPrepareHeader(_->hout, &wavebuf, sizeof(wavebuf));
+      if (result != MMSYSERR_NOERROR) {
+        MMError("waveOutPrepareHeader()", result);
+        continue;
+      }
+      waveOutWrite(_->hout, &wavebuf, sizeof(wavebuf));
+      _->bytes_written += len;
+    }
+
+    // Every buffer had already finished before we got here: the device has been playing silence
+    // since roughly when we expected it to drain.
+    uint64_t written = _->bytes_written.load();
+    if (starved && written != written_before) {
+      int64_t silent_usec = max<int64_t>(pass_start_usec - drained_at_usec, 0);
+      _->stats.RecordXrun(silent_usec * _->bytes_per_second / _->bytes_per_frame / 1000 / 1000);
+    }
+
+    // The device position only moves once per period, so it's freshest right after it moves.
+    uint64_t played = GetBytesPlayed(_, written);
+    if (played != last_played) {
+      _->clock.Report((int64_t) (played * 1000 * 1000 / _->bytes_per_second), MonotonicTimeUsec());
+      last_played = played;
+    }
+
+    uint64_t queued = written - played;
+    playing = queued > 0;
+    if (playing) {
+      _->stats.RecordFillLevel(queued);
+      drained_at_usec =
+          MonotonicTimeUsec() + (int64_t) (queued * 1000 * 1000 / _->bytes_per_second);
+    }
+    _->stats.RecordCallback(MonotonicTimeUsec() - pass_start_usec);
+
+    // Woken up by the driver when a buffer finishes, or by PlayAudio() when there's more to play.
+    WaitForSingleObject(_->buffer_done_event, INFINITE);
+  }
+
+  return NULL;
+}
+
 bool AudioRenderer::Init(const int channels, const int sample_rate) {
   WAVEFORMATEX waveformat;
   MMRESULT result;
@@ -33,32 +286,99 @@ bool AudioRenderer::Init(const int channels, const int sample_rate) {
   waveformat.nSamplesPerSec = sample_rate;
   waveformat.nBlockAlign = waveformat.nChannels * waveformat.wBitsPerSample / 8;
   waveformat.nAvgBytesPerSec = waveformat.nSamplesPerSec * waveformat.nBlockAlign;
+  waveformat.cbSize = 0;
 
-  result = waveOutOpen(&this->_->hout, devId, &waveformat, 0, 0, CALLBACK_NULL);
+  this->_->buffer_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  this->_->bytes_per_buffer = kFramesPerBuffer * waveformat.nBlockAlign;
+  this->_->bytes_per_second = waveformat.nAvgBytesPerSec;
+  this->_->bytes_per_frame = waveformat.nBlockAlign;
+  for (int16_t*& buffer : this->_->output_buffers) {
+    buffer = new int16_t[this->_->bytes_per_buffer / sizeof(int16_t)];
+  }
+
+  result = waveOutOpen(&this->_->hout, devId, &waveformat,
+      (DWORD_PTR) this->_->buffer_done_event, 0, CALLBACK_EVENT);
 
   if (result != MMSYSERR_NOERROR) {
     MMError("waveOutOpen()", result);
     return false;
   }
 
+  this->_->running = true;
+  pthread_create(&this->_->device_thread, NULL, DeviceThreadEntryPoint, this->_);
+
   return true;
 }
 
-void AudioRenderer::PlayAudio(const uint8_t* const pcm_data, const size_t len) {
-  this->_->wavebuf.dwBufferLength = len;
-  this->_->wavebuf.dwFlags = 0;
-  this->_->wavebuf.lpData = reinterpret_cast<char*>(const_cast<uint8_t*>(pcm_data));
+void AudioRenderer::SetThreadPolicy(const ThreadPolicy& policy) {
+  this->_->device_thread_policy = policy;
+}
 
-  MMRESULT result =
-      waveOutPrepareHeader(this->_->hout, &this->_->wavebuf, sizeof(this->_->wavebuf));
-  if (result != MMSYSERR_NOERROR) {
-    MMError("waveOutPrepareHeader()", result);
-    return;
+uint64_t AudioRenderer::PlayAudio(const uint8_t* const pcm_data, const size_t len) {
+  return this->PlayLoop(pcm_data, len, 0, 0);
+}
+
+uint64_t AudioRenderer::PlayLoop(const uint8_t* const pcm_data, const size_t len,
+    const size_t loop_begin, const size_t loop_end) {
+  PcmSegment segment { pcm_data, len, loop_begin, loop_end, this->_->song_gain };
+  if (!this->_->stream.Enqueue(segment)) {
+    ERR("Audio queue is full, dropping buffer of [" + to_string(len) + "] bytes.");
+    this->_->stats.RecordDropped(len / this->_->bytes_per_frame);
+    return 0;
   }
 
-  LOG("Playing buffer of [" + to_string(len) + "] bytes.");
+  LOG("Queued buffer of [" + to_string(len) + "] bytes"
+      + (segment.IsLooping() ? ", looping [" + to_string(loop_begin) + ", "
+          + to_string(loop_end) + ")." : "."));
+
+  SetEvent(this->_->buffer_done_event);
+  return ++this->_->segments_queued;
+}
+
+void AudioRenderer::SetTempo(const float tempo) {
+  this->_->stretch.SetTempo(tempo);
+}
+
+float AudioRenderer::GetTempo() const {
+  return this->_->stretch.GetTempo();
+}
+
+void AudioRenderer::SetVolume(const float volume) {
+  this->_->volume.store(volume);
+}
+
+void AudioRenderer::SetSongGain(const float gain) {
+  this->_->song_gain = gain;
+}
+
+uint64_t AudioRenderer::GetLoopCount() const {
+  return this->_->loop_count.load();
+}
+
+const AudioClock& AudioRenderer::GetClock() const {
+  return this->_->clock;
+}
+
+const AudioStats& AudioRenderer::GetStats() const {
+  return this->_->stats;
+}
 
-  waveOutWrite(this->_->hout, &this->_->wavebuf, sizeof(this->_->wavebuf));
+uint64_t AudioRenderer::GetSegmentCount() const {
+  return this->_->segment_count.load();
+}
+
+int64_t AudioRenderer::GetSegmentStartDelayUsec() const {
+  return GetDelayUsec(this->_, this->_->segment_start_byte.load());
+}
+
+int64_t AudioRenderer::GetOutputLatencyUsec() const {
+  uint64_t written = this->_->bytes_written.load();
+  uint64_t queued = written - GetBytesPlayed(this->_, written);
+  return (int64_t) (queued * 1000 * 1000 / this->_->bytes_per_second);
+}
+
+int64_t AudioRenderer::GetLoopStartDelayUsec() const {
+  return GetDelayUsec(this->_, this->_->loop_start_byte.load());
 }
 
 AudioRenderer::AudioRenderer() {
@@ -66,10 +386,27 @@ AudioRenderer::AudioRenderer() {
 }
 
 AudioRenderer::~AudioRenderer() {
+  if (this->_->running) {
+    this->_->running = false;
+    SetEvent(this->_->buffer_done_event);
+    pthread_join(this->_->device_thread, NULL);
+  }
+
   if (this->_->hout) {
-    waveOutUnprepareHeader(this->_->hout, &this->_->wavebuf, sizeof(this->_->wavebuf));
+    waveOutReset(this->_->hout);
+    for (WAVEHDR& wavebuf : this->_->wavebufs) {
+      if (wavebuf.dwFlags & WHDR_PREPARED) {
+        waveOutUnprepareHeader(this->_->hout, &wavebuf, sizeof(wavebuf));
+      }
+    }
     waveOutClose(this->_->hout);
   }
+  if (this->_->buffer_done_event) {
+    CloseHandle(this->_->buffer_done_event);
+  }
+  for (int16_t *buffer : this->_->output_buffers) {
+    delete[] buffer;
+  }
 
   delete this->_;
 }
@@ -0,0 +1,68 @@
+#include <string>
+
+#include <audio_stats.hpp>
+
+using namespace std;
+
+AudioStats::AudioStats() {
+  for (auto& bucket : this->callback_histogram) {
+    bucket.store(0, memory_order_relaxed);
+  }
+}
+
+void AudioStats::RecordXrun(const uint64_t frames_padded) {
+  this->xruns.fetch_add(1, memory_order_relaxed);
+  this->frames_padded.fetch_add(frames_padded, memory_order_relaxed);
+}
+
+void AudioStats::RecordCallback(const int64_t duration_usec) {
+  int bucket = 0;
+  for (int64_t usec = duration_usec; usec > 0 && bucket < kHistogramBuckets - 1; usec >>= 1) {
+    bucket++;
+  }
+
+  this->callbacks.fetch_add(1, memory_order_relaxed);
+  this->callback_histogram[bucket].fetch_add(1, memory_order_relaxed);
+
+  // There's only one device thread, so a plain compare-and-store is enough.
+  if (duration_usec > this->callback_max_usec.load(memory_order_relaxed)) {
+    this->callback_max_usec.store(duration_usec, memory_order_relaxed);
+  }
+}
+
+void AudioStats::RecordFillLevel(const uint64_t bytes_queued) {
+  if (bytes_queued < this->fill_low_water.load(memory_order_relaxed)) {
+    this->fill_low_water.store(bytes_queued, memory_order_relaxed);
+  }
+  if (bytes_queued > this->fill_high_water.load(memory_order_relaxed)) {
+    this->fill_high_water.store(bytes_queued, memory_order_relaxed);
+  }
+}
+
+void AudioStats::RecordDropped(const uint64_t frames_dropped) {
+  this->frames_dropped.fetch_add(frames_dropped, memory_order_relaxed);
+}
+
+uint64_t AudioStats::GetFillLowWater() const {
+  uint64_t low_water = this->fill_low_water.load(memory_order_relaxed);
+  return low_water == UINT64_MAX ? 0 : low_water;
+}
+
+void AudioStats::Dump() const {
+  LOG("Audio: [" + to_string(this->GetXrunCount()) + "] xruns, ["
+      + to_string(this->GetFramesPadded()) + "] frames padded, ["
+      + to_string(this->GetFramesDropped()) + "] frames dropped.");
+  LOG("Audio: device fill level low water [" + to_string(this->GetFillLowWater())
+      + "] bytes, high water [" + to_string(this->GetFillHighWater()) + "] bytes.");
+  LOG("Audio: [" + to_string(this->GetCallbackCount()) + "] refill passes, max ["
+      + to_string(this->GetCallbackMaxUsec()) + "] usec.");
+
+  for (int bucket = 0; bucket < kHistogramBuckets; bucket++) {
+    uint64_t count = this->GetCallbackHistogram(bucket);
+    if (!count) {
+      continue;
+    }
+    string range = bucket == 0 ? "< 1" : "< " + to_string(1L << bucket);
+    LOG("Audio:   " + range + " usec: " + to_string(count));
+  }
+}
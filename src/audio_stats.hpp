@@ -0,0 +1,73 @@
+#ifndef HUES_AUDIO_STATS_H_
+#define HUES_AUDIO_STATS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * Counters describing the health of the audio output path. The device thread records into these
+ * without locking or allocating; any thread can read them (or Dump() them) at any time.
+ */
+class AudioStats {
+  DISALLOW_COPY_AND_ASSIGN(AudioStats)
+
+  public:
+
+    /** Bucket 0 counts passes under 1 usec; bucket i counts [2^(i-1), 2^i) usec. */
+    static const int kHistogramBuckets = 20;
+
+    AudioStats();
+    ~AudioStats() {}
+
+    /**
+     * Records an underrun: the device ran out of audio before we refilled it.
+     *
+     * @param frames_padded the estimated number of frames of silence the device played meanwhile.
+     */
+    void RecordXrun(const uint64_t frames_padded);
+    /** Records how long one device thread refill pass took. */
+    void RecordCallback(const int64_t duration_usec);
+    /** Records how many bytes are queued on the device after a refill pass. */
+    void RecordFillLevel(const uint64_t bytes_queued);
+    /** Records frames that were thrown away instead of being played. */
+    void RecordDropped(const uint64_t frames_dropped);
+
+    uint64_t GetXrunCount() const { return this->xruns.load(std::memory_order_relaxed); }
+    uint64_t GetFramesPadded() const { return this->frames_padded.load(std::memory_order_relaxed); }
+    uint64_t GetFramesDropped() const {
+      return this->frames_dropped.load(std::memory_order_relaxed);
+    }
+    uint64_t GetCallbackCount() const { return this->callbacks.load(std::memory_order_relaxed); }
+    uint64_t GetCallbackHistogram(const int bucket) const {
+      return this->callback_histogram[bucket].load(std::memory_order_relaxed);
+    }
+    int64_t GetCallbackMaxUsec() const {
+      return this->callback_max_usec.load(std::memory_order_relaxed);
+    }
+    /** Returns the fewest bytes ever left queued on the device, or 0 if nothing was recorded. */
+    uint64_t GetFillLowWater() const;
+    uint64_t GetFillHighWater() const {
+      return this->fill_high_water.load(std::memory_order_relaxed);
+    }
+
+    /** Logs all counters. */
+    void Dump() const;
+
+  private:
+
+    std::atomic<uint64_t> xruns{0};
+    std::atomic<uint64_t> frames_padded{0};
+    std::atomic<uint64_t> frames_dropped{0};
+
+    std::atomic<uint64_t> callbacks{0};
+    std::atomic<uint64_t> callback_histogram[kHistogramBuckets];
+    std::atomic<int64_t> callback_max_usec{0};
+
+    std::atomic<uint64_t> fill_low_water{UINT64_MAX};
+    std::atomic<uint64_t> fill_high_water{0};
+};
+
+#endif // HUES_AUDIO_STATS_H_
@@ -0,0 +1,25 @@
+#include <beat_events.hpp>
+
+using namespace std;
+
+bool BeatEventQueue::Push(const BeatEvent& event) {
+  unsigned int head = this->head.load(memory_order_relaxed);
+  if (head - this->tail.load(memory_order_acquire) >= kCapacity) {
+    return false;
+  }
+
+  this->events[head % kCapacity] = event;
+  this->head.store(head + 1, memory_order_release);
+  return true;
+}
+
+bool BeatEventQueue::Pop(BeatEvent *event) {
+  unsigned int tail = this->tail.load(memory_order_relaxed);
+  if (tail == this->head.load(memory_order_acquire)) {
+    return false;
+  }
+
+  *event = this->events[tail % kCapacity];
+  this->tail.store(tail + 1, memory_order_release);
+  return true;
+}
@@ -0,0 +1,69 @@
+#ifndef HUES_BEAT_EVENTS_H_
+#define HUES_BEAT_EVENTS_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include <common.hpp>
+#include <respack.hpp>
+
+/**
+ * A beat with every random choice already made, so that whoever draws it can know exactly what's
+ * coming before it's due.
+ */
+struct BeatEvent {
+  // Increases by one for every beat resolved from a song.
+  uint64_t sequence;
+
+  // NULL for beats fired from outside (see BeatTrigger); so is everything up to the transition.
+  const AudioResource *song;
+  AudioResource::Type type;
+  size_t beat;
+
+  AudioResource::Beat transition;
+  // What the beat changes: BeatTimeline::kChange* bits, and what to change them to.
+  uint8_t actions;
+  ImageResource *image;
+  int color_index;
+
+  // When the beat is expected to be drawn, on the monotonic clock. Beats in later loop iterations
+  // assume the audio keeps up perfectly, so this is only an estimate.
+  int64_t due_usec;
+};
+
+/**
+ * A single-producer, single-consumer queue of upcoming BeatEvents. The logic thread pushes beats as
+ * it resolves them; the render thread pops them to get ready. Neither side ever blocks.
+ */
+class BeatEventQueue {
+  DISALLOW_COPY_AND_ASSIGN(BeatEventQueue)
+
+  public:
+
+    static const unsigned int kCapacity = 32;
+
+    BeatEventQueue() {}
+    ~BeatEventQueue() {}
+
+    /**
+     * Queues an event. Producer thread only.
+     *
+     * @return <code>false</code> if the queue is full, <code>true</code> otherwise.
+     */
+    bool Push(const BeatEvent& event);
+
+    /**
+     * Takes the oldest event off the queue. Consumer thread only.
+     *
+     * @return <code>false</code> if the queue is empty, <code>true</code> otherwise.
+     */
+    bool Pop(BeatEvent *event);
+
+  private:
+
+    BeatEvent events[kCapacity];
+    std::atomic<unsigned int> head{0};
+    std::atomic<unsigned int> tail{0};
+};
+
+#endif // HUES_BEAT_EVENTS_H_
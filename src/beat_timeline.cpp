@@ -0,0 +1,78 @@
+#include <algorithm>
+
+#include <beat_timeline.hpp>
+
+using namespace std;
+
+typedef BeatTimeline::Beat Beat;
+
+static constexpr Beat BeatForCharacter(const int c) {
+  return c == 'x' ? Beat::VERTICAL_BLUR
+      : c == 'o' ? Beat::HORIZONTAL_BLUR
+      : c == '-' ? Beat::NO_BLUR
+      : c == '+' ? Beat::BLACKOUT
+      : c == '|' ? Beat::SHORT_BLACKOUT
+      : c == ':' ? Beat::COLOR_ONLY
+      : c == '*' ? Beat::IMAGE_ONLY
+      : Beat::NO_TRANSITION;
+}
+
+// C++11 has no constexpr loops, so spell out all 256 entries.
+#define BEAT_ROW_4(c) BeatForCharacter(c), BeatForCharacter((c) + 1), \
+    BeatForCharacter((c) + 2), BeatForCharacter((c) + 3)
+#define BEAT_ROW_16(c) BEAT_ROW_4(c), BEAT_ROW_4((c) + 4), BEAT_ROW_4((c) + 8), BEAT_ROW_4((c) + 12)
+#define BEAT_ROW_64(c) BEAT_ROW_16(c), BEAT_ROW_16((c) + 16), BEAT_ROW_16((c) + 32), \
+    BEAT_ROW_16((c) + 48)
+
+/** Beat type for every possible beatmap character. */
+static constexpr Beat kBeatTable[256] = {
+  BEAT_ROW_64(0), BEAT_ROW_64(64), BEAT_ROW_64(128), BEAT_ROW_64(192)
+};
+
+#undef BEAT_ROW_64
+#undef BEAT_ROW_16
+#undef BEAT_ROW_4
+
+static_assert(kBeatTable['x'] == Beat::VERTICAL_BLUR && kBeatTable['*'] == Beat::IMAGE_ONLY
+    && kBeatTable['.'] == Beat::NO_TRANSITION && kBeatTable[0xFF] == Beat::NO_TRANSITION,
+    "Beat table is out of sync with BeatForCharacter()");
+
+Beat BeatTimeline::ParseBeatCharacter(const char beat_char) {
+  return kBeatTable[static_cast<unsigned char>(beat_char)];
+}
+
+uint8_t BeatTimeline::GetActionsForBeat(const Beat beat) {
+  switch (beat) {
+    case Beat::NO_TRANSITION: return 0;
+    case Beat::IMAGE_ONLY: return kChangeImage;
+    case Beat::COLOR_ONLY: return kChangeColor;
+    default: return kChangeColor | kChangeImage;
+  }
+}
+
+void BeatTimeline::Compile(const string& beatmap, const size_t frame_count) {
+  static const string kNoBeatmap = ".";
+  const string& chars = beatmap.empty() ? kNoBeatmap : beatmap;
+  const size_t beat_count = chars.length();
+
+  this->frame_offsets.resize(beat_count);
+  this->beats.resize(beat_count);
+  this->actions.resize(beat_count);
+  this->image_change_count = 0;
+  this->color_change_count = 0;
+
+  for (size_t i = 0; i < beat_count; i++) {
+    // Integer math, so beat i of every loop lands on exactly the same frame.
+    this->frame_offsets[i] = (uint32_t) ((uint64_t) i * frame_count / beat_count);
+    this->beats[i] = ParseBeatCharacter(chars[i]);
+    this->actions[i] = GetActionsForBeat(this->beats[i]);
+
+    this->image_change_count += (this->actions[i] & kChangeImage) ? 1 : 0;
+    this->color_change_count += (this->actions[i] & kChangeColor) ? 1 : 0;
+  }
+}
+
+size_t BeatTimeline::FindBeat(const size_t frame) const {
+  auto next = upper_bound(this->frame_offsets.begin(), this->frame_offsets.end(), frame);
+  return next == this->frame_offsets.begin() ? 0 : (next - this->frame_offsets.begin()) - 1;
+}
@@ -0,0 +1,79 @@
+#ifndef HUES_BEAT_TIMELINE_H_
+#define HUES_BEAT_TIMELINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <common.hpp>
+
+/**
+ * A beatmap compiled ahead of time, so that nothing has to be parsed or divided while a song plays.
+ *
+ * Each beat gets a frame offset into the song (at normal tempo), its type, and the set of things it
+ * changes on screen. They are kept as parallel arrays, so walking the timeline only touches the
+ * fields being looked at.
+ */
+class BeatTimeline {
+  DISALLOW_COPY_AND_ASSIGN(BeatTimeline)
+
+  public:
+
+    enum class Beat : uint8_t {
+      VERTICAL_BLUR,
+      HORIZONTAL_BLUR,
+      NO_BLUR,
+      BLACKOUT,
+      SHORT_BLACKOUT,
+      COLOR_ONLY,
+      IMAGE_ONLY,
+      NO_TRANSITION
+    };
+
+    /** Bits of GetActions(). */
+    static const uint8_t kChangeColor = 1 << 0;
+    static const uint8_t kChangeImage = 1 << 1;
+
+    BeatTimeline() {}
+    ~BeatTimeline() {}
+
+    /** Maps a beatmap character to its beat type. Unknown characters are NO_TRANSITION. */
+    static Beat ParseBeatCharacter(const char beat_char);
+
+    /** Returns what a beat of the given type changes on screen, as kChange* bits. */
+    static uint8_t GetActionsForBeat(const Beat beat);
+
+    /**
+     * Compiles a beatmap, replacing whatever was compiled before. The beats are spread evenly over
+     * the song; an empty beatmap is a single beat that does nothing.
+     *
+     * @param beatmap the beatmap string from the respack.
+     * @param frame_count the length of the song, in sample frames.
+     */
+    void Compile(const std::string& beatmap, const size_t frame_count);
+
+    size_t GetBeatCount() const { return this->frame_offsets.size(); }
+    /** Returns the frame at which a beat starts, at normal tempo. */
+    uint32_t GetFrameOffset(const size_t beat) const { return this->frame_offsets[beat]; }
+    Beat GetBeat(const size_t beat) const { return this->beats[beat]; }
+    uint8_t GetActions(const size_t beat) const { return this->actions[beat]; }
+
+    /** Returns the index of the beat playing at a frame offset. */
+    size_t FindBeat(const size_t frame) const;
+
+    /** Returns the number of beats that change the image, or the color. */
+    size_t GetImageChangeCount() const { return this->image_change_count; }
+    size_t GetColorChangeCount() const { return this->color_change_count; }
+
+  private:
+
+    std::vector<uint32_t> frame_offsets;
+    std::vector<Beat> beats;
+    std::vector<uint8_t> actions;
+
+    size_t image_change_count = 0;
+    size_t color_change_count = 0;
+};
+
+#endif // HUES_BEAT_TIMELINE_H_
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <beat_trace.hpp>
+#include <respack.hpp>
+
+using namespace std;
+
+/** Logs percentiles and a log2 histogram of a set of lateness samples. */
+static void DumpLateness(const string& prefix, vector<int64_t>& lateness_usec) {
+  if (lateness_usec.empty()) {
+    return;
+  }
+
+  sort(lateness_usec.begin(), lateness_usec.end());
+  size_t n = lateness_usec.size();
+  LOG(prefix + "p50 [" + to_string(lateness_usec[(n - 1) / 2]) + "] usec, p99 ["
+      + to_string(lateness_usec[(n - 1) * 99 / 100]) + "] usec, max ["
+      + to_string(lateness_usec[n - 1]) + "] usec.");
+
+  uint64_t histogram[BeatTrace::kHistogramBuckets] = {};
+  uint64_t early = 0;
+  for (int64_t usec : lateness_usec) {
+    if (usec < 0) {
+      early++;
+      continue;
+    }
+    int bucket = 0;
+    for (; usec > 0 && bucket < BeatTrace::kHistogramBuckets - 1; usec >>= 1) {
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+
+  if (early) {
+    LOG(prefix + "  early: " + to_string(early));
+  }
+  for (int bucket = 0; bucket < BeatTrace::kHistogramBuckets; bucket++) {
+    if (!histogram[bucket]) {
+      continue;
+    }
+    string range = bucket == 0 ? "< 1" : "< " + to_string(1L << bucket);
+    LOG(prefix + "  " + range + " usec: " + to_string(histogram[bucket]));
+  }
+}
+
+void BeatTrace::RecordBeat(const AudioResource *song, const int64_t scheduled_usec,
+    const int64_t applied_usec) {
+  uint64_t index = this->recorded.load(memory_order_relaxed);
+  Record& record = this->records[index % kCapacity];
+  record.song = song;
+  record.scheduled_usec = scheduled_usec;
+  record.applied_usec = applied_usec;
+  record.drawn_usec.store(0, memory_order_relaxed);
+  record.presented_usec.store(0, memory_order_relaxed);
+  this->recorded.store(index + 1, memory_order_release);
+}
+
+void BeatTrace::RecordPresented(const uint64_t recorded_count, const int64_t drawn_usec,
+    const int64_t presented_usec) {
+  // Anything that has been overwritten since is gone. If the logic thread laps us while we're in
+  // here we may stamp a newer beat early, which would take a stall of kCapacity beats.
+  uint64_t first = max(this->presented,
+      recorded_count > (uint64_t) kCapacity ? recorded_count - kCapacity : 0);
+  for (uint64_t index = first; index < recorded_count; index++) {
+    this->records[index % kCapacity].drawn_usec.store(drawn_usec, memory_order_relaxed);
+    this->records[index % kCapacity].presented_usec.store(presented_usec, memory_order_relaxed);
+  }
+  this->presented = max(this->presented, recorded_count);
+}
+
+void BeatTrace::Dump() const {
+  uint64_t recorded = this->GetRecordedCount();
+  uint64_t first = recorded > (uint64_t) kCapacity ? recorded - kCapacity : 0;
+
+  // Group the ring by song, in the order they were played.
+  vector<const AudioResource*> songs;
+  for (uint64_t index = first; index < recorded; index++) {
+    const AudioResource *song = this->records[index % kCapacity].song;
+    if (find(songs.begin(), songs.end(), song) == songs.end()) {
+      songs.push_back(song);
+    }
+  }
+
+  LOG("Beat trace: [" + to_string(recorded - first) + "] of [" + to_string(recorded)
+      + "] beats kept.");
+  for (const AudioResource *song : songs) {
+    vector<int64_t> applied, drawn, presented;
+    for (uint64_t index = first; index < recorded; index++) {
+      const Record& record = this->records[index % kCapacity];
+      if (record.song != song) {
+        continue;
+      }
+      applied.push_back(record.applied_usec - record.scheduled_usec);
+      int64_t presented_usec = record.presented_usec.load(memory_order_relaxed);
+      if (presented_usec) {
+        drawn.push_back(record.drawn_usec.load(memory_order_relaxed) - record.scheduled_usec);
+        presented.push_back(presented_usec - record.scheduled_usec);
+      }
+    }
+
+    LOG("Beat trace: [" + (song ? song->GetTitle() : "triggered beats") + "], ["
+        + to_string(applied.size()) + "] beats, [" + to_string(presented.size())
+        + "] seen on screen.");
+    DumpLateness("Beat trace:   applied ", applied);
+    DumpLateness("Beat trace:   drawn ", drawn);
+    DumpLateness("Beat trace:   on screen ", presented);
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef HUES_BEAT_TRACE_H_
+#define HUES_BEAT_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include <common.hpp>
+
+class AudioResource;
+
+/**
+ * Traces how late every visible beat is, so we can tell whether the show is in sync.
+ *
+ * For each beat we keep when it was due, when the logic thread got the renderer to apply it, when
+ * the first frame showing it started drawing, and when that frame was swapped to the screen.
+ * Records live in a preallocated ring of the last kCapacity beats: recording never allocates or
+ * blocks.
+ *
+ * The logic thread calls RecordBeat() and Dump(); the render thread calls GetRecordedCount() and
+ * RecordPresented() around each frame.
+ */
+class BeatTrace {
+  DISALLOW_COPY_AND_ASSIGN(BeatTrace)
+
+  public:
+
+    static const int kCapacity = 4096;
+    static const int kHistogramBuckets = 16;
+
+    BeatTrace() {}
+    ~BeatTrace() {}
+
+    /**
+     * Records a beat that has just been applied.
+     *
+     * @param song the song the beat belongs to, or NULL for a triggered beat.
+     * @param scheduled_usec when the beat was due (or triggered) on the monotonic clock.
+     * @param applied_usec when the renderer had been told about it.
+     */
+    void RecordBeat(const AudioResource *song, const int64_t scheduled_usec,
+        const int64_t applied_usec);
+
+    /**
+     * Returns the number of beats recorded so far. The render thread grabs this before drawing a
+     * frame; every beat it counts is in that frame.
+     */
+    uint64_t GetRecordedCount() const { return this->recorded.load(std::memory_order_acquire); }
+
+    /**
+     * Marks the beats drawn in a frame as presented.
+     *
+     * @param recorded_count what GetRecordedCount() returned before drawing the frame.
+     * @param drawn_usec when the frame started drawing, about when recorded_count was taken.
+     * @param presented_usec when the frame was swapped.
+     */
+    void RecordPresented(const uint64_t recorded_count, const int64_t drawn_usec,
+        const int64_t presented_usec);
+
+    /** Logs lateness percentiles and histograms for each song in the ring. */
+    void Dump() const;
+
+  private:
+
+    struct Record {
+      const AudioResource *song;
+      int64_t scheduled_usec;
+      int64_t applied_usec;
+      // Written by the render thread; 0 until then.
+      std::atomic<int64_t> drawn_usec;
+      std::atomic<int64_t> presented_usec;
+    };
+
+    Record records[kCapacity];
+    std::atomic<uint64_t> recorded{0};
+
+    // Only touched by the render thread.
+    uint64_t presented = 0;
+};
+
+#endif // HUES_BEAT_TRACE_H_
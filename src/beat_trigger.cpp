@@ -0,0 +1,218 @@
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <string>
+
+#include <beat_trigger.hpp>
+
+using namespace std;
+
+#ifdef WIN32
+typedef SOCKET socket_t;
+static const socket_t kInvalidSocket = INVALID_SOCKET;
+static void CloseSocket(socket_t fd) { closesocket(fd); }
+#else
+typedef int socket_t;
+static const socket_t kInvalidSocket = -1;
+static void CloseSocket(socket_t fd) { close(fd); }
+#endif
+
+/** How often the listener checks whether it should stop. */
+static const int kReceiveTimeoutMsec = 100;
+
+static const char kBeatAddress[] = "/hues/beat";
+
+/** Bundles start with this, then an 8 byte time tag, then their size-prefixed elements. */
+static const char kBundleTag[] = "#bundle";
+static const size_t kBundleHeaderLength = sizeof(kBundleTag) + 8;
+
+/**
+ * Returns the length of the OSC string at the start of data, including its padding to a multiple
+ * of 4 bytes, or 0 if it isn't terminated in time.
+ */
+static size_t OscStringLength(const char *data, const size_t len) {
+  const char *end = static_cast<const char*>(memchr(data, '\0', len));
+  if (!end) {
+    return 0;
+  }
+  size_t padded = ((end - data) / 4 + 1) * 4;
+  return padded <= len ? padded : 0;
+}
+
+BeatTrigger::~BeatTrigger() {
+  if (this->running) {
+    this->running = false;
+    pthread_join(this->listener_thread, NULL);
+  }
+  if ((socket_t) this->socket_fd != kInvalidSocket) {
+    CloseSocket((socket_t) this->socket_fd);
+  }
+#ifdef WIN32
+  if (this->winsock_started) {
+    WSACleanup();
+  }
+#endif
+}
+
+bool BeatTrigger::Start(const int port) {
+#ifdef WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+    ERR("WSAStartup() failed.");
+    return false;
+  }
+  this->winsock_started = true;
+#endif
+
+  socket_t fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd == kInvalidSocket) {
+    ERR("Couldn't create beat trigger socket.");
+    return false;
+  }
+
+  // Wake up now and then to check whether we should stop.
+#ifdef WIN32
+  DWORD timeout = kReceiveTimeoutMsec;
+#else
+  struct timeval timeout = { 0, kReceiveTimeoutMsec * 1000 };
+#endif
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout),
+      sizeof(timeout));
+
+  // Only listen locally: anyone who can reach this port can drive the show.
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+    ERR("Couldn't bind beat trigger socket to port [" + to_string(port) + "].");
+    CloseSocket(fd);
+    return false;
+  }
+
+  this->socket_fd = (intptr_t) fd;
+  this->running = true;
+  pthread_create(&this->listener_thread, NULL, BeatTrigger::ListenerEntryPoint, this);
+
+  LOG("Listening for beats on UDP port [" + to_string(port) + "].");
+  return true;
+}
+
+bool BeatTrigger::Poll(TriggeredBeat *beat) {
+  unsigned int tail = this->tail.load(memory_order_relaxed);
+  if (tail == this->head.load(memory_order_acquire)) {
+    return false;
+  }
+
+  *beat = this->beats[tail % kQueueCapacity];
+  this->tail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+void BeatTrigger::Push(const char beat_char, const int64_t received_usec) {
+  unsigned int head = this->head.load(memory_order_relaxed);
+  if (head - this->tail.load(memory_order_acquire) >= kQueueCapacity) {
+    this->dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+
+  this->beats[head % kQueueCapacity] = TriggeredBeat { beat_char, received_usec };
+  this->head.store(head + 1, memory_order_release);
+}
+
+void BeatTrigger::HandlePacket(const char *packet, const size_t len,
+    const int64_t received_usec) {
+  // A bundle: handle each of its elements in turn, which may be bundles themselves.
+  if (len >= kBundleHeaderLength && memcmp(packet, kBundleTag, sizeof(kBundleTag)) == 0) {
+    size_t offset = kBundleHeaderLength;
+    while (offset + 4 <= len) {
+      uint32_t element_len;
+      memcpy(&element_len, packet + offset, 4);
+      element_len = ntohl(element_len);
+      offset += 4;
+      if (element_len > len - offset) {
+        ERR("Malformed OSC bundle.");
+        return;
+      }
+      this->HandlePacket(packet + offset, element_len, received_usec);
+      offset += element_len;
+    }
+    return;
+  }
+
+  // Not OSC: take it as beatmap characters, ignoring line endings.
+  if (!len || packet[0] != '/') {
+    for (size_t i = 0; i < len; i++) {
+      if (packet[i] != '\n' && packet[i] != '\r') {
+        this->Push(packet[i], received_usec);
+      }
+    }
+    return;
+  }
+
+  size_t address_len = OscStringLength(packet, len);
+  if (!address_len || strcmp(packet, kBeatAddress) != 0) {
+    DEBUG("Ignoring OSC message to [" + string(packet, strnlen(packet, len)) + "].");
+    return;
+  }
+
+  const char *type_tags = packet + address_len;
+  size_t type_tags_len = OscStringLength(type_tags, len - address_len);
+  if (!type_tags_len || type_tags[0] != ',') {
+    ERR("Malformed OSC message to [" + string(kBeatAddress) + "].");
+    return;
+  }
+
+  const char *argument = type_tags + type_tags_len;
+  size_t remaining = len - address_len - type_tags_len;
+  for (const char *tag = type_tags + 1; *tag; tag++) {
+    if (*tag == 's') {
+      size_t string_len = OscStringLength(argument, remaining);
+      if (!string_len) {
+        break;
+      }
+      for (const char *c = argument; *c; c++) {
+        this->Push(*c, received_usec);
+      }
+      argument += string_len;
+      remaining -= string_len;
+    } else if (*tag == 'i') {
+      if (remaining < 4) {
+        break;
+      }
+      uint32_t value;
+      memcpy(&value, argument, 4);
+      this->Push((char) ntohl(value), received_usec);
+      argument += 4;
+      remaining -= 4;
+    } else {
+      ERR("Unsupported OSC argument type [" + string(1, *tag) + "].");
+      break;
+    }
+  }
+}
+
+void* BeatTrigger::ListenerEntryPoint(void *beat_trigger) {
+  BeatTrigger *_this = static_cast<BeatTrigger*>(beat_trigger);
+  char packet[1024];
+
+  while (_this->running.load()) {
+    int len = recv((socket_t) _this->socket_fd, packet, sizeof(packet), 0);
+    if (len <= 0) {
+      continue;
+    }
+    _this->HandlePacket(packet, len, MonotonicTimeUsec());
+  }
+
+  return NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef HUES_BEAT_TRIGGER_H_
+#define HUES_BEAT_TRIGGER_H_
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/** A beat fired from outside, e.g. by an operator or a lighting desk. */
+struct TriggeredBeat {
+  // The beatmap character for the beat, e.g. 'x' for a vertical blur.
+  char beat_char;
+  // When the packet was received, on the monotonic clock.
+  int64_t received_usec;
+};
+
+/**
+ * Listens for beats on a local UDP port, on its own thread.
+ *
+ * Packets are OSC messages to /hues/beat, with either a string argument (each character is a beat,
+ * as in a beatmap) or an int argument (the character code of one beat), or OSC bundles of them.
+ * Bundle time tags are ignored: beats are applied as soon as they arrive. As a convenience for
+ * testing with e.g. netcat, a packet that isn't OSC is read as a string of beatmap characters.
+ *
+ * The listener thread pushes beats onto a lock-free single-producer, single-consumer queue, and
+ * one other thread takes them off with Poll(). Neither side blocks the other.
+ */
+class BeatTrigger {
+  DISALLOW_COPY_AND_ASSIGN(BeatTrigger)
+
+  public:
+
+    static const unsigned int kQueueCapacity = 64;
+
+    BeatTrigger() {}
+    ~BeatTrigger();
+
+    /**
+     * Binds to the given port on the loopback interface and starts listening.
+     *
+     * @return <code>true</code> if the socket was bound, <code>false</code> otherwise.
+     */
+    bool Start(const int port);
+
+    /**
+     * Takes the oldest triggered beat off the queue.
+     *
+     * @return <code>false</code> if no beat is waiting, <code>true</code> otherwise.
+     */
+    bool Poll(TriggeredBeat *beat);
+
+    /** Returns the number of beats dropped because the queue was full. */
+    uint64_t GetDroppedCount() const { return this->dropped.load(std::memory_order_relaxed); }
+
+  private:
+
+    static void* ListenerEntryPoint(void *beat_trigger);
+
+    /** Parses a packet and queues the beats in it. */
+    void HandlePacket(const char *packet, const size_t len, const int64_t received_usec);
+    void Push(const char beat_char, const int64_t received_usec);
+
+    intptr_t socket_fd = -1;
+    pthread_t listener_thread;
+    std::atomic<bool> running{false};
+    // Windows only: whether Start() got Winsock going, and so has to shut it down again.
+    bool winsock_started = false;
+
+    TriggeredBeat beats[kQueueCapacity];
+    std::atomic<unsigned int> head{0};
+    std::atomic<unsigned int> tail{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+#endif // HUES_BEAT_TRIGGER_H_
@@ -0,0 +1,46 @@
+#ifndef HUES_CLOCK_H_
+#define HUES_CLOCK_H_
+
+#include <unistd.h>
+
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * The time source the beat logic runs against. By default this is the real monotonic clock;
+ * simulations swap in a VirtualClock so that hours of playback take seconds.
+ */
+class Clock {
+  DISALLOW_COPY_AND_ASSIGN(Clock)
+
+  public:
+
+    Clock() {}
+    virtual ~Clock() {}
+
+    /** Returns the current time, in microseconds. Only differences are meaningful. */
+    virtual int64_t NowUsec() const { return MonotonicTimeUsec(); }
+
+    /** Waits for (at least) the given amount of time. */
+    virtual void SleepUsec(const int64_t usec) { usleep(usec); }
+};
+
+/** A clock that only moves when someone sleeps on it, and then instantly. */
+class VirtualClock : public Clock {
+  DISALLOW_COPY_AND_ASSIGN(VirtualClock)
+
+  public:
+
+    VirtualClock() {}
+    ~VirtualClock() {}
+
+    int64_t NowUsec() const override { return this->now_usec; }
+    void SleepUsec(const int64_t usec) override { this->now_usec += usec; }
+
+  private:
+
+    int64_t now_usec = 0;
+};
+
+#endif // HUES_CLOCK_H_
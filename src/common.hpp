@@ -3,6 +3,7 @@
 
 #include <time.h>
 
+#include <cstdint>
 #include <iostream>
 
 #include <config.h>
@@ -27,6 +28,13 @@
 #define DEBUG(message) {}
 #endif // DEBUG
 
+// Microseconds on the monotonic clock. Unlike clock(), this keeps ticking while we sleep.
+inline int64_t MonotonicTimeUsec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000 * 1000 + now.tv_nsec / 1000;
+}
+
 inline std::string __transform_pretty_function(const std::string& fn) {
   size_t colons = fn.find("::");
   size_t begin = fn.substr(0, colons).rfind(" ") + 1;
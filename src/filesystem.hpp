@@ -26,6 +26,29 @@ namespace FileSystem {
     return stat(filename.c_str(), &buf) != -1;
   }
 
+  /**
+   * Creates a directory, along with any parents it's missing.
+   *
+   * @return <code>true</code> if the directory exists now, <code>false</code> otherwise.
+   */
+  inline bool MakeDirectories(const string& path) {
+    for (size_t slash = path.find_first_of("/\\", 1); ;
+        slash = path.find_first_of("/\\", slash + 1)) {
+      string prefix = path.substr(0, slash);
+      if (!Exists(prefix)) {
+#ifdef WIN32
+        CreateDirectoryA(prefix.c_str(), NULL);
+#else
+        mkdir(prefix.c_str(), 0755);
+#endif
+      }
+      if (slash == string::npos) {
+        break;
+      }
+    }
+    return Exists(path);
+  }
+
   inline void ListDirectory(const string& dir_name, vector<string>* const dir_list) {
 #ifdef WIN32
     // TODO(nolm): implement me.
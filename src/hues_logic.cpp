@@ -1,11 +1,63 @@
 #include <assert.h>
-#include <unistd.h>
+#include <signal.h>
 
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <unordered_map>
 #include <vector>
 
 #include <filesystem.hpp>
 #include <hues_logic.hpp>
+#include <simulation.hpp>
+
+/** How often the audio stats get dumped to the log. */
+static const int64_t kStatsDumpIntervalUsec = 60 * 1000 * 1000;
+
+/** How often the spectrum analyzer runs; about once per frame at 60fps. */
+static const int64_t kSpectrumIntervalUsec = 1000 * 1000 / 60;
+
+/** How long Idle() sleeps for. */
+static const int64_t kIdleSleepUsec = 100;
+
+/** How long a replay waits before its first beat, for the renderer to settle. */
+static const int64_t kReplayLeadInUsec = 1000 * 1000;
+
+/** How long the first song waits for its first beats' images, before starting without them. */
+static const int64_t kPrefetchTimeoutUsec = 2 * 1000 * 1000;
+
+/** A beat drawn more than a frame after it was due counts as late. */
+static const int64_t kLateBeatUsec = 1000 * 1000 / 60;
+
+/** Songs get normalized towards this RMS level, in dBFS... */
+static const float kTargetLoudnessDb = -14.f;
+/** ...but never by more than this much either way. Peaks are taken care of by the limiter. */
+static const float kMaxNormalizationDb = 12.f;
+
+/** Returns the gain that brings a song's loop to the target loudness. */
+static float GetNormalizationGain(const AudioResource& song) {
+  float loudness = OutputStage::MeasureLoudnessDb(
+      reinterpret_cast<const int16_t*>(song.GetPcmData(AudioResource::Type::LOOP)),
+      song.GetPcmDataSize(AudioResource::Type::LOOP) / sizeof(int16_t));
+  float gain_db = min(max(kTargetLoudnessDb - loudness, -kMaxNormalizationDb), kMaxNormalizationDb);
+
+  LOG("Song loudness: [" + to_string(loudness) + "] dBFS, normalizing by ["
+      + to_string(gain_db) + "] dB.");
+  return pow(10.f, gain_db / 20.f);
+}
+
+static volatile sig_atomic_t stats_dump_requested = 0;
+static volatile sig_atomic_t shutdown_requested = 0;
+
+#ifdef SIGUSR1
+static void HandleStatsDumpSignal(int ignored) {
+  stats_dump_requested = 1;
+}
+#endif
+
+static void HandleShutdownSignal(int ignored) {
+  shutdown_requested = 1;
+}
 
 bool HuesLogic::TryLoadRespack(const string& respack_path) {
   if (FileSystem::Exists(respack_path)) {
@@ -30,90 +82,531 @@ bool HuesLogic::TryLoadRespack() {
 
 void HuesLogic::InitDisplay() {
   this->v = new VideoRenderer();
+  this->v->SetLegacyGl(this->legacy_gl);
+  this->v->SetTextureBudget(this->texture_budget);
   pthread_create(&this->v_thread, NULL, HuesLogic::VideoRendererEntryPoint, this);
   this->v->WaitForTextureLoad();
 }
 
 void HuesLogic::PlaySong(const string& song_title) {
-  vector<AudioResource*> song_list;
-  this->respack->GetAllSongs(song_list);
-
   this->a = new AudioRenderer();
+  this->a->SetThreadPolicy(this->audio_thread_policy);
   this->a->Init(2, 44100);
+  this->a->SetTempo(this->tempo);
+  this->a->SetVolume(this->volume);
+  Realtime::ApplyThreadPolicy("logic", this->logic_thread_policy);
+
+#ifdef SIGUSR1
+  // `kill -USR1` dumps the audio stats on demand.
+  signal(SIGUSR1, HandleStatsDumpSignal);
+#endif
+  // Report the beat trace before going down.
+  signal(SIGINT, HandleShutdownSignal);
+  signal(SIGTERM, HandleShutdownSignal);
+  this->next_stats_dump_usec = this->clock->NowUsec() + kStatsDumpIntervalUsec;
+
+  this->spectrum = new SpectrumAnalyzer(44100);
+  this->v->SetSpectrumAnalyzer(this->spectrum);
+  this->v->SetBeatTrace(&this->beat_trace);
+
+  LOG("Random seed: [" + to_string(this->seed) + "].");
+  if (!this->record_path.empty() && this->recorder.Open(this->record_path, this->seed)) {
+    this->session_start_usec = this->clock->NowUsec();
+  }
 
-  // Worst linear search in the history of ever.
-  AudioResource *song = NULL;
-  for (auto le_song : song_list) {
-    if (le_song->GetTitle() == song_title) {
-      song = le_song;
+  if (this->trigger_port) {
+    this->trigger = new BeatTrigger();
+    if (!this->trigger->Start(this->trigger_port)) {
+      delete this->trigger;
+      this->trigger = NULL;
     }
   }
+
+  AudioResource *song = this->respack->GetSongByTitle(song_title);
   if (!song) {
-    ERR("Respack didn't contain requested song [" + song_title + "]!");
+    vector<AudioResource*> matches;
+    if (!this->respack->FindSongs(song_title, matches, 1)) {
+      ERR("Respack didn't contain requested song [" + song_title + "]!");
+      this->Shutdown();
+      return;
+    }
+    song = matches[0];
+    LOG("No song titled [" + song_title + "], playing [" + song->GetTitle() + "] instead.");
+  }
+
+  this->DecodeSong(song);
+
+  // Hold the song until the renderer has the first beats' images in: otherwise the first image
+  // change is always late. Until then, guess that it starts when we'd give up waiting, so that
+  // the images count as due no sooner than they can be.
+  this->StartLookahead(*song);
+  int64_t guessed_start_usec = this->clock->NowUsec() + kPrefetchTimeoutUsec;
+  this->resolve_start_usec = guessed_start_usec;
+  this->ResolveUpcomingBeats();
+  if (!this->WaitForUpcomingImages()) {
+    this->Shutdown();
+    return;
+  }
+  this->resolve_start_usec += this->clock->NowUsec() - guessed_start_usec;
+  this->QueueSong(song);
+
+  LOG("Measured audio output latency: [" + to_string(this->a->GetOutputLatencyUsec())
+      + "] usec, video latency: [" + to_string(this->video_latency_usec) + "] usec.");
+
+  // Only returns once we're asked to stop.
+  this->AnimateSong(*song, 0);
+  this->Shutdown();
+}
+
+void HuesLogic::Simulate(const int loops_per_song) {
+  VirtualClock virtual_clock;
+  NullVideoRenderer video;
+  SpectrumAnalyzer spectrum(44100);
+  this->clock = &virtual_clock;
+  this->v = &video;
+  this->spectrum = &spectrum;
+  this->next_stats_dump_usec = this->clock->NowUsec() + kStatsDumpIntervalUsec;
+
+  vector<AudioResource*> song_list;
+  this->respack->GetAllSongs(song_list);
+
+  uint64_t allocations = 0;
+  uint64_t beat_mismatches = 0;
+  int64_t animate_usec = 0;
+
+  for (AudioResource *song : song_list) {
+    NullAudioRenderer audio(this->clock);
+    audio.Init(2, 44100);
+    audio.SetTempo(this->tempo);
+    this->a = &audio;
+    this->StartLookahead(*song);
+    this->DecodeSong(song);
+    this->QueueSong(song);
+
+    // Decoding is slow and allocates, so only time and count the animation itself.
+    uint64_t beats_before = this->beat_count;
+    uint64_t allocations_before = Simulation::GetAllocationCount();
+    int64_t start_usec = MonotonicTimeUsec();
+
+    this->AnimateSong(*song, loops_per_song);
+
+    animate_usec += MonotonicTimeUsec() - start_usec;
+    allocations += Simulation::GetAllocationCount() - allocations_before;
+
+    uint64_t expected_beats = loops_per_song
+        * song->GetTimeline(AudioResource::Type::LOOP).GetBeatCount();
+    if (song->HasBuildup()) {
+      expected_beats += song->GetTimeline(AudioResource::Type::BUILDUP).GetBeatCount();
+    }
+    if (this->beat_count - beats_before != expected_beats) {
+      ERR("Song [" + song->GetTitle() + "] animated [" + to_string(this->beat_count - beats_before)
+          + "] beats, expected [" + to_string(expected_beats) + "].");
+      beat_mismatches++;
+    }
+
+    this->a = NULL;
+    this->playing_song = NULL;
+  }
+
+  uint64_t anomalies = video.GetAnomalies() + beat_mismatches + this->late_beat_count
+      + this->skipped_loop_count;
+  LOG("Simulated [" + to_string(song_list.size()) + "] songs, ["
+      + to_string(virtual_clock.NowUsec() / 1000 / 1000) + "] seconds of playback in ["
+      + to_string(animate_usec / 1000) + "] msec.");
+  LOG("Beats: [" + to_string(this->beat_count) + "], ["
+      + to_string(animate_usec ? this->beat_count * 1000 * 1000 / animate_usec : 0)
+      + "] per second. Image changes: [" + to_string(video.GetImageChanges())
+      + "], color changes: [" + to_string(video.GetColorChanges()) + "].");
+  LOG("Allocations while animating: ["
+      + (Simulation::kCountsAllocations ? to_string(allocations) : "not counted in this build")
+      + "]. Max beat lateness: ["
+      + to_string(this->max_beat_lateness_usec) + "] usec.");
+  LOG("Anomalies: [" + to_string(anomalies) + "] (late beats: [" + to_string(this->late_beat_count)
+      + "], skipped loops: [" + to_string(this->skipped_loop_count) + "], beat count mismatches: ["
+      + to_string(beat_mismatches) + "], bad renderer calls: [" + to_string(video.GetAnomalies())
+      + "]).");
+  this->beat_trace.Dump();
+
+  this->clock = &this->real_clock;
+  this->v = NULL;
+  this->spectrum = NULL;
+}
+
+void HuesLogic::Replay(const string& session_path) {
+  SessionReader reader;
+  if (!reader.Open(session_path)) {
+    this->StopRenderer();
     return;
   }
-  song->ReadAndDecode(AudioResource::Type::LOOP);
 
+  vector<ImageResource*> images;
+  this->respack->GetAllImages(images);
+  unordered_map<string, ImageResource*> images_by_name;
+  for (ImageResource *image : images) {
+    images_by_name[image->GetName()] = image;
+  }
+
+  // Resolve everything up front so that replaying is as cheap as playing live.
+  vector<BeatEvent> beats;
+  vector<int64_t> offsets_usec;
+  SessionRecord record;
+  while (reader.Read(&record)) {
+    BeatEvent beat;
+    beat.sequence = beats.size();
+    beat.song = record.song_title.empty() ? NULL : this->respack->GetSongByTitle(record.song_title);
+    beat.type = record.type;
+    beat.beat = record.beat;
+    beat.transition = record.transition;
+    beat.actions = record.actions;
+    beat.image = NULL;
+    beat.color_index = record.color_index;
+    if (!record.image_name.empty()) {
+      auto it = images_by_name.find(record.image_name);
+      beat.image = it != images_by_name.end() ? it->second : NULL;
+    }
+    if ((!record.song_title.empty() && !beat.song)
+        || (!record.image_name.empty() && !beat.image)) {
+      ERR("Session was recorded with a different respack: no [" + record.song_title + "] or ["
+          + record.image_name + "].");
+      this->StopRenderer();
+      return;
+    }
+    beats.push_back(beat);
+    offsets_usec.push_back(record.offset_usec);
+  }
+
+  LOG("Replaying [" + to_string(beats.size()) + "] beats, recorded with seed ["
+      + to_string(reader.GetSeed()) + "].");
+  this->v->SetBeatTrace(&this->beat_trace);
+
+  const int64_t start_usec = this->clock->NowUsec() + kReplayLeadInUsec;
+  size_t queued = 0;
+  for (size_t i = 0; i < beats.size(); i++) {
+    // Tell the renderer what's coming, the same distance ahead as when playing live.
+    for (; queued < beats.size() && queued < i + kLookaheadBeats; queued++) {
+      beats[queued].due_usec = start_usec + offsets_usec[queued];
+      this->v->QueueUpcomingBeat(beats[queued]);
+    }
+
+    while (this->clock->NowUsec() < beats[i].due_usec) {
+      this->clock->SleepUsec(kIdleSleepUsec);
+    }
+
+    int64_t lateness_usec = this->clock->NowUsec() - beats[i].due_usec;
+    this->max_beat_lateness_usec = max(this->max_beat_lateness_usec, lateness_usec);
+    this->late_beat_count += lateness_usec > kLateBeatUsec ? 1 : 0;
+    this->beat_count++;
+    this->ApplyBeat(beats[i], beats[i].due_usec);
+  }
+
+  LOG("Replayed [" + to_string(this->beat_count) + "] beats in ["
+      + to_string((this->clock->NowUsec() - start_usec) / 1000) + "] msec. Late: ["
+      + to_string(this->late_beat_count) + "], max lateness: ["
+      + to_string(this->max_beat_lateness_usec) + "] usec.");
+  this->beat_trace.Dump();
+  this->StopRenderer();
+}
+
+void HuesLogic::DecodeSong(AudioResource *song) {
+  song->SetTempo(this->tempo);
+  song->ReadAndDecode(AudioResource::Type::LOOP);
   if (song->HasBuildup()) {
     song->ReadAndDecode(AudioResource::Type::BUILDUP);
-    this->SongLoop(*song, AudioResource::Type::BUILDUP);
+  }
+  if (this->normalize) {
+    this->a->SetSongGain(GetNormalizationGain(*song));
   }
 
-  for (;;) {
-    this->SongLoop(*song, AudioResource::Type::LOOP);
+  if (this->lock_memory) {
+    Realtime::LockMemory(song->GetPcmData(AudioResource::Type::LOOP),
+        song->GetPcmDataSize(AudioResource::Type::LOOP));
+    if (song->HasBuildup()) {
+      Realtime::LockMemory(song->GetPcmData(AudioResource::Type::BUILDUP),
+          song->GetPcmDataSize(AudioResource::Type::BUILDUP));
+    }
   }
 }
 
-void HuesLogic::SongLoop(const AudioResource& song, const AudioResource::Type song_type) {
-  const string beatmap = song.GetBeatmap(song_type).empty() ? "." : song.GetBeatmap(song_type);
-  const int beat_count = !beatmap.length() ? 1 : beatmap.length();
-  const double beat_length_usec = song.GetBeatDurationUsec(song_type);
-  const double song_length_usec = song.GetSongDurationUsec(song_type);
+void HuesLogic::QueueSong(AudioResource *song) {
+  // Queue up everything at once; the audio thread loops the song by itself.
+  this->buildup_segment = 0;
+  if (song->HasBuildup()) {
+    this->buildup_segment = this->a->PlayAudio(song->GetPcmData(AudioResource::Type::BUILDUP),
+        song->GetPcmDataSize(AudioResource::Type::BUILDUP));
+  }
+  size_t loop_size = song->GetPcmDataSize(AudioResource::Type::LOOP);
+  this->a->PlayLoop(song->GetPcmData(AudioResource::Type::LOOP), loop_size, 0, loop_size);
+}
 
-  // Wait until the previous song has actually ended.
-  while (clock() < this->next_song_ok) {
-      usleep(100);
+bool HuesLogic::WaitForUpcomingImages() {
+  int64_t give_up_usec = this->clock->NowUsec() + kPrefetchTimeoutUsec;
+  while (!this->v->HasLoadedUpcomingImages(this->beats_resolved)) {
+    if (this->clock->NowUsec() >= give_up_usec) {
+      LOG("Starting before the first images are loaded.");
+      return true;
+    }
+    if (!this->Idle()) {
+      return false;
+    }
   }
-  this->next_song_ok =
-      (clock_t) ((((double) clock()) / CLOCKS_PER_SEC + (song_length_usec / 1000. / 1000.))
-          * CLOCKS_PER_SEC);
+  return true;
+}
+
+void HuesLogic::AnimateSong(const AudioResource& song, const int loop_count) {
+  if (song.HasBuildup()) {
+    // Wait for the audio thread to get to the buildup, past whatever the last song left playing,
+    // then time its beats from where the buildup starts, like the loop's below.
+    while (this->buildup_segment && this->a->GetSegmentCount() < this->buildup_segment) {
+      if (!this->Idle()) {
+        return;
+      }
+    }
+    this->SongLoop(song, AudioResource::Type::BUILDUP,
+        this->clock->NowUsec() + this->a->GetSegmentStartDelayUsec() - this->video_latency_usec);
+  }
+
+  uint64_t loops_seen = 0;
+  for (int loop = 0; !this->stopping && (!loop_count || loop < loop_count); loop++) {
+    // Wait for the audio thread to wrap around to the next iteration. If we fell behind, skip ahead
+    // to the current iteration instead of drifting.
+    while (this->a->GetLoopCount() <= loops_seen) {
+      if (!this->Idle()) {
+        return;
+      }
+    }
+    this->skipped_loop_count += this->a->GetLoopCount() - loops_seen - 1;
+    loops_seen = this->a->GetLoopCount();
+
+    // The audio thread reads ahead of the speakers, and the display lags behind us too; shift the
+    // beats so that they show up on screen when they're heard.
+    this->SongLoop(song, AudioResource::Type::LOOP,
+        this->clock->NowUsec() + this->a->GetLoopStartDelayUsec() - this->video_latency_usec);
+  }
+}
+
+void HuesLogic::SongLoop(const AudioResource& song, const AudioResource::Type song_type,
+    const int64_t start_usec) {
+  const BeatTimeline& timeline = song.GetTimeline(song_type);
+  const size_t beat_count = timeline.GetBeatCount();
+  const double usec_per_frame = this->GetUsecPerFrame(song, song_type);
 
   assert(song.GetChannelCount(song_type) == 2);
   assert(song.GetSampleRate(song_type) == 44100);
-  a->PlayAudio(song.GetPcmData(song_type), song.GetPcmDataSize(song_type));
 
-  for (int cur_beat = 0; cur_beat < beat_count ; cur_beat++) {
-    AudioResource::Beat beat_type = AudioResource::ParseBeatCharacter(beatmap.at(cur_beat));
+  this->playing_song = &song;
+  this->playing_type = song_type;
+  this->playing_start_usec = start_usec;
+
+  for (size_t cur_beat = 0; cur_beat < beat_count; cur_beat++) {
+    this->ResolveUpcomingBeats();
+    const BeatEvent& beat = this->lookahead[this->beats_applied % kLookaheadBeats];
+    assert(beat.song == &song && beat.type == song_type && beat.beat == cur_beat);
 
-    // Wait until the previous beat has ended.
-    while (clock() < this->next_beat_ok) {
-      usleep(100);
+    // Wait until this beat is due. Beats are timed from the start of the song rather than from
+    // each other so that scheduling hiccups don't accumulate.
+    const int64_t beat_usec =
+        start_usec + (int64_t) (timeline.GetFrameOffset(cur_beat) * usec_per_frame);
+    while (this->clock->NowUsec() < beat_usec) {
+      if (!this->Idle()) {
+        return;
+      }
     }
 
-    switch (beat_type) {
-      case AudioResource::Beat::NO_TRANSITION: break;
-      case AudioResource::Beat::IMAGE_ONLY:
-        this->v->SetImage(AudioResource::Beat::IMAGE_ONLY);
-        break;
-      case AudioResource::Beat::COLOR_ONLY:
-        this->v->SetColor();
-        break;
-      default:
-        this->v->SetColor();
-        this->v->SetImage(beat_type);
-        break;
+    int64_t lateness_usec = this->clock->NowUsec() - beat_usec;
+    this->max_beat_lateness_usec = max(this->max_beat_lateness_usec, lateness_usec);
+    this->late_beat_count += lateness_usec > kLateBeatUsec ? 1 : 0;
+    this->beat_count++;
+
+    this->ApplyBeat(beat, beat_usec);
+    this->beats_applied++;
+  }
+}
+
+double HuesLogic::GetUsecPerFrame(const AudioResource& song,
+    const AudioResource::Type song_type) const {
+  return 1000. * 1000.
+      / (song.GetSampleRate(song_type) * song.GetTempo() * this->a->GetClock().GetRate());
+}
+
+void HuesLogic::PickImageAndColor(BeatEvent *beat) {
+  beat->image = (beat->actions & BeatTimeline::kChangeImage) && !this->image_list.empty()
+      ? this->image_list[this->random.Uniform(this->image_list.size())] : NULL;
+  beat->color_index =
+      (beat->actions & BeatTimeline::kChangeColor) ? this->random.Uniform(0x40) : -1;
+}
+
+void HuesLogic::ApplyBeat(const BeatEvent& beat, const int64_t due_usec) {
+  // The lookahead only guessed when the beat would be due; by now we know.
+  BeatEvent due_beat = beat;
+  due_beat.due_usec = due_usec;
+  this->v->ApplyBeat(due_beat);
+  if (!beat.actions) {
+    return;
+  }
+
+  int64_t now_usec = this->clock->NowUsec();
+  this->beat_trace.RecordBeat(beat.song, due_usec, now_usec);
+  if (this->recorder.IsOpen()) {
+    // When it was due rather than applied, so that replays aren't late by however late we were.
+    this->recorder.Record(beat, due_usec - this->session_start_usec);
+  }
+}
+
+void HuesLogic::ApplyTriggeredBeats() {
+  TriggeredBeat triggered;
+  while (this->trigger && this->trigger->Poll(&triggered)) {
+    BeatEvent beat;
+    beat.sequence = 0;
+    beat.song = NULL;
+    beat.type = AudioResource::Type::LOOP;
+    beat.beat = 0;
+    beat.transition = BeatTimeline::ParseBeatCharacter(triggered.beat_char);
+    beat.actions = BeatTimeline::GetActionsForBeat(beat.transition);
+    beat.due_usec = triggered.received_usec;
+    this->PickImageAndColor(&beat);
+
+    this->ApplyBeat(beat, triggered.received_usec);
+    this->triggered_beat_count++;
+  }
+}
+
+void HuesLogic::StartLookahead(const AudioResource& song) {
+  this->image_list.clear();
+  this->respack->GetAllImages(this->image_list);
+
+  // Whatever was resolved for the last song has already been announced, but will never be due.
+  this->beats_applied = this->beats_resolved;
+  this->resolve_song = &song;
+  this->resolve_type = song.HasBuildup() ? AudioResource::Type::BUILDUP : AudioResource::Type::LOOP;
+  this->resolve_beat = 0;
+  this->resolve_start_usec = this->clock->NowUsec();
+}
+
+void HuesLogic::ResolveUpcomingBeats() {
+  while (this->beats_resolved - this->beats_applied < kLookaheadBeats) {
+    const AudioResource& song = *this->resolve_song;
+    const BeatTimeline& timeline = song.GetTimeline(this->resolve_type);
+    const double usec_per_frame = this->GetUsecPerFrame(song, this->resolve_type);
+
+    BeatEvent& beat = this->lookahead[this->beats_resolved % kLookaheadBeats];
+    beat.sequence = this->beats_resolved;
+    beat.song = &song;
+    beat.type = this->resolve_type;
+    beat.beat = this->resolve_beat;
+    beat.transition = timeline.GetBeat(this->resolve_beat);
+    beat.actions = timeline.GetActions(this->resolve_beat);
+    this->PickImageAndColor(&beat);
+    beat.due_usec = this->resolve_start_usec
+        + (int64_t) (timeline.GetFrameOffset(this->resolve_beat) * usec_per_frame);
+
+    // If the renderer is that far behind, it'll just have to cope when the beat is due.
+    this->v->QueueUpcomingBeat(beat);
+    this->beats_resolved++;
+
+    // After the buildup comes the loop, forever. It starts when the audio gets there, at the same
+    // rate as the beats' offsets, not at the nominal duration.
+    if (++this->resolve_beat == timeline.GetBeatCount()) {
+      this->resolve_start_usec +=
+          (int64_t) (song.GetFrameCount(this->resolve_type) * usec_per_frame);
+      this->resolve_type = AudioResource::Type::LOOP;
+      this->resolve_beat = 0;
     }
+  }
+}
+
+bool HuesLogic::Idle() {
+  if (shutdown_requested || this->v->HasStopped()) {
+    this->stopping = true;
+    return false;
+  }
+  this->ApplyTriggeredBeats();
+  this->AnalyzeSpectrumIfDue();
+  this->DumpStatsIfDue();
+  this->clock->SleepUsec(kIdleSleepUsec);
+  return true;
+}
+
+void HuesLogic::AnalyzeSpectrumIfDue() {
+  int64_t now = this->clock->NowUsec();
+  if (!this->playing_song || now < this->next_spectrum_usec) {
+    return;
+  }
+  this->next_spectrum_usec = now + kSpectrumIntervalUsec;
+
+  // Analyze what's on screen when this frame is: the beats are already shifted for latency.
+  const AudioResource& song = *this->playing_song;
+  int64_t elapsed_usec = max<int64_t>(now - this->playing_start_usec, 0);
+  size_t position = (size_t) (elapsed_usec / this->GetUsecPerFrame(song, this->playing_type));
+  size_t frame_count = song.GetPcmDataSize(this->playing_type)
+      / (song.GetChannelCount(this->playing_type) * /* bytes per sample */ 2);
 
-    this->next_beat_ok =
-        (clock_t) ((((double) clock()) / CLOCKS_PER_SEC + (beat_length_usec / 1000. / 1000.))
-            * CLOCKS_PER_SEC);
+  this->spectrum->Analyze(reinterpret_cast<const int16_t*>(song.GetPcmData(this->playing_type)),
+      frame_count, position);
+}
+
+void HuesLogic::DumpStatsIfDue() {
+  if (!stats_dump_requested && this->clock->NowUsec() < this->next_stats_dump_usec) {
+    return;
+  }
+
+  bool requested = stats_dump_requested;
+  stats_dump_requested = 0;
+  this->next_stats_dump_usec = this->clock->NowUsec() + kStatsDumpIntervalUsec;
+
+  this->a->GetStats().Dump();
+  this->a->GetClock().Dump();
+  this->v->DumpFrameStats();
+  LOG("Beats: [" + to_string(this->beat_count) + "], late: [" + to_string(this->late_beat_count)
+      + "], max lateness: [" + to_string(this->max_beat_lateness_usec) + "] usec, skipped loops: ["
+      + to_string(this->skipped_loop_count) + "].");
+  if (this->trigger) {
+    LOG("Triggered beats: [" + to_string(this->triggered_beat_count) + "], dropped: ["
+        + to_string(this->trigger->GetDroppedCount()) + "].");
+  }
+  LOG("Spectrum: [" + to_string(this->spectrum->GetAnalyzeCount()) + "] frames analyzed, avg ["
+      + to_string(this->spectrum->GetAverageAnalyzeUsec()) + "] usec, max ["
+      + to_string(this->spectrum->GetMaxAnalyzeUsec()) + "] usec.");
+
+  // Sorting the trace takes a moment, so only do it when asked.
+  if (requested) {
+    this->beat_trace.Dump();
   }
 }
 
+void HuesLogic::Shutdown() {
+  LOG("Shutting down.");
+  stats_dump_requested = 1;
+  this->DumpStatsIfDue();
+  this->recorder.Close();
+
+  // From the outside in: no more beats from the network, then no more audio, then no more video,
+  // which takes the image decoders down with it. The analyzer goes once nothing draws from it.
+  delete this->trigger;
+  this->trigger = NULL;
+  delete this->a;
+  this->a = NULL;
+  if (this->StopRenderer()) {
+    delete this->spectrum;
+    this->spectrum = NULL;
+  }
+}
+
+bool HuesLogic::StopRenderer() {
+  if (!this->v->Stop()) {
+    return false;
+  }
+  pthread_join(this->v_thread, NULL);
+  delete this->v;
+  this->v = NULL;
+  return true;
+}
+
 void* HuesLogic::VideoRendererEntryPoint(void* hueslogic) {
   HuesLogic *_this = static_cast<HuesLogic*>(hueslogic);
   const char* fake_argv[] { "0x40hues" };
 
+  Realtime::ApplyThreadPolicy("render", _this->render_thread_policy);
+
   _this->v->Init(1, const_cast<char**>(fake_argv));
   _this->v->LoadTextures(*_this->respack);
   _this->v->DoGlutLoop();
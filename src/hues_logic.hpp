@@ -1,11 +1,17 @@
 #ifndef HUES_HUES_LOGIC_H_
 #define HUES_HUES_LOGIC_H_
 
-#include <ctime>
-
 #include <audio_renderer.hpp>
+#include <beat_events.hpp>
+#include <beat_trigger.hpp>
+#include <beat_trace.hpp>
+#include <clock.hpp>
 #include <common.hpp>
+#include <random.hpp>
+#include <realtime.hpp>
 #include <respack.hpp>
+#include <session_log.hpp>
+#include <spectrum_analyzer.hpp>
 #include <video_renderer.hpp>
 
 class HuesLogic {
@@ -32,30 +38,259 @@ class HuesLogic {
     void InitDisplay();
 
     /**
-     * Plays the given song. This method never returns. Unless the song name is invalid.
+     * Plays the given song, until SIGINT or SIGTERM or the window closes. Then dumps the stats and
+     * shuts everything down before returning.
      *
      * @param song_list the _title_ of the song to play.
      */
     void PlaySong(const string& song_title);
 
+    /**
+     * Plays every song in the respack headlessly, against a virtual clock and renderers that do
+     * nothing, as fast as possible. Logs throughput, allocations and anything that looks wrong.
+     * Must not be combined with InitDisplay() or PlaySong().
+     *
+     * @param loops_per_song how many times to play each song's loop, after its buildup.
+     */
+    void Simulate(const int loops_per_song);
+
+    /**
+     * Replays a session recorded with SetRecordPath(): applies the exact same beats to the video
+     * renderer at the same times, with no audio, then logs how late they were and stops the
+     * renderer. Useful to compare renderer changes against an identical workload. Must be called
+     * after InitDisplay().
+     *
+     * @param session_path the session log to replay.
+     */
+    void Replay(const string& session_path);
+
+    /** Sets the seed for every image and color we pick, so that a run can be repeated. */
+    void SetSeed(const uint64_t seed) {
+      this->seed = seed;
+      this->random.Seed(seed);
+    }
+
+    /**
+     * Records every visible beat PlaySong() applies to a session log, for Replay().
+     *
+     * @param path where to write the log, or empty not to record.
+     */
+    void SetRecordPath(const string& path) { this->record_path = path; }
+
+    /**
+     * Sets how long the display takes to show a frame after we draw it (compositor, scaler, TV
+     * post-processing, ...). Beats are drawn this much earlier to land on time.
+     *
+     * @param latency_usec the video output latency, in microseconds.
+     */
+    void SetVideoLatencyUsec(const int64_t latency_usec) {
+      this->video_latency_usec = latency_usec;
+    }
+
+    /**
+     * Sets the scheduling policies for our timing-sensitive threads. Must be called before
+     * InitDisplay().
+     *
+     * @param audio the policy for the audio device thread.
+     * @param logic the policy for the beat scheduling thread (the one calling PlaySong()).
+     * @param render the policy for the video rendering thread.
+     */
+    void SetThreadPolicies(const ThreadPolicy& audio, const ThreadPolicy& logic,
+        const ThreadPolicy& render) {
+      this->audio_thread_policy = audio;
+      this->logic_thread_policy = logic;
+      this->render_thread_policy = render;
+    }
+
+    /**
+     * Sets the speed songs are played at, without changing their pitch. Beats follow along.
+     *
+     * @param tempo the playback speed: 1.05 plays 5% faster.
+     */
+    void SetTempo(const float tempo) { this->tempo = tempo; }
+
+    /**
+     * Sets the master volume.
+     *
+     * @param volume the linear gain: 0.5 is half as loud.
+     */
+    void SetVolume(const float volume) { this->volume = volume; }
+
+    /** Sets whether songs get their gain adjusted so they all play at about the same loudness. */
+    void SetNormalize(const bool normalize) { this->normalize = normalize; }
+
+    /**
+     * Sets the local UDP port to take beats from, for live shows. See BeatTrigger.
+     *
+     * @param port the port to listen on, or 0 not to listen.
+     */
+    void SetTriggerPort(const int port) { this->trigger_port = port; }
+
+    /** Sets whether to draw without a GL 3.3 core profile. Must be called before InitDisplay(). */
+    void SetLegacyGl(const bool legacy_gl) { this->legacy_gl = legacy_gl; }
+
+    /**
+     * Sets how much texture memory images may take up, in bytes, or 0 for no limit. Must be called
+     * before InitDisplay().
+     */
+    void SetTextureBudget(const size_t texture_budget) { this->texture_budget = texture_budget; }
+
+    /** Sets whether decoded songs get locked into RAM, so playing them can't page fault. */
+    void SetLockMemory(const bool lock_memory) { this->lock_memory = lock_memory; }
+
   private:
 
     bool TryLoadRespack(const string& respack_path);
 
+    /** Decodes a song, ready to be queued. */
+    void DecodeSong(AudioResource *song);
+
+    /** Queues up a decoded song on the audio renderer: the buildup, then the loop. */
+    void QueueSong(AudioResource *song);
+
+    /**
+     * Waits for the renderer to load the images of every beat resolved so far, or for a couple of
+     * seconds at most.
+     *
+     * @return <code>false</code> once we've been asked to stop, <code>true</code> otherwise.
+     */
+    bool WaitForUpcomingImages();
+
+    /**
+     * Animates a queued song, following along with the audio renderer. The lookahead must have
+     * been started on the song.
+     *
+     * @param loop_count how many loop iterations to animate before returning; 0 for forever.
+     */
+    void AnimateSong(const AudioResource& song, const int loop_count);
+
+    /**
+     * Animate one iteration of the current song. The audio itself is queued (and looped) by
+     * PlaySong().
+     *
+     * @param start_usec the monotonic time at which the first beat should be drawn.
+     */
+    void SongLoop(const AudioResource& song, const AudioResource::Type song_type,
+        const int64_t start_usec);
+
     /**
-     * Play and animate one iteration of the current song, blocking to ensure the previous song has
-     * played completely.
+     * Returns how long a frame of the song takes to play on our clock: at the song's tempo, and at
+     * the rate the audio device really plays at.
      */
-    void SongLoop(const AudioResource& song, const AudioResource::Type song_type);
+    double GetUsecPerFrame(const AudioResource& song, const AudioResource::Type song_type) const;
+
+    /** Picks the image and color for a beat, for whichever of them it changes. */
+    void PickImageAndColor(BeatEvent *beat);
+
+    /**
+     * Hands a beat to the renderer, and traces (and maybe records) it if it's visible. Its
+     * transition is animated from when it was due, however late it's applied.
+     *
+     * @param due_usec when the beat should have been applied, on our clock.
+     */
+    void ApplyBeat(const BeatEvent& beat, const int64_t due_usec);
+
+    /** Draws any beats fired from outside since the last call. */
+    void ApplyTriggeredBeats();
+
+    /** Points the beat resolver at the start of a song: its buildup if any, then the loop. */
+    void StartLookahead(const AudioResource& song);
+
+    /**
+     * Makes sure the next kLookaheadBeats beats have their image and color picked, and tells the
+     * renderer about any that are new.
+     */
+    void ResolveUpcomingBeats();
+
+    /**
+     * Sleeps briefly while waiting on the audio, doing whatever housekeeping is due.
+     *
+     * @return <code>false</code> once we've been asked to stop, <code>true</code> otherwise.
+     */
+    bool Idle();
+
+    /** Feeds the spectrum analyzer the audio at the current position, about once per frame. */
+    void AnalyzeSpectrumIfDue();
+
+    /**
+     * Dumps the audio stats if it's been a while, or if someone asked with SIGUSR1. The beat trace
+     * is only dumped when asked.
+     */
+    void DumpStatsIfDue();
+
+    /** Dumps all the stats, then stops and frees everything PlaySong() started. */
+    void Shutdown();
+
+    /**
+     * Stops the video renderer and waits for its thread, then frees it.
+     *
+     * @return <code>true</code> if it's gone, <code>false</code> if GLUT wouldn't let it stop.
+     */
+    bool StopRenderer();
 
     static void* VideoRendererEntryPoint(void *_this);
 
-    clock_t next_beat_ok = 0;
-    clock_t next_song_ok = 0;
+    Clock real_clock;
+    Clock *clock = &real_clock;
+
+    int64_t video_latency_usec = 0;
+    int64_t next_stats_dump_usec = 0;
+    int64_t next_spectrum_usec = 0;
+    // Set by Idle() once we've been asked to stop, so that everything waiting on it returns.
+    bool stopping = false;
+
+    // The audio renderer's number for the queued song's buildup, or 0 if it has none.
+    uint64_t buildup_segment = 0;
+
+    // The song iteration currently being animated, and when its first beat is drawn.
+    const AudioResource *playing_song = NULL;
+    AudioResource::Type playing_type = AudioResource::Type::LOOP;
+    int64_t playing_start_usec = 0;
+
+    // Beat scheduling health.
+    uint64_t beat_count = 0;
+    uint64_t late_beat_count = 0;
+    uint64_t skipped_loop_count = 0;
+    int64_t max_beat_lateness_usec = 0;
+    BeatTrace beat_trace;
+
+    // Beats resolved ahead of time; the ones in [beats_applied, beats_resolved) are still to come.
+    static const int kLookaheadBeats = 16;
+    BeatEvent lookahead[kLookaheadBeats];
+    uint64_t beats_resolved = 0;
+    uint64_t beats_applied = 0;
+    vector<ImageResource*> image_list;
+
+    // The next beat to resolve.
+    const AudioResource *resolve_song = NULL;
+    AudioResource::Type resolve_type = AudioResource::Type::LOOP;
+    size_t resolve_beat = 0;
+    int64_t resolve_start_usec = 0;
+
+    uint64_t seed = 0;
+    Random random;
+    string record_path;
+    SessionRecorder recorder;
+    int64_t session_start_usec = 0;
+
+    int trigger_port = 0;
+    BeatTrigger *trigger = NULL;
+    uint64_t triggered_beat_count = 0;
+
+    ThreadPolicy audio_thread_policy;
+    ThreadPolicy logic_thread_policy;
+    ThreadPolicy render_thread_policy;
+    bool lock_memory = false;
+    bool legacy_gl = false;
+    size_t texture_budget = VideoRenderer::kDefaultTextureBudget;
+    float tempo = 1.f;
+    float volume = 1.f;
+    bool normalize = false;
 
     ResourcePack *respack;
-    AudioRenderer *a;
-    VideoRenderer *v;
+    AudioRenderer *a = NULL;
+    VideoRenderer *v = NULL;
+    SpectrumAnalyzer *spectrum = NULL;
     pthread_t v_thread;
 
 };
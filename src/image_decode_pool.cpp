@@ -0,0 +1,174 @@
+#include <thread>
+
+#include <image_decode_pool.hpp>
+
+using namespace std;
+
+/** How many decoded images each worker may have waiting for the consumer. */
+static const size_t kDecodedImagesPerThread = 2;
+
+ImageDecodePool::ImageDecodePool() {
+  pthread_mutex_init(&this->mutex, NULL);
+  pthread_cond_init(&this->requested_cv, NULL);
+  pthread_cond_init(&this->taken_cv, NULL);
+  pthread_cond_init(&this->buffer_cv, NULL);
+}
+
+ImageDecodePool::~ImageDecodePool() {
+  this->Stop();
+
+  pthread_mutex_destroy(&this->mutex);
+  pthread_cond_destroy(&this->requested_cv);
+  pthread_cond_destroy(&this->taken_cv);
+  pthread_cond_destroy(&this->buffer_cv);
+}
+
+void ImageDecodePool::Stop() {
+  pthread_mutex_lock(&this->mutex);
+  // Don't let the workers pick up anything new.
+  this->stopping = true;
+  pthread_cond_broadcast(&this->requested_cv);
+  pthread_cond_broadcast(&this->taken_cv);
+  pthread_cond_broadcast(&this->buffer_cv);
+  pthread_mutex_unlock(&this->mutex);
+
+  for (pthread_t thread : this->threads) {
+    pthread_join(thread, NULL);
+  }
+  this->threads.clear();
+
+  for (DecodedImage& image : this->decoded) {
+    ImageDecodePool::Free(image);
+  }
+  this->decoded.clear();
+}
+
+void ImageDecodePool::Start(const unsigned int thread_count, const size_t buffer_size) {
+  this->buffer_size = buffer_size;
+  unsigned int count = max(1u, thread_count ? thread_count : thread::hardware_concurrency());
+  this->max_decoded = count * kDecodedImagesPerThread;
+
+  this->threads.resize(count);
+  for (pthread_t& thread : this->threads) {
+    pthread_create(&thread, NULL, ImageDecodePool::WorkerEntryPoint, this);
+  }
+}
+
+void ImageDecodePool::Request(const ImageResource *image) {
+  pthread_mutex_lock(&this->mutex);
+  this->pending.push_back(image);
+  pthread_cond_signal(&this->requested_cv);
+  pthread_mutex_unlock(&this->mutex);
+}
+
+void ImageDecodePool::AddBuffer(png_byte *buffer) {
+  pthread_mutex_lock(&this->mutex);
+  this->buffers.push_back(buffer);
+  pthread_cond_signal(&this->buffer_cv);
+  pthread_mutex_unlock(&this->mutex);
+}
+
+bool ImageDecodePool::TryNext(DecodedImage *decoded) {
+  pthread_mutex_lock(&this->mutex);
+  if (this->decoded.empty()) {
+    pthread_mutex_unlock(&this->mutex);
+    return false;
+  }
+  *decoded = this->decoded.front();
+  this->decoded.pop_front();
+  pthread_cond_signal(&this->taken_cv);
+  pthread_mutex_unlock(&this->mutex);
+  return true;
+}
+
+void ImageDecodePool::Free(const DecodedImage& decoded) {
+  if (decoded.mapping.base) {
+    TexelCache::Unmap(decoded.mapping);
+  } else if (!decoded.buffer) {
+    delete[] decoded.bytes;
+  }
+}
+
+void* ImageDecodePool::WorkerEntryPoint(void *pool) {
+  static_cast<ImageDecodePool*>(pool)->Work();
+  return NULL;
+}
+
+void ImageDecodePool::Work() {
+  for (;;) {
+    pthread_mutex_lock(&this->mutex);
+    while (this->pending.empty() && !this->stopping) {
+      pthread_cond_wait(&this->requested_cv, &this->mutex);
+    }
+    if (this->stopping) {
+      pthread_mutex_unlock(&this->mutex);
+      return;
+    }
+    DecodedImage image { this->pending.front(), NULL, NULL, 0, 0, 0, {} };
+    this->pending.pop_front();
+    pthread_mutex_unlock(&this->mutex);
+
+    // Images in the cache are handed over still mapped, and uploaded from there; only the ones
+    // that need decoding take a lent buffer.
+    uint64_t key = 0;
+    bool cacheable = this->texel_cache && this->texel_cache->GetKey(image.image->GetPath(), &key);
+    if (!cacheable || !this->ReadFromCache(key, &image)) {
+      if (this->buffer_size) {
+        pthread_mutex_lock(&this->mutex);
+        while (this->buffers.empty() && !this->stopping) {
+          pthread_cond_wait(&this->buffer_cv, &this->mutex);
+        }
+        if (this->stopping) {
+          pthread_mutex_unlock(&this->mutex);
+          return;
+        }
+        image.buffer = this->buffers.front();
+        this->buffers.pop_front();
+        pthread_mutex_unlock(&this->mutex);
+      }
+      this->Decode(&image, cacheable ? &key : NULL);
+    }
+
+    // Wait for the consumer to catch up before handing over another image.
+    pthread_mutex_lock(&this->mutex);
+    while (this->decoded.size() >= this->max_decoded && !this->stopping) {
+      pthread_cond_wait(&this->taken_cv, &this->mutex);
+    }
+    this->decoded.push_back(image);
+    pthread_mutex_unlock(&this->mutex);
+  }
+}
+
+void ImageDecodePool::Decode(DecodedImage *image, const uint64_t *key) {
+  DEBUG("Decoding [" + image->image->GetName() + "].");
+  image->bytes = image->image->ReadAndDecode(&image->width, &image->height, &image->color_type,
+      image->buffer, this->buffer_size, this->format);
+  if (key && image->bytes && image->color_type == this->GetColorType()) {
+    this->texel_cache->Store(*key, image->bytes, image->width, image->height,
+        this->GetChannelCount());
+  }
+}
+
+int ImageDecodePool::GetColorType() const {
+  return this->format == ImageResource::Format::LUMINANCE
+      ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB_ALPHA;
+}
+
+int ImageDecodePool::GetChannelCount() const {
+  return this->format == ImageResource::Format::LUMINANCE ? 1 : 4;
+}
+
+bool ImageDecodePool::ReadFromCache(const uint64_t key, DecodedImage *image) {
+  TexelCache::Mapping mapping;
+  if (!this->texel_cache->Map(key, this->GetChannelCount(), &mapping)) {
+    return false;
+  }
+
+  image->bytes = const_cast<png_byte*>(mapping.texels);
+  image->mapping = mapping;
+  image->width = mapping.width;
+  image->height = mapping.height;
+  image->color_type = this->GetColorType();
+  DEBUG("Read [" + image->image->GetName() + "] from the texture cache.");
+  return true;
+}
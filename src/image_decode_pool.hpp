@@ -0,0 +1,141 @@
+#ifndef HUES_IMAGE_DECODE_POOL_H_
+#define HUES_IMAGE_DECODE_POOL_H_
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include <common.hpp>
+#include <respack.hpp>
+#include <texel_cache.hpp>
+
+/** An image decoded by an ImageDecodePool. */
+struct DecodedImage {
+  const ImageResource *image;
+  // 8bpc pixels, bottom row first, rows 4-byte aligned; NULL if the image couldn't be decoded.
+  // Whoever takes the image frees them with ImageDecodePool::Free(), unless they're in a buffer
+  // lent to the pool.
+  png_byte *bytes;
+  // The buffer lent with AddBuffer() that the image was decoded into, even if decoding failed, or
+  // NULL if the pool allocated the image itself.
+  png_byte *buffer;
+  int width;
+  int height;
+  int color_type;
+  // The texture cache entry the pixels are in, if they're read straight from one.
+  TexelCache::Mapping mapping;
+};
+
+/**
+ * Decodes images on a pool of worker threads as they're requested, handing them back to one
+ * consumer thread in the order they finish. The consumer (the render thread, uploading textures)
+ * takes whatever is ready without waiting, and the workers never get more than a few images ahead
+ * of it, so memory stays bounded however big the pack is.
+ *
+ * Images are decoded into new arrays, or into buffers the consumer lends the pool (e.g. mapped
+ * pixel buffer objects), so that they land where they're uploaded from without another copy.
+ *
+ * With a TexelCache, images decoded before are read back from it instead of being decoded again,
+ * and handed over still mapped, without taking a lent buffer.
+ */
+class ImageDecodePool {
+  DISALLOW_COPY_AND_ASSIGN(ImageDecodePool)
+
+  public:
+
+    ImageDecodePool();
+    /** Stops the pool, if Stop() hasn't already. */
+    ~ImageDecodePool();
+
+    /**
+     * Stops the workers, once they finish the images they're on, and frees undelivered images.
+     * Nothing can be taken afterwards. Must be called before anything lent to the pool goes away.
+     */
+    void Stop();
+
+    /**
+     * Makes the workers read images from a cache, and store the ones they decode in it. Must be
+     * called before starting, and the cache must outlive the pool.
+     */
+    void SetTexelCache(TexelCache *texel_cache) { this->texel_cache = texel_cache; }
+
+    /** Sets what images are decoded into (RGBA by default). Must be called before starting. */
+    void SetFormat(const ImageResource::Format format) { this->format = format; }
+
+    /**
+     * Starts workers that wait for images to be requested with Request().
+     *
+     * @param thread_count how many workers to start; 0 means one per core.
+     * @param buffer_size if not 0, images are only decoded into buffers of this size lent with
+     *     AddBuffer(), and workers wait for one to be lent when there are none left.
+     */
+    void Start(const unsigned int thread_count, const size_t buffer_size = 0);
+
+    /** Asks for another image to be decoded. The image must outlive the pool. */
+    void Request(const ImageResource *image);
+
+    /**
+     * Lends the pool a buffer to decode one image into. It comes back as the image's
+     * DecodedImage::buffer, but only once an image that isn't in the cache comes along; until then
+     * it stays lent. Only for pools started with a buffer size.
+     *
+     * @param buffer at least the pool's buffer size; not NULL.
+     */
+    void AddBuffer(png_byte *buffer);
+
+    /**
+     * Takes another decoded image, if there is one, without waiting.
+     *
+     * @return <code>true</code> if an image was taken, <code>false</code> otherwise.
+     */
+    bool TryNext(DecodedImage *decoded);
+
+    unsigned int GetThreadCount() const { return this->threads.size(); }
+
+    /** Frees an image's pixels, unless they're in a buffer lent to the pool. */
+    static void Free(const DecodedImage& decoded);
+
+  private:
+
+    static void* WorkerEntryPoint(void *pool);
+    void Work();
+    /**
+     * Decodes an image.
+     *
+     * @param key where to store it in the cache, or NULL not to.
+     */
+    void Decode(DecodedImage *image, const uint64_t *key);
+    /**
+     * Reads an image from the cache, if it's there.
+     *
+     * @return <code>true</code> if it was, <code>false</code> otherwise.
+     */
+    bool ReadFromCache(const uint64_t key, DecodedImage *image);
+    /** Returns the libpng color type of images decoded into this->format. */
+    int GetColorType() const;
+    int GetChannelCount() const;
+
+    vector<pthread_t> threads;
+    TexelCache *texel_cache = NULL;
+    ImageResource::Format format = ImageResource::Format::RGBA;
+
+    pthread_mutex_t mutex;
+    // Signalled when an image is requested, and when one is taken.
+    pthread_cond_t requested_cv;
+    pthread_cond_t taken_cv;
+    // Guarded by mutex: images no worker has picked up yet.
+    deque<const ImageResource*> pending;
+    // Guarded by mutex.
+    deque<DecodedImage> decoded;
+    size_t max_decoded = 0;
+    bool stopping = false;
+    // Buffers lent to the pool and not yet decoded into, if it was started with a buffer size.
+    size_t buffer_size = 0;
+    deque<png_byte*> buffers;
+    // Signalled when a buffer is lent.
+    pthread_cond_t buffer_cv;
+};
+
+#endif // HUES_IMAGE_DECODE_POOL_H_
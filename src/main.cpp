@@ -1,7 +1,14 @@
+#include <getopt.h>
+
+#include <cmath>
 #include <cstdlib>
 #include <ctime>
+#include <vector>
 
 #include <hues_logic.hpp>
+#include <output_stage.hpp>
+#include <random.hpp>
+#include <time_stretch.hpp>
 
 static const char* pick[] {
   "Madeon - Finale",
@@ -9,15 +16,196 @@ static const char* pick[] {
   "Outlaw Star OST - Desire"
 };
 
+static const struct option kLongOptions[] {
+  { "video-latency", required_argument, NULL, 'v' },
+  { "audio-thread", required_argument, NULL, 'A' },
+  { "logic-thread", required_argument, NULL, 'L' },
+  { "render-thread", required_argument, NULL, 'R' },
+  { "lock-memory", no_argument, NULL, 'm' },
+  { "tempo", required_argument, NULL, 't' },
+  { "volume", required_argument, NULL, 'V' },
+  { "normalize", no_argument, NULL, 'n' },
+  { "benchmark-audio", no_argument, NULL, 'B' },
+  { "simulate", required_argument, NULL, 'S' },
+  { "trigger-port", required_argument, NULL, 'T' },
+  { "seed", required_argument, NULL, 's' },
+  { "record", required_argument, NULL, 'r' },
+  { "replay", required_argument, NULL, 'P' },
+  { "legacy-gl", no_argument, NULL, 'G' },
+  { "texture-budget", required_argument, NULL, 'M' },
+  { NULL, 0, NULL, 0 }
+};
+
+static void PrintUsage(const char *argv0) {
+  cout << "Usage: " << argv0 << " [options]" << endl
+      << "  -v, --video-latency=MS    display latency to compensate for, in milliseconds" << endl
+      << "      --audio-thread=POLICY scheduling for the audio thread, e.g. fifo:80@2" << endl
+      << "      --logic-thread=POLICY scheduling for the beat scheduling thread" << endl
+      << "      --render-thread=POLICY scheduling for the render thread" << endl
+      << "  -m, --lock-memory         lock decoded songs into RAM" << endl
+      << "  -t, --tempo=PERCENT       playback speed, e.g. 102.5; pitch is unaffected" << endl
+      << "      --volume=PERCENT      master volume" << endl
+      << "  -n, --normalize           play all songs at about the same loudness" << endl
+      << "      --benchmark-audio     time the audio processing stages, then exit" << endl
+      << "      --simulate=LOOPS      play every song headlessly, as fast as possible" << endl
+      << "      --trigger-port=PORT   take extra beats over UDP/OSC on a local port" << endl
+      << "      --seed=N              seed for the song pick and every image and color" << endl
+      << "      --record=FILE         log every beat drawn, for --replay" << endl
+      << "      --replay=FILE         draw the beats in a --record log again, then exit" << endl
+      << "      --legacy-gl           draw with fixed-function OpenGL, for old drivers" << endl
+      << "      --texture-budget=MB   texture memory for images; 0 means no limit" << endl
+      << "POLICY is CLASS[:PRIORITY][@CPU], where CLASS is normal, fifo or rr." << endl;
+}
+
+/**
+ * Runs a minute of synthetic audio through the time stretcher and the output stage (with enough
+ * gain to keep the limiter busy) and prints how long each takes per second of audio.
+ */
+static void BenchmarkAudio() {
+  const int kSampleRate = 44100;
+  const int kSeconds = 60;
+  const int kFramesPerBuffer = 1024;
+
+  vector<int16_t> pcm(kSampleRate * kSeconds * 2);
+  for (size_t i = 0; i < pcm.size() / 2; i++) {
+    float t = (float) i / kSampleRate;
+    pcm[i * 2] = (int16_t) (12000 * sin(2 * M_PI * 220 * t) + 8000 * sin(2 * M_PI * 3 * t));
+    pcm[i * 2 + 1] = (int16_t) (12000 * sin(2 * M_PI * 330 * t));
+  }
+  vector<int16_t> buffer(kFramesPerBuffer * 2);
+
+  TimeStretch stretch;
+  stretch.SetTempo(1.05f);
+  size_t in_frame = 0, out_frames = 0;
+  int64_t start_usec = MonotonicTimeUsec();
+  while (in_frame < pcm.size() / 2) {
+    size_t len = min(stretch.GetInputSpace(), pcm.size() / 2 - in_frame);
+    stretch.PutInput(&pcm[in_frame * 2], len);
+    in_frame += len;
+    while (size_t produced = stretch.GetOutput(&buffer[0], kFramesPerBuffer)) {
+      out_frames += produced;
+    }
+  }
+  int64_t stretch_usec = MonotonicTimeUsec() - start_usec;
+
+  OutputStage output;
+  output.SetTargetGain(4.f);
+  start_usec = MonotonicTimeUsec();
+  for (size_t frame = 0; frame + kFramesPerBuffer <= pcm.size() / 2; frame += kFramesPerBuffer) {
+    output.Process(&pcm[frame * 2], kFramesPerBuffer);
+  }
+  int64_t output_usec = MonotonicTimeUsec() - start_usec;
+
+  cout << "Time stretch: " << stretch_usec / kSeconds << " usec per second of audio ("
+      << out_frames << " frames out)." << endl;
+  cout << "Output stage: " << output_usec / kSeconds << " usec per second of audio." << endl;
+}
+
 int main(int argc, char **argv) {
   HuesLogic h;
+
+  ThreadPolicy audio_policy, logic_policy, render_policy;
+  int simulate_loops = 0;
+  uint64_t seed = time(NULL);
+  string replay_path;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "v:mt:n", kLongOptions, NULL)) != -1) {
+    ThreadPolicy *policy = NULL;
+    switch (opt) {
+      case 'v':
+        h.SetVideoLatencyUsec((int64_t) (atof(optarg) * 1000));
+        break;
+      case 'A': policy = &audio_policy; break;
+      case 'L': policy = &logic_policy; break;
+      case 'R': policy = &render_policy; break;
+      case 'm':
+        h.SetLockMemory(true);
+        break;
+      case 't': {
+        float percent = atof(optarg);
+        if (percent < 50 || percent > 200) {
+          cout << "Tempo must be between 50% and 200%." << endl;
+          exit(EXIT_FAILURE);
+        }
+        h.SetTempo(percent / 100);
+        break;
+      }
+      case 'V':
+        h.SetVolume(max(atof(optarg), 0.) / 100);
+        break;
+      case 'n':
+        h.SetNormalize(true);
+        break;
+      case 'B':
+        BenchmarkAudio();
+        exit(EXIT_SUCCESS);
+      case 'S':
+        simulate_loops = atoi(optarg);
+        if (simulate_loops < 1) {
+          cout << "Need to simulate at least one loop per song." << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'T': {
+        int port = atoi(optarg);
+        if (port < 1 || port > 65535) {
+          cout << "Invalid trigger port [" << optarg << "]." << endl;
+          exit(EXIT_FAILURE);
+        }
+        h.SetTriggerPort(port);
+        break;
+      }
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        h.SetRecordPath(optarg);
+        break;
+      case 'P':
+        replay_path = optarg;
+        break;
+      case 'G':
+        h.SetLegacyGl(true);
+        break;
+      case 'M': {
+        int megabytes = atoi(optarg);
+        if (megabytes < 0) {
+          cout << "Invalid texture budget [" << optarg << "]." << endl;
+          exit(EXIT_FAILURE);
+        }
+        h.SetTextureBudget((size_t) megabytes << 20);
+        break;
+      }
+      default:
+        PrintUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (policy && !Realtime::ParseThreadPolicy(optarg, policy)) {
+      cout << "Invalid thread policy [" << optarg << "]." << endl;
+      PrintUsage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  h.SetThreadPolicies(audio_policy, logic_policy, render_policy);
+  h.SetSeed(seed);
+
   if (!h.TryLoadRespack()) {
     exit(EXIT_FAILURE);
   }
 
-  srand(time(NULL));
+  if (simulate_loops) {
+    h.Simulate(simulate_loops);
+    exit(EXIT_SUCCESS);
+  }
 
   h.InitDisplay();
-  h.PlaySong(pick[rand() % (sizeof(pick) / sizeof(char**))]);
-}
+  if (!replay_path.empty()) {
+    h.Replay(replay_path);
+    exit(EXIT_SUCCESS);
+  }
 
+  Random random(seed);
+  h.PlaySong(pick[random.Uniform(sizeof(pick) / sizeof(char**))]);
+}
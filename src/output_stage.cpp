@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <output_stage.hpp>
+
+using namespace std;
+
+/** The limiter keeps peaks under -1dBFS. */
+static const float kLimiterThreshold = 32768.f * 0.891f;
+
+/** How much of the way back to unity the limiter gain recovers each block; ~36ms at 44.1kHz. */
+static const float kLimiterRelease = 0.02f;
+
+/** Converts 16-bit samples to floats, keeping the 16-bit scale. */
+static void ConvertToFloat(const int16_t *src, float *dst, const size_t sample_count) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= sample_count; i += 8) {
+    __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(low));
+    _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(high));
+  }
+#endif
+  for (; i < sample_count; i++) {
+    dst[i] = src[i];
+  }
+}
+
+/** Rounds floats back to 16-bit samples, saturating. */
+static void ConvertToInt16(const float *src, int16_t *dst, const size_t sample_count) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= sample_count; i += 8) {
+    __m128i low = _mm_cvtps_epi32(_mm_loadu_ps(src + i));
+    __m128i high = _mm_cvtps_epi32(_mm_loadu_ps(src + i + 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(low, high));
+  }
+#endif
+  for (; i < sample_count; i++) {
+    dst[i] = (int16_t) lrintf(min(max(src[i], -32768.f), 32767.f));
+  }
+}
+
+/** Multiplies stereo frame i by gain + i * step. */
+static void ApplyGainRamp(float *pcm, const size_t frame_count, const float gain,
+    const float step) {
+  size_t i = 0;
+#ifdef __SSE2__
+  // Two frames per vector: [L0 R0 L1 R1] scaled by [g g g+s g+s].
+  __m128 gains = _mm_setr_ps(gain, gain, gain + step, gain + step);
+  const __m128 gain_step = _mm_set1_ps(2 * step);
+  for (; i + 2 <= frame_count; i += 2) {
+    _mm_storeu_ps(pcm + i * 2, _mm_mul_ps(_mm_loadu_ps(pcm + i * 2), gains));
+    gains = _mm_add_ps(gains, gain_step);
+  }
+#endif
+  for (; i < frame_count; i++) {
+    pcm[i * 2] *= gain + i * step;
+    pcm[i * 2 + 1] *= gain + i * step;
+  }
+}
+
+/** Returns the largest absolute sample value. sample_count must be a multiple of 4. */
+static float Peak(const float *pcm, const size_t sample_count) {
+#ifdef __SSE2__
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 peak4 = _mm_setzero_ps();
+  for (size_t i = 0; i < sample_count; i += 4) {
+    peak4 = _mm_max_ps(peak4, _mm_and_ps(_mm_loadu_ps(pcm + i), abs_mask));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, peak4);
+  return max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+#else
+  float peak = 0.f;
+  for (size_t i = 0; i < sample_count; i++) {
+    peak = max(peak, fabsf(pcm[i]));
+  }
+  return peak;
+#endif
+}
+
+OutputStage::OutputStage() {
+  // Prime the output with silence to cover the lookahead.
+  this->limited_frames = 2 * kLimiterBlockFrames;
+  memset(this->limited, 0, this->limited_frames * 2 * sizeof(float));
+}
+
+void OutputStage::Process(int16_t *pcm, const size_t frame_count) {
+  this->engaged = true;
+
+  // Gain, ramping towards the target at a fixed rate.
+  float *input = this->pending + this->pending_frames * 2;
+  ConvertToFloat(pcm, input, frame_count * 2);
+
+  size_t ramped = 0;
+  if (this->ramp_gain != this->target_gain) {
+    const float max_step = 1.f / kRampFrames;
+    float difference = this->target_gain - this->ramp_gain;
+    float step = difference > 0 ? max_step : -max_step;
+
+    ramped = min(frame_count, (size_t) ceilf(fabsf(difference) / max_step));
+    ApplyGainRamp(input, ramped, this->ramp_gain, step);
+    this->ramp_gain = ramped * max_step >= fabsf(difference)
+        ? this->target_gain : this->ramp_gain + ramped * step;
+  }
+  if (ramped < frame_count && this->ramp_gain != 1.f) {
+    ApplyGainRamp(input + ramped * 2, frame_count - ramped, this->ramp_gain, 0.f);
+  }
+  this->pending_frames += frame_count;
+
+  // Limit every block we can see past.
+  size_t block = 0;
+  for (; this->pending_frames - block >= 2 * kLimiterBlockFrames; block += kLimiterBlockFrames) {
+    this->LimitBlock(this->pending + block * 2);
+  }
+  memmove(this->pending, this->pending + block * 2,
+      (this->pending_frames - block) * 2 * sizeof(float));
+  this->pending_frames -= block;
+
+  // Hand back the oldest limited audio.
+  ConvertToInt16(this->limited, pcm, frame_count * 2);
+  memmove(this->limited, this->limited + frame_count * 2,
+      (this->limited_frames - frame_count) * 2 * sizeof(float));
+  this->limited_frames -= frame_count;
+}
+
+void OutputStage::LimitBlock(const float *block) {
+  const size_t block_samples = kLimiterBlockFrames * 2;
+
+  // Get under the threshold by the end of this block if the next one needs it, so the gain is
+  // already down when the peak arrives.
+  float peak = max(Peak(block, block_samples), Peak(block + block_samples, block_samples));
+  float target = peak > kLimiterThreshold ? kLimiterThreshold / peak : 1.f;
+  float next_gain = target < this->limiter_gain
+      ? target : this->limiter_gain + (target - this->limiter_gain) * kLimiterRelease;
+
+  float *output = this->limited + this->limited_frames * 2;
+  memcpy(output, block, block_samples * sizeof(float));
+
+  float step = (next_gain - this->limiter_gain) / kLimiterBlockFrames;
+  ApplyGainRamp(output, kLimiterBlockFrames, this->limiter_gain + step, step);
+
+  this->limiter_gain = next_gain;
+  this->limited_frames += kLimiterBlockFrames;
+}
+
+float OutputStage::MeasureLoudnessDb(const int16_t *pcm, const size_t sample_count) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < sample_count; i++) {
+    sum += (int32_t) pcm[i] * pcm[i];
+  }
+
+  double mean_square = sample_count ? (double) sum / sample_count : 0.;
+  return 10.f * log10(mean_square / (32768. * 32768.) + 1e-12);
+}
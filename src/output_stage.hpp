@@ -0,0 +1,76 @@
+#ifndef HUES_OUTPUT_STAGE_H_
+#define HUES_OUTPUT_STAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * The last processing step before audio hits the device: a click-free gain ramp followed by a
+ * lookahead soft limiter, working in place on 16-bit interleaved stereo PCM.
+ *
+ * Gain changes are spread over kRampFrames. The limiter looks kLimiterBlockFrames ahead so that
+ * it can turn the gain down smoothly before a peak arrives instead of clipping it, then lets it
+ * back up gradually. Both run as SIMD kernels over whole blocks. Everything is preallocated;
+ * Process() is meant to run on the audio device thread.
+ *
+ * The limiter delays the audio by 2 * kLimiterBlockFrames.
+ */
+class OutputStage {
+  DISALLOW_COPY_AND_ASSIGN(OutputStage)
+
+  public:
+
+    /** A full swing from silence to unity gain takes this long; ~20ms at 44.1kHz. */
+    static const int kRampFrames = 882;
+    /** Limiter lookahead and gain envelope resolution. */
+    static const int kLimiterBlockFrames = 32;
+    /** The most frames Process() accepts in one call. */
+    static const int kMaxFrames = 4096;
+
+    OutputStage();
+    ~OutputStage() {}
+
+    /** Sets the gain to ramp towards. */
+    void SetTargetGain(const float gain) { this->target_gain = gain; }
+
+    /**
+     * Returns whether this stage has ever had anything to do. Until it has, audio can skip it (and
+     * its delay) entirely; once it has, all audio must go through it to stay continuous.
+     */
+    bool IsEngaged() const { return this->engaged; }
+
+    /**
+     * Applies gain and limiting to a buffer in place.
+     *
+     * @param pcm 16-bit interleaved stereo PCM.
+     * @param frame_count the number of frames in the buffer; at most kMaxFrames.
+     */
+    void Process(int16_t *pcm, const size_t frame_count);
+
+    /** Returns the RMS level of 16-bit PCM in dBFS, for loudness normalization. */
+    static float MeasureLoudnessDb(const int16_t *pcm, const size_t sample_count);
+
+  private:
+
+    /**
+     * Turns a block of pending input into limited output. The block after it must be pending too.
+     */
+    void LimitBlock(const float *block);
+
+    bool engaged = false;
+
+    float target_gain = 1.f;
+    float ramp_gain = 1.f;
+    float limiter_gain = 1.f;
+
+    // Gained input waiting for lookahead, and limited output waiting to be handed back, both as
+    // interleaved stereo in 16-bit scale.
+    alignas(16) float pending[(kMaxFrames + 2 * kLimiterBlockFrames) * 2];
+    size_t pending_frames = 0;
+    alignas(16) float limited[(kMaxFrames + 4 * kLimiterBlockFrames) * 2];
+    size_t limited_frames = 0;
+};
+
+#endif // HUES_OUTPUT_STAGE_H_
@@ -0,0 +1,67 @@
+#include <algorithm>
+
+#include <pcm_stream.hpp>
+
+using namespace std;
+
+bool PcmStream::Enqueue(const PcmSegment& segment) {
+  unsigned int head = this->head.load(memory_order_relaxed);
+  if (head - this->tail.load(memory_order_acquire) >= kMaxQueuedSegments) {
+    return false;
+  }
+
+  this->segments[head % kMaxQueuedSegments] = segment;
+  this->head.store(head + 1, memory_order_release);
+  return true;
+}
+
+size_t PcmStream::Read(const size_t max_len, const uint8_t **data) {
+  if (!max_len) {
+    return 0;
+  }
+
+  for (;;) {
+    unsigned int tail = this->tail.load(memory_order_relaxed);
+    unsigned int head = this->head.load(memory_order_acquire);
+
+    if (!this->playing) {
+      if (tail == head) {
+        return 0;
+      }
+      this->playing = true;
+      this->cursor = 0;
+      this->segment_count.fetch_add(1, memory_order_release);
+    }
+
+    const PcmSegment& segment = this->segments[tail % kMaxQueuedSegments];
+    const bool looping = segment.IsLooping();
+
+    // Wrap at the seam, unless something else is waiting to play after us.
+    if (looping && this->cursor == segment.loop_end && head - tail == 1) {
+      this->cursor = segment.loop_begin;
+    }
+    if (looping && this->cursor == segment.loop_begin) {
+      this->loop_count.fetch_add(1, memory_order_release);
+    }
+
+    // Never hand out a run that straddles either end of the loop region.
+    size_t end = segment.len;
+    if (looping && this->cursor < segment.loop_begin) {
+      end = segment.loop_begin;
+    } else if (looping && this->cursor < segment.loop_end) {
+      end = segment.loop_end;
+    }
+
+    if (this->cursor >= end) {
+      this->playing = false;
+      this->tail.store(tail + 1, memory_order_release);
+      continue;
+    }
+
+    size_t len = min(max_len, end - this->cursor);
+    *data = segment.data + this->cursor;
+    this->gain = segment.gain;
+    this->cursor += len;
+    return len;
+  }
+}
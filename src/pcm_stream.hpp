@@ -0,0 +1,91 @@
+#ifndef HUES_PCM_STREAM_H_
+#define HUES_PCM_STREAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * A PCM buffer queued for playback. The buffer is owned by the caller and must outlive playback.
+ *
+ * If the loop region [loop_begin, loop_end) is non-empty, playback runs from the start of the
+ * buffer up to loop_end and then wraps back to loop_begin until another segment is queued, at which
+ * point the rest of the buffer (from loop_end) is played out. All offsets are in bytes.
+ *
+ * The gain is applied by the output stage, on top of the master volume.
+ */
+struct PcmSegment {
+  const uint8_t *data;
+  size_t len;
+  size_t loop_begin;
+  size_t loop_end;
+  float gain;
+
+  bool IsLooping() const { return this->loop_end > this->loop_begin; }
+};
+
+/**
+ * A single-producer, single-consumer queue of PcmSegments, plus the read cursor the audio device
+ * thread uses to walk through them.
+ *
+ * The producer (logic thread) calls Enqueue(). The consumer (device thread) calls Read(), which
+ * hands out pointers straight into the queued buffers: looping never copies, allocates or
+ * resubmits anything, the cursor just wraps at the seam. Neither side ever blocks.
+ */
+class PcmStream {
+  DISALLOW_COPY_AND_ASSIGN(PcmStream)
+
+  public:
+
+    PcmStream() {}
+    ~PcmStream() {}
+
+    /**
+     * Queues a segment to play after everything already queued. Producer thread only.
+     *
+     * @return <code>false</code> if the queue is full, <code>true</code> otherwise.
+     */
+    bool Enqueue(const PcmSegment& segment);
+
+    /**
+     * Returns the next contiguous run of PCM bytes to play and advances the cursor past it. The
+     * returned run never crosses a loop boundary, so each run lies entirely inside or outside the
+     * loop region. Consumer thread only.
+     *
+     * @param max_len the maximum number of bytes to return; should be a multiple of the frame size.
+     * @param data receives a pointer to the start of the run.
+     * @return the length of the run in bytes, or 0 if nothing is queued.
+     */
+    size_t Read(const size_t max_len, const uint8_t **data);
+
+    /** Returns the gain of the segment the last Read() run came from. Consumer thread only. */
+    float GetGain() const { return this->gain; }
+
+    /** Returns the number of loop iterations started so far, across all segments. */
+    uint64_t GetLoopCount() const { return this->loop_count.load(std::memory_order_acquire); }
+
+    /** Returns the number of segments the cursor has started playing. */
+    uint64_t GetSegmentCount() const {
+      return this->segment_count.load(std::memory_order_acquire);
+    }
+
+  private:
+
+    static const unsigned int kMaxQueuedSegments = 8;
+
+    PcmSegment segments[kMaxQueuedSegments];
+    std::atomic<unsigned int> head{0};
+    std::atomic<unsigned int> tail{0};
+
+    std::atomic<uint64_t> loop_count{0};
+    std::atomic<uint64_t> segment_count{0};
+
+    // Only touched by the consumer.
+    bool playing = false;
+    size_t cursor = 0;
+    float gain = 1.f;
+};
+
+#endif // HUES_PCM_STREAM_H_
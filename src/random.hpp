@@ -0,0 +1,48 @@
+#ifndef HUES_RANDOM_H_
+#define HUES_RANDOM_H_
+
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * A small seedable pseudo-random generator (xorshift64*), so that a run can be repeated exactly.
+ * Unlike rand(), its sequence is the same on every platform and it has no hidden global state.
+ */
+class Random {
+  DISALLOW_COPY_AND_ASSIGN(Random)
+
+  public:
+
+    explicit Random(const uint64_t seed = 0) { this->Seed(seed); }
+    ~Random() {}
+
+    /** Restarts the sequence from the given seed. Any seed, including 0, is fine. */
+    void Seed(const uint64_t seed) {
+      // Mix the seed (splitmix64) so that nearby seeds give unrelated sequences, and never 0.
+      uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      z ^= z >> 31;
+      this->state = z ? z : 1;
+    }
+
+    /** Returns the next 32 random bits. */
+    uint32_t Next() {
+      this->state ^= this->state >> 12;
+      this->state ^= this->state << 25;
+      this->state ^= this->state >> 27;
+      return (uint32_t) ((this->state * 0x2545f4914f6cdd1dULL) >> 32);
+    }
+
+    /** Returns a number in [0, bound). The bias is negligible for the small bounds we use. */
+    uint32_t Uniform(const uint32_t bound) {
+      return (uint32_t) (((uint64_t) this->Next() * bound) >> 32);
+    }
+
+  private:
+
+    uint64_t state;
+};
+
+#endif // HUES_RANDOM_H_
@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include <realtime.hpp>
+
+using namespace std;
+
+bool Realtime::ParseThreadPolicy(const string& spec, ThreadPolicy *policy) {
+  size_t class_end = spec.find_first_of(":@");
+  string sched_class = spec.substr(0, class_end);
+
+  if (sched_class == "normal") {
+    policy->sched_class = ThreadPolicy::Class::NORMAL;
+  } else if (sched_class == "fifo") {
+    policy->sched_class = ThreadPolicy::Class::FIFO;
+  } else if (sched_class == "rr") {
+    policy->sched_class = ThreadPolicy::Class::ROUND_ROBIN;
+  } else {
+    return false;
+  }
+
+  const char *rest = spec.c_str() + (class_end == string::npos ? spec.length() : class_end);
+  char *end;
+  const bool has_priority = *rest == ':';
+  if (has_priority) {
+    policy->priority = strtol(rest + 1, &end, 10);
+    if (end == rest + 1) {
+      return false;
+    }
+    rest = end;
+  }
+
+#ifndef WIN32
+  // Real-time classes have no priority 0, so default to the lowest one. Priorities out of range
+  // would only be turned down once the thread is running.
+  if (policy->sched_class != ThreadPolicy::Class::NORMAL) {
+    int sched_policy = policy->sched_class == ThreadPolicy::Class::FIFO ? SCHED_FIFO : SCHED_RR;
+    if (!has_priority) {
+      policy->priority = sched_get_priority_min(sched_policy);
+    }
+    if (policy->priority < sched_get_priority_min(sched_policy)
+        || policy->priority > sched_get_priority_max(sched_policy)) {
+      return false;
+    }
+  }
+#endif
+  if (*rest == '@') {
+    policy->cpu = strtol(rest + 1, &end, 10);
+    if (end == rest + 1 || policy->cpu < 0) {
+      return false;
+    }
+    rest = end;
+  }
+
+  return *rest == '\0';
+}
+
+#ifdef WIN32
+
+bool Realtime::ApplyThreadPolicy(const string& thread_name, const ThreadPolicy& policy) {
+  bool ok = true;
+
+  // Windows doesn't have FIFO vs. round robin, just priority levels.
+  if (policy.sched_class != ThreadPolicy::Class::NORMAL) {
+    int priority = policy.priority >= 50 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+    if (!SetThreadPriority(GetCurrentThread(), priority)) {
+      ERR("Couldn't raise priority of the " + thread_name + " thread: error ["
+          + to_string(GetLastError()) + "]. Continuing at normal priority.");
+      ok = false;
+    }
+  }
+
+  if (policy.cpu >= 0 && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << policy.cpu)) {
+    ERR("Couldn't pin the " + thread_name + " thread to CPU [" + to_string(policy.cpu)
+        + "]: error [" + to_string(GetLastError()) + "].");
+    ok = false;
+  }
+
+  return ok;
+}
+
+bool Realtime::LockMemory(const void *buffer, const size_t len) {
+  if (!VirtualLock(const_cast<void*>(buffer), len)) {
+    ERR("Couldn't lock [" + to_string(len) + "] bytes into memory: error ["
+        + to_string(GetLastError()) + "].");
+    return false;
+  }
+  return true;
+}
+
+#else // WIN32
+
+bool Realtime::ApplyThreadPolicy(const string& thread_name, const ThreadPolicy& policy) {
+  bool ok = true;
+
+  if (policy.sched_class != ThreadPolicy::Class::NORMAL) {
+    int sched_policy =
+        policy.sched_class == ThreadPolicy::Class::FIFO ? SCHED_FIFO : SCHED_RR;
+    struct sched_param param;
+    param.sched_priority = policy.priority;
+
+    int result = pthread_setschedparam(pthread_self(), sched_policy, &param);
+    if (result == EPERM) {
+      ERR("Not allowed to make the " + thread_name + " thread real-time (needs CAP_SYS_NICE or an "
+          "rtprio limit). Continuing at normal priority.");
+      ok = false;
+    } else if (result) {
+      ERR("Couldn't make the " + thread_name + " thread real-time: " + strerror(result) + ".");
+      ok = false;
+    }
+  }
+
+  if (policy.cpu >= 0) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(policy.cpu, &cpus);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (result) {
+      ERR("Couldn't pin the " + thread_name + " thread to CPU [" + to_string(policy.cpu) + "]: "
+          + strerror(result) + ".");
+      ok = false;
+    }
+#else
+    ERR("Pinning threads to CPUs isn't supported on this platform.");
+    ok = false;
+#endif
+  }
+
+  if (ok && (policy.sched_class != ThreadPolicy::Class::NORMAL || policy.cpu >= 0)) {
+    LOG("Applied scheduling policy to the " + thread_name + " thread.");
+  }
+  return ok;
+}
+
+bool Realtime::LockMemory(const void *buffer, const size_t len) {
+  if (mlock(buffer, len)) {
+    ERR("Couldn't lock [" + to_string(len) + "] bytes into memory: " + strerror(errno)
+        + ". Raise the memlock limit to fix this.");
+    return false;
+  }
+  return true;
+}
+
+#endif // WIN32
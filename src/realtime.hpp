@@ -0,0 +1,57 @@
+#ifndef HUES_REALTIME_H_
+#define HUES_REALTIME_H_
+
+#include <cstddef>
+#include <string>
+
+#include <common.hpp>
+
+using namespace std;
+
+/** Scheduling settings for one of our threads. The defaults leave the thread alone. */
+struct ThreadPolicy {
+  enum class Class {
+    NORMAL,
+    FIFO,
+    ROUND_ROBIN
+  };
+
+  Class sched_class = Class::NORMAL;
+  /** Real-time priority; only meaningful for FIFO and ROUND_ROBIN. */
+  int priority = 0;
+  /** The CPU to pin the thread to, or -1 to let the OS decide. */
+  int cpu = -1;
+};
+
+/**
+ * Helpers for getting our timing-sensitive threads (audio, beat scheduling, rendering) scheduled
+ * promptly. Everything here is best-effort: if we lack the permissions for something, we log it and
+ * carry on at normal priority.
+ */
+namespace Realtime {
+  /**
+   * Parses a thread policy of the form <code>CLASS[:PRIORITY][@CPU]</code>, where CLASS is one of
+   * <code>normal</code>, <code>fifo</code> or <code>rr</code>. For example, <code>fifo:80@2</code>.
+   * A real-time CLASS without a PRIORITY gets the lowest real-time priority.
+   *
+   * @return <code>false</code> if the spec couldn't be parsed, <code>true</code> otherwise.
+   */
+  bool ParseThreadPolicy(const string& spec, ThreadPolicy *policy);
+
+  /**
+   * Applies a policy to the calling thread.
+   *
+   * @param thread_name a name for the thread, for logging.
+   * @return <code>true</code> if everything was applied, <code>false</code> otherwise.
+   */
+  bool ApplyThreadPolicy(const string& thread_name, const ThreadPolicy& policy);
+
+  /**
+   * Locks a buffer into RAM so that playing it can never page fault.
+   *
+   * @return <code>true</code> if the buffer was locked, <code>false</code> otherwise.
+   */
+  bool LockMemory(const void *buffer, const size_t len);
+}
+
+#endif // HUES_REALTIME_H_
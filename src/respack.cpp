@@ -1,5 +1,12 @@
 #include <assert.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <fstream>
 #include <string>
 
@@ -13,6 +20,34 @@
 using namespace std;
 using namespace pugi;
 
+static string ToLower(const string& text) {
+  string lower(text);
+  for (char& c : lower) {
+    c = tolower(static_cast<unsigned char>(c));
+  }
+  return lower;
+}
+
+/**
+ * Returns how loosely text contains the characters of query in order: the number of characters
+ * skipped between the first and last match, or -1 if it doesn't contain them at all.
+ */
+static int FuzzyMatchGaps(const string& text, const string& query) {
+  size_t start = string::npos;
+  size_t position = 0;
+  for (char c : query) {
+    position = text.find(c, position);
+    if (position == string::npos) {
+      return -1;
+    }
+    if (start == string::npos) {
+      start = position;
+    }
+    position++;
+  }
+  return start == string::npos ? 0 : (int) (position - start - query.length());
+}
+
 ResourcePack::~ResourcePack() {
   for (AudioResource *song : this->song_list) {
     delete song;
@@ -41,6 +76,7 @@ bool ResourcePack::Init() {
   LOG("Loading respack at [" + this->base_path + "].");
   this->ParseSongXmlFile();
   this->ParseImageXmlFile();
+  this->IndexSongs();
 
   return true;
 }
@@ -75,6 +111,76 @@ void ResourcePack::ParseSongXmlFile() {
   LOG("Found [" + to_string(this->song_list.size()) + "] songs.");
 }
 
+void ResourcePack::IndexSongs() {
+  this->songs_by_title.clear();
+  this->songs_by_name.clear();
+  this->sorted_titles.clear();
+  this->songs_by_title.reserve(this->song_list.size());
+  this->songs_by_name.reserve(this->song_list.size() * 2);
+  this->sorted_titles.reserve(this->song_list.size());
+
+  for (AudioResource *song : this->song_list) {
+    // Like the old linear search, the last song with a given title wins.
+    this->songs_by_title[song->song_title] = song;
+    this->songs_by_name[song->loop.name] = song;
+    if (song->HasBuildup()) {
+      this->songs_by_name[song->buildup.name] = song;
+    }
+    this->sorted_titles.emplace_back(ToLower(song->song_title), song);
+  }
+  sort(this->sorted_titles.begin(), this->sorted_titles.end());
+}
+
+AudioResource* ResourcePack::GetSongByTitle(const string& title) const {
+  auto song = this->songs_by_title.find(title);
+  return song == this->songs_by_title.end() ? NULL : song->second;
+}
+
+AudioResource* ResourcePack::GetSongByName(const string& name) const {
+  auto song = this->songs_by_name.find(name);
+  return song == this->songs_by_name.end() ? NULL : song->second;
+}
+
+int ResourcePack::FindSongs(const string& query, vector<AudioResource*>& results,
+    const size_t max_results) const {
+  const string lower_query = ToLower(query);
+  size_t found = 0;
+
+  // Prefix matches are a contiguous run of the sorted titles.
+  auto first = lower_bound(this->sorted_titles.begin(), this->sorted_titles.end(),
+      make_pair(lower_query, (AudioResource*) NULL));
+  auto prefix_end = first;
+  for (; prefix_end != this->sorted_titles.end()
+      && prefix_end->first.compare(0, lower_query.length(), lower_query) == 0; prefix_end++) {
+    if (found < max_results) {
+      results.push_back(prefix_end->second);
+      found++;
+    }
+  }
+  if (found == max_results) {
+    return found;
+  }
+
+  // Then everything else that matches loosely.
+  vector<pair<int, size_t>> fuzzy;
+  for (size_t i = 0; i < this->sorted_titles.size(); i++) {
+    if (i >= (size_t) (first - this->sorted_titles.begin())
+        && i < (size_t) (prefix_end - this->sorted_titles.begin())) {
+      continue;
+    }
+    int gaps = FuzzyMatchGaps(this->sorted_titles[i].first, lower_query);
+    if (gaps >= 0) {
+      fuzzy.emplace_back(gaps, i);
+    }
+  }
+  sort(fuzzy.begin(), fuzzy.end());
+  for (size_t i = 0; i < fuzzy.size() && found < max_results; i++, found++) {
+    results.push_back(this->sorted_titles[fuzzy[i].second].second);
+  }
+
+  return found;
+}
+
 void ResourcePack::ParseImageXmlFile() {
   string image_xml_filename = this->base_path + "images.xml";
   xml_document doc;
@@ -113,10 +219,51 @@ int ResourcePack::GetAllImages(vector<ImageResource*>& image_list) const {
 // =====================================================================
 
 // Borrowed from https://github.com/DavidEGrayson/ahrs-visualizer/blob/master/png_texture.cpp
-png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type) const {
+/**
+ * Composites count RGBA pixels onto white, keeping only the red channel: 255 - (255 - R) * A / 255,
+ * rounded to nearest. The same as mixing white with the image by its alpha, which is how it's
+ * drawn.
+ */
+static void CompositeOntoWhite(const png_byte *rgba, png_byte *luminance, const size_t count) {
+  size_t i = 0;
+#ifdef __SSE2__
+  // Sixteen pixels at a time, in 16-bit lanes: (255 - R) * A is at most 255 * 255, and
+  // (x + 128 + ((x + 128) >> 8)) >> 8 divides it by 255 exactly, without overflowing.
+  const __m128i low_byte = _mm_set1_epi32(0xff);
+  const __m128i all_ones = _mm_set1_epi16(0xff);
+  const __m128i half = _mm_set1_epi16(128);
+  for (; i + 16 <= count; i += 16) {
+    __m128i blended[2];
+    for (int j = 0; j < 2; j++) {
+      __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4 + j * 32));
+      __m128i second = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(rgba + i * 4 + j * 32 + 16));
+      __m128i red = _mm_packs_epi32(_mm_and_si128(first, low_byte),
+          _mm_and_si128(second, low_byte));
+      __m128i alpha = _mm_packs_epi32(_mm_srli_epi32(first, 24), _mm_srli_epi32(second, 24));
+      __m128i x = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(all_ones, red), alpha), half);
+      x = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+      blended[j] = _mm_sub_epi16(all_ones, x);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(luminance + i),
+        _mm_packus_epi16(blended[0], blended[1]));
+  }
+#endif
+  for (; i < count; i++) {
+    unsigned int x = (255 - rgba[i * 4]) * rgba[i * 4 + 3] + 128;
+    luminance[i] = 255 - ((x + (x >> 8)) >> 8);
+  }
+}
+
+png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type, png_byte *buffer,
+    const size_t buffer_size, const Format format) const {
   png_byte header[8];
   png_byte *image_data = NULL;
   png_byte **row_pointers = NULL;
+  // RGBA rows for compositing onto white: just the one, unless the image is interlaced. Volatile,
+  // as it's set after setjmp() and has to be freed after a longjmp().
+  png_byte * volatile rgba_rows = NULL;
+  int passes = 1;
 
   png_structp png_ptr = NULL;
   png_infop info_ptr = NULL, endinfo_ptr = NULL;
@@ -124,7 +271,7 @@ png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type)
   int rowbytes = 0;
 
   // Open the file.
-  string file_name = this->base_path + "/Images/" + this->image_name + ".png";
+  string file_name = this->GetPath();
   FILE *fp = fopen(file_name.c_str(), "rb");
   if (!fp) {
     perror(file_name.c_str());
@@ -180,12 +327,19 @@ png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type)
   // Transform PNG images into 8bpc GA.
   png_set_expand(png_ptr);
   png_set_packing(png_ptr);
+  if (format == Format::LUMINANCE) {
+    // Compositing wants RGBA whatever the image started out as.
+    png_set_strip_16(png_ptr);
+    png_set_gray_to_rgb(png_ptr);
+    png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+    passes = png_set_interlace_handling(png_ptr);
+  }
 
   // Allocate memory for the image; read and update more PNG info first though.
   png_read_update_info(png_ptr, info_ptr);
   temp_color_type = png_get_color_type(png_ptr, info_ptr);
   if (color_type) {
-    *color_type = temp_color_type;
+    *color_type = format == Format::LUMINANCE ? PNG_COLOR_TYPE_GRAY : temp_color_type;
   }
 
   // Make sure we have an expected image type.
@@ -193,11 +347,18 @@ png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type)
   assert((temp_color_type & PNG_COLOR_MASK_ALPHA) == PNG_COLOR_MASK_ALPHA);
 
   // glTexImage2d requires rows to be 4-byte aligned
-  rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+  rowbytes = format == Format::LUMINANCE ? temp_width : png_get_rowbytes(png_ptr, info_ptr);
   rowbytes += 3 - ((rowbytes - 1) % 4);
 
   // We need two representations of the image data -- a block for OpenGL, and rows for libpng.
-  image_data = new png_byte[rowbytes * temp_height * sizeof(png_byte) + 15];
+  if (!buffer) {
+    image_data = new png_byte[rowbytes * temp_height * sizeof(png_byte) + 15];
+  } else if (rowbytes * temp_height * sizeof(png_byte) <= buffer_size) {
+    image_data = buffer;
+  } else {
+    ERR("ImageResource [" + file_name + "] is too big for its buffer.");
+    goto DECODE_DESTROY_PNG_STRUCTS;
+  }
   row_pointers = new png_byte*[temp_height * sizeof(png_byte *)];
 
   // Set the individual row_pointers to point at the correct offsets of image_data.
@@ -205,11 +366,30 @@ png_byte* ImageResource::ReadAndDecode(int *width, int *height, int *color_type)
     row_pointers[temp_height - 1 - i] = image_data + i * rowbytes;
   }
 
-  // Read the PNG data and return.
-  png_read_image(png_ptr, row_pointers);
+  if (format == Format::LUMINANCE) {
+    // Composite each row as it's decoded, so that the RGBA image is never all in memory at once.
+    // Interlaced images only come together after the last pass, so they have to be.
+    const size_t rgba_rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    rgba_rows = new png_byte[rgba_rowbytes * (passes > 1 ? temp_height : 1)];
+    for (int pass = 0; pass < passes; pass++) {
+      for (unsigned int i = 0; i < temp_height; i++) {
+        png_read_row(png_ptr, rgba_rows + (passes > 1 ? i * rgba_rowbytes : 0), NULL);
+        if (pass == passes - 1) {
+          CompositeOntoWhite(rgba_rows + (passes > 1 ? i * rgba_rowbytes : 0), row_pointers[i],
+              temp_width);
+          memset(row_pointers[i] + temp_width, 0, rowbytes - temp_width);
+        }
+      }
+    }
+    png_read_end(png_ptr, NULL);
+  } else {
+    // Read the PNG data and return.
+    png_read_image(png_ptr, row_pointers);
+  }
 
   delete[] row_pointers;
 DECODE_DESTROY_PNG_STRUCTS:
+  delete[] rgba_rows;
   png_destroy_read_struct(&png_ptr, &info_ptr, &endinfo_ptr);
 DECODE_CLOSE_FILE:
   fclose(fp);
@@ -217,6 +397,30 @@ DECODE_RETURN:
   return image_data;
 }
 
+bool ImageResource::ReadSize(int *width, int *height) const {
+  string file_name = this->GetPath();
+  FILE *fp = fopen(file_name.c_str(), "rb");
+  if (!fp) {
+    perror(file_name.c_str());
+    return false;
+  }
+
+  // The signature comes first, then the IHDR chunk: its length and type, then the big-endian width
+  // and height.
+  png_byte header[8 + 4 + 4 + 4 + 4];
+  bool is_png = fread(header, sizeof(header), 1, fp) == 1 && !png_sig_cmp(header, 0, 8)
+      && !memcmp(header + 12, "IHDR", 4);
+  fclose(fp);
+  if (!is_png) {
+    ERR("ImageResource [" + file_name + "] was not a PNG.");
+    return false;
+  }
+
+  *width = (int) png_get_uint_32(header + 16);
+  *height = (int) png_get_uint_32(header + 20);
+  return true;
+}
+
 // =====================================================================
 //                     A u d i o R e s o u r c e
 // =====================================================================
@@ -239,14 +443,19 @@ void AudioResource::ReadAndDecode(const Type audio_type) {
     song->pcm_data = decoder.Decode(&song->sample_count, &song->channel_count, &song->sample_rate);
 
     // Calculate length of each beat. If there is no beatmap, the song is one long beat.
+    double song_usec = (double) song->sample_count / song->sample_rate * 1000 * 1000;
     if (song->beatmap.empty()) {
-      song->usec_per_beat = this->GetSongDurationUsec(audio_type);
+      song->usec_per_beat = song_usec;
     } else {
-      song->usec_per_beat = this->GetSongDurationUsec(audio_type) / song->beatmap.length();
+      song->usec_per_beat = song_usec / song->beatmap.length();
     }
 
+    song->timeline.Compile(song->beatmap, song->sample_count);
+
     LOG("Loaded [" + file_name + "]: " + to_string(song->beatmap.length()) + " beats at "
-        + to_string(song->usec_per_beat) + " usec each.");
+        + to_string(song->usec_per_beat) + " usec each, ["
+        + to_string(song->timeline.GetImageChangeCount()) + "] image and ["
+        + to_string(song->timeline.GetColorChangeCount()) + "] color changes.");
   } else {
     ERR("Unable to open audio file [" + file_name + "] for read!");
   }
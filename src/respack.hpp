@@ -4,10 +4,13 @@
 #include <cmath>
 #include <locale>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <png.h>
 
+#include <beat_timeline.hpp>
 #include <common.hpp>
 
 using namespace std;
@@ -53,16 +56,48 @@ public:
    */
   int GetAllImages(vector<ImageResource*>& image_list) const;
 
+  /**
+   * Looks up a song by its exact title in constant time.
+   *
+   * @return the song, which lives as long as this pack, or NULL if there isn't one.
+   */
+  AudioResource* GetSongByTitle(const string& title) const;
+  /**
+   * Looks up a song by the exact name of its loop or buildup file in constant time.
+   *
+   * @return the song, which lives as long as this pack, or NULL if there isn't one.
+   */
+  AudioResource* GetSongByName(const string& name) const;
+
+  /**
+   * Searches song titles, ignoring case: titles starting with the query come first (sorted), then
+   * titles containing its characters in order, closest matches first.
+   *
+   * @param query what the user typed so far.
+   * @param results a vector to append the matching songs to.
+   * @param max_results the most songs to return.
+   * @return the number of songs appended.
+   */
+  int FindSongs(const string& query, vector<AudioResource*>& results,
+      const size_t max_results) const;
+
   string GetBasePath() const;
 
 private:
   void ParseSongXmlFile();
   void ParseImageXmlFile();
+  /** Builds the song lookup tables. Called once all songs are known. */
+  void IndexSongs();
 
   const string base_path;
 
   vector<AudioResource*> song_list;
   vector<ImageResource*> image_list;
+
+  unordered_map<string, AudioResource*> songs_by_title;
+  unordered_map<string, AudioResource*> songs_by_name;
+  // Lowercased titles, sorted, for prefix searches.
+  vector<pair<string, AudioResource*>> sorted_titles;
 };
 
 class ImageResource {
@@ -79,6 +114,15 @@ public:
     RIGHT
   };
 
+  /** What ReadAndDecode() turns images into. */
+  enum class Format {
+    // 8bpc RGBA, as stored.
+    RGBA,
+    // 8-bit luminance (the red channel), composited onto white by its alpha: what the image looks
+    // like when drawn, as a quarter of the bytes.
+    LUMINANCE
+  };
+
   /**
    * Constructs a new, named ImageResource.
    *
@@ -89,17 +133,34 @@ public:
       base_path(base_path), image_name(name), alignment(alignment) { }
 
   /**
-   * Reads this image resource into an OpenGL-compatible RGB(A) byte-array bitmap.
+   * Reads this image resource into an OpenGL-compatible RGB(A) or luminance byte-array bitmap,
+   * bottom row first, with rows padded to 4 bytes.
    * The caller is responsible for deallocating the returned byte array once finished.
    *
    * @param width OPTIONAL: a pointer to receive the decoded image's true width.
    * @param height OPTIONAL: a pointer to receive the decoded image's true height.
-   * @param color_type OPTIONAL: a pointer to receive the decoded image's color type (usually RGBA).
+   * @param color_type OPTIONAL: a pointer to receive the decoded image's color type (usually RGBA,
+   *     and always gray for Format::LUMINANCE).
+   * @param buffer OPTIONAL: where to decode the image to, instead of a new array. The caller keeps
+   *     ownership of it.
+   * @param buffer_size the size of buffer; images that don't fit aren't decoded.
+   * @param format what to decode the image into.
+   * @return the decoded image, or NULL if it couldn't be decoded.
    */
-  png_byte* ReadAndDecode(int *width, int *height, int *color_type) const;
+  png_byte* ReadAndDecode(int *width, int *height, int *color_type, png_byte *buffer = NULL,
+      const size_t buffer_size = 0, const Format format = Format::RGBA) const;
+
+  /**
+   * Reads just this image's dimensions from its PNG header, without decoding it.
+   *
+   * @return <code>true</code> if the image is a PNG, <code>false</code> otherwise.
+   */
+  bool ReadSize(int *width, int *height) const;
 
   /** Returns this ImageResource's name (without file extension). */
   string GetName() const { return this->image_name; }
+  /** Returns the path to this ImageResource's PNG file. */
+  string GetPath() const { return this->base_path + "/Images/" + this->image_name + ".png"; }
   /** Returns this ImageResource's alignment. */
   Align GetAlignment() const { return this->alignment; }
 
@@ -128,16 +189,7 @@ class AudioResource {
 
 public:
 
-  enum class Beat {
-    VERTICAL_BLUR,
-    HORIZONTAL_BLUR,
-    NO_BLUR,
-    BLACKOUT,
-    SHORT_BLACKOUT,
-    COLOR_ONLY,
-    IMAGE_ONLY,
-    NO_TRANSITION
-  };
+  typedef BeatTimeline::Beat Beat;
 
   enum class Type {
     LOOP,
@@ -165,13 +217,29 @@ public:
   string GetBeatmap(const Type type) const {
     return (type == Type::LOOP ? this->loop : this->buildup).beatmap;
   }
+  /** Returns the compiled beatmap. Only valid once the audio has been decoded. */
+  const BeatTimeline& GetTimeline(const Type type) const {
+    return (type == Type::LOOP ? this->loop : this->buildup).timeline;
+  }
+  /** Returns how long the song takes to play at the current tempo. */
   double GetSongDurationUsec(const Type type) const {
     return (double) (type == Type::LOOP ? this->loop : this->buildup).sample_count
-        / (type == Type::LOOP ? this->loop : this->buildup).sample_rate * 1000 * 1000;
+        / (type == Type::LOOP ? this->loop : this->buildup).sample_rate * 1000 * 1000
+        / this->tempo;
   }
+  /** Returns how long each beat lasts at the current tempo. */
   double GetBeatDurationUsec(const Type type) const {
-    return (type == Type::LOOP ? this->loop : this->buildup).usec_per_beat;
+    return (type == Type::LOOP ? this->loop : this->buildup).usec_per_beat / this->tempo;
   }
+
+  /**
+   * Sets the speed this song is played at, so that durations follow it. This does not change the
+   * audio itself; see AudioRenderer::SetTempo().
+   *
+   * @param tempo the playback speed: 1.05 plays 5% faster.
+   */
+  void SetTempo(const double tempo) { this->tempo = tempo; }
+  double GetTempo() const { return this->tempo; }
   uint8_t* GetPcmData(const Type type) const {
     return (type == Type::LOOP ? this->loop : this->buildup).pcm_data;
   }
@@ -179,6 +247,10 @@ public:
     return (type == Type::LOOP ? this->loop : this->buildup).sample_count
       * GetChannelCount(type) * /* bytes per sample */ 2;
   }
+  /** Returns how many frames (samples per channel) the song has. */
+  int GetFrameCount(const Type type) const {
+    return (type == Type::LOOP ? this->loop : this->buildup).sample_count;
+  }
   int GetChannelCount(const Type type) const {
     return (type == Type::LOOP ? this->loop : this->buildup).channel_count;
   }
@@ -197,20 +269,6 @@ public:
    */
   void ReadAndDecode(const Type audio_type);
 
-  static Beat ParseBeatCharacter(const char beatChar) {
-    switch (beatChar) {
-      case 'x': return Beat::VERTICAL_BLUR;
-      case 'o': return Beat::HORIZONTAL_BLUR;
-      case '-': return Beat::NO_BLUR;
-      case '+': return Beat::BLACKOUT;
-      case '|': return Beat::SHORT_BLACKOUT;
-      case ':': return Beat::COLOR_ONLY;
-      case '*': return Beat::IMAGE_ONLY;
-      case '.': return Beat::NO_TRANSITION;
-    }
-    return Beat::NO_TRANSITION;
-  }
-
 private:
 
   void SetBuildupBeatmap(const string& beatmap) { this->buildup.beatmap = beatmap; }
@@ -219,16 +277,20 @@ private:
   struct song_info {
     const string name;
     string beatmap;
+    BeatTimeline timeline;
     uint8_t *pcm_data;
     int channel_count;
     int sample_count;
     int sample_rate;
+    // At normal tempo.
     double usec_per_beat;
 
     song_info(const string& name) : name(name) {}
   } buildup;
   struct song_info loop;
 
+  double tempo = 1.;
+
   const string base_path;
   const string song_title;
 };
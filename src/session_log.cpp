@@ -0,0 +1,167 @@
+#include <cstring>
+
+#include <session_log.hpp>
+
+static const char kMagic[8] = { 'H', 'U', 'E', 'S', 'L', 'O', 'G', '1' };
+
+/** Record tags. */
+static const uint8_t kNameTag = 'N';
+static const uint8_t kBeatTag = 'B';
+
+/** Name id meaning "none", for triggered beats and beats that keep the image. */
+static const uint16_t kNoName = 0xffff;
+
+/** Size of a beat record after its tag. */
+static const size_t kBeatRecordSize = 8 + 4 + 2 + 2 + 1 + 1 + 1 + 1;
+
+template<typename T> static uint8_t* Put(uint8_t *out, const T value) {
+  memcpy(out, &value, sizeof(T));
+  return out + sizeof(T);
+}
+
+template<typename T> static const uint8_t* Get(const uint8_t *in, T *value) {
+  memcpy(value, in, sizeof(T));
+  return in + sizeof(T);
+}
+
+bool SessionRecorder::Open(const string& path, const uint64_t seed) {
+  this->file = fopen(path.c_str(), "wb");
+  if (!this->file) {
+    ERR("Couldn't create session log [" + path + "].");
+    return false;
+  }
+
+  // Big enough that recording a beat almost never has to hit the disk.
+  setvbuf(this->file, NULL, _IOFBF, 1 << 16);
+  fwrite(kMagic, sizeof(kMagic), 1, this->file);
+  fwrite(&seed, sizeof(seed), 1, this->file);
+  LOG("Recording session to [" + path + "].");
+  return true;
+}
+
+uint16_t SessionRecorder::GetNameId(const void *key, const string& name) {
+  if (!key) {
+    return kNoName;
+  }
+  auto it = this->name_ids.find(key);
+  if (it != this->name_ids.end()) {
+    return it->second;
+  }
+
+  uint16_t id = (uint16_t) this->name_ids.size();
+  this->name_ids[key] = id;
+  uint8_t header[1 + 2 + 2];
+  uint8_t *out = Put(header, kNameTag);
+  out = Put(out, id);
+  Put(out, (uint16_t) name.size());
+  fwrite(header, sizeof(header), 1, this->file);
+  fwrite(name.data(), name.size(), 1, this->file);
+  return id;
+}
+
+void SessionRecorder::Record(const BeatEvent& beat, const int64_t offset_usec) {
+  if (!this->file) {
+    return;
+  }
+
+  uint16_t song_id = this->GetNameId(beat.song, beat.song ? beat.song->GetTitle() : "");
+  uint16_t image_id = this->GetNameId(beat.image, beat.image ? beat.image->GetName() : "");
+
+  uint8_t record[1 + kBeatRecordSize];
+  uint8_t *out = Put(record, kBeatTag);
+  out = Put(out, offset_usec);
+  out = Put(out, (uint32_t) beat.beat);
+  out = Put(out, song_id);
+  out = Put(out, image_id);
+  out = Put(out, (uint8_t) beat.type);
+  out = Put(out, (uint8_t) beat.transition);
+  out = Put(out, beat.actions);
+  Put(out, (int8_t) beat.color_index);
+  fwrite(record, sizeof(record), 1, this->file);
+  this->record_count++;
+}
+
+void SessionRecorder::Close() {
+  if (this->file) {
+    fclose(this->file);
+    this->file = NULL;
+    LOG("Recorded [" + to_string(this->record_count) + "] beats.");
+  }
+}
+
+SessionReader::~SessionReader() {
+  if (this->file) {
+    fclose(this->file);
+  }
+}
+
+bool SessionReader::Open(const string& path) {
+  this->file = fopen(path.c_str(), "rb");
+  if (!this->file) {
+    ERR("Couldn't open session log [" + path + "].");
+    return false;
+  }
+
+  char magic[sizeof(kMagic)];
+  if (fread(magic, sizeof(magic), 1, this->file) != 1 || memcmp(magic, kMagic, sizeof(magic))
+      || fread(&this->seed, sizeof(this->seed), 1, this->file) != 1) {
+    ERR("[" + path + "] is not a session log.");
+    return false;
+  }
+  return true;
+}
+
+bool SessionReader::Read(SessionRecord *record) {
+  uint8_t tag;
+  while (fread(&tag, 1, 1, this->file) == 1) {
+    if (tag == kNameTag) {
+      uint8_t header[2 + 2];
+      uint16_t id, len;
+      if (fread(header, sizeof(header), 1, this->file) != 1) {
+        break;
+      }
+      Get(Get(header, &id), &len);
+      string name(len, '\0');
+      if (id != this->names.size() || (len && fread(&name[0], len, 1, this->file) != 1)) {
+        break;
+      }
+      this->names.push_back(name);
+      continue;
+    }
+    if (tag != kBeatTag) {
+      break;
+    }
+
+    uint8_t data[kBeatRecordSize];
+    if (fread(data, sizeof(data), 1, this->file) != 1) {
+      break;
+    }
+    uint16_t song_id, image_id;
+    uint8_t type, transition;
+    int8_t color_index;
+    const uint8_t *in = Get(data, &record->offset_usec);
+    in = Get(in, &record->beat);
+    in = Get(in, &song_id);
+    in = Get(in, &image_id);
+    in = Get(in, &type);
+    in = Get(in, &transition);
+    in = Get(in, &record->actions);
+    Get(in, &color_index);
+    if ((song_id != kNoName && song_id >= this->names.size())
+        || (image_id != kNoName && image_id >= this->names.size())) {
+      break;
+    }
+
+    record->song_title = song_id == kNoName ? "" : this->names[song_id];
+    record->image_name = image_id == kNoName ? "" : this->names[image_id];
+    record->type = (AudioResource::Type) type;
+    record->transition = (AudioResource::Beat) transition;
+    record->color_index = color_index;
+    return true;
+  }
+
+  if (!feof(this->file)) {
+    ERR("Session log is corrupt; stopping early.");
+  }
+  return false;
+}
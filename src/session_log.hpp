@@ -0,0 +1,116 @@
+#ifndef HUES_SESSION_LOG_H_
+#define HUES_SESSION_LOG_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <beat_events.hpp>
+#include <common.hpp>
+
+using namespace std;
+
+/** One beat read back from a session log. Songs and images are referred to by name. */
+struct SessionRecord {
+  // When the beat was due, relative to the start of the session.
+  int64_t offset_usec;
+
+  // Empty for triggered beats.
+  string song_title;
+  AudioResource::Type type;
+  uint32_t beat;
+
+  AudioResource::Beat transition;
+  uint8_t actions;
+  // Empty if the beat doesn't change the image.
+  string image_name;
+  int color_index;
+};
+
+/**
+ * Writes a compact binary log of every visible beat applied during a session: what was drawn, and
+ * when. Replaying it drives the renderer through exactly the same workload again.
+ *
+ * The file is an 8-byte magic, the session's random seed, and then a stream of tagged records:
+ * names (song titles and image names, each written the first time it's used) and beats referring
+ * to them by id. Numbers are in native byte order; logs are meant to be replayed on the machine
+ * that recorded them.
+ */
+class SessionRecorder {
+  DISALLOW_COPY_AND_ASSIGN(SessionRecorder)
+
+  public:
+
+    SessionRecorder() {}
+    ~SessionRecorder() { this->Close(); }
+
+    /**
+     * Creates the log file and writes its header.
+     *
+     * @param path where to write the log.
+     * @param seed the seed the session's random choices were made with.
+     * @return <code>true</code> if the file could be created, <code>false</code> otherwise.
+     */
+    bool Open(const string& path, const uint64_t seed);
+
+    /**
+     * Appends a beat to the log. Only allocates the first time a song or image shows up.
+     *
+     * @param beat the beat that was just applied.
+     * @param offset_usec when it was due, relative to the start of the session.
+     */
+    void Record(const BeatEvent& beat, const int64_t offset_usec);
+
+    /** Flushes and closes the log. */
+    void Close();
+
+    bool IsOpen() const { return this->file != NULL; }
+    uint64_t GetRecordCount() const { return this->record_count; }
+
+  private:
+
+    /** Returns the id for a name, writing it to the log if it's new. */
+    uint16_t GetNameId(const void *key, const string& name);
+
+    FILE *file = NULL;
+    unordered_map<const void*, uint16_t> name_ids;
+    uint64_t record_count = 0;
+};
+
+/** Reads back a log written by SessionRecorder. */
+class SessionReader {
+  DISALLOW_COPY_AND_ASSIGN(SessionReader)
+
+  public:
+
+    SessionReader() {}
+    ~SessionReader();
+
+    /**
+     * Opens a log and reads its header.
+     *
+     * @return <code>true</code> if the file is a session log, <code>false</code> otherwise.
+     */
+    bool Open(const string& path);
+
+    /** Returns the seed the recorded session ran with. */
+    uint64_t GetSeed() const { return this->seed; }
+
+    /**
+     * Reads the next beat.
+     *
+     * @return <code>false</code> at the end of the log or if it's corrupt, <code>true</code>
+     *     otherwise.
+     */
+    bool Read(SessionRecord *record);
+
+  private:
+
+    FILE *file = NULL;
+    uint64_t seed = 0;
+    vector<string> names;
+};
+
+#endif // HUES_SESSION_LOG_H_
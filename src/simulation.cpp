@@ -0,0 +1,121 @@
+#include <cmath>
+
+#include <simulation.hpp>
+
+using namespace std;
+
+#ifndef HUES_COUNT_ALLOCATIONS
+uint64_t Simulation::GetAllocationCount() {
+  return 0;
+}
+#endif
+
+bool NullAudioRenderer::Init(const int channels, const int sample_rate) {
+  this->bytes_per_second = (double) sample_rate * channels * /* bytes per sample */ 2;
+  return true;
+}
+
+uint64_t NullAudioRenderer::PlayLoop(const uint8_t* const pcm_data, const size_t len,
+    const size_t loop_begin, const size_t loop_end) {
+  if (this->segments.empty()) {
+    this->start_usec = this->clock->NowUsec();
+  }
+  this->segments.push_back(PcmSegment { pcm_data, len, loop_begin, loop_end, 1.f });
+  return this->segments.size();
+}
+
+double NullAudioRenderer::GetPlaybackPosition(uint64_t *loop_count, double *loop_start) const {
+  double position = (this->clock->NowUsec() - this->start_usec)
+      * this->bytes_per_second * this->tempo / 1000 / 1000;
+
+  *loop_count = 0;
+  *loop_start = 0.;
+
+  double offset = 0.;
+  for (size_t i = 0; i < this->segments.size() && position >= offset; i++) {
+    const PcmSegment& segment = this->segments[i];
+    double loop_begin = offset + segment.loop_begin;
+
+    if (segment.IsLooping() && position >= loop_begin) {
+      if (i + 1 == this->segments.size()) {
+        double loop_len = segment.loop_end - segment.loop_begin;
+        double iteration = floor((position - loop_begin) / loop_len);
+        *loop_count += (uint64_t) iteration + 1;
+        *loop_start = loop_begin + iteration * loop_len;
+        break;
+      }
+      *loop_count += 1;
+      *loop_start = loop_begin;
+    }
+    offset += segment.len;
+  }
+
+  return position;
+}
+
+uint64_t NullAudioRenderer::GetLoopCount() const {
+  uint64_t loop_count;
+  double loop_start;
+  this->GetPlaybackPosition(&loop_count, &loop_start);
+  return loop_count;
+}
+
+int64_t NullAudioRenderer::GetLoopStartDelayUsec() const {
+  uint64_t loop_count;
+  double loop_start;
+  double position = this->GetPlaybackPosition(&loop_count, &loop_start);
+  return (int64_t) ((loop_start - position) / (this->bytes_per_second * this->tempo) * 1000 * 1000);
+}
+
+uint64_t NullAudioRenderer::GetSegmentCount() const {
+  double segment_start;
+  return this->GetSegmentStart(&segment_start);
+}
+
+int64_t NullAudioRenderer::GetSegmentStartDelayUsec() const {
+  double segment_start;
+  this->GetSegmentStart(&segment_start);
+  uint64_t loop_count;
+  double loop_start;
+  double position = this->GetPlaybackPosition(&loop_count, &loop_start);
+  return (int64_t) ((segment_start - position) / (this->bytes_per_second * this->tempo)
+      * 1000 * 1000);
+}
+
+uint64_t NullAudioRenderer::GetSegmentStart(double *segment_start) const {
+  uint64_t loop_count;
+  double loop_start;
+  double position = this->GetPlaybackPosition(&loop_count, &loop_start);
+
+  // Every buffer but the last plays through once, so each one starts where the last one ended.
+  uint64_t started = 0;
+  double offset = 0.;
+  *segment_start = 0.;
+  for (size_t i = 0; i < this->segments.size() && position >= offset; i++) {
+    started = i + 1;
+    *segment_start = offset;
+    offset += this->segments[i].len;
+  }
+  return started;
+}
+
+void NullVideoRenderer::ApplyBeat(const BeatEvent& beat) {
+  uint8_t expected = BeatTimeline::GetActionsForBeat(beat.transition);
+  if (beat.actions != expected || beat.sequence >= this->upcoming_count
+      || ((beat.actions & BeatTimeline::kChangeColor)
+          && (beat.color_index < 0 || beat.color_index >= 0x40))) {
+    this->anomalies++;
+  }
+
+  this->image_changes += (beat.actions & BeatTimeline::kChangeImage) ? 1 : 0;
+  this->color_changes += (beat.actions & BeatTimeline::kChangeColor) ? 1 : 0;
+}
+
+bool NullVideoRenderer::QueueUpcomingBeat(const BeatEvent& beat) {
+  // Beats have to come in order, with none missing.
+  if (beat.sequence != this->upcoming_count) {
+    this->anomalies++;
+  }
+  this->upcoming_count = beat.sequence + 1;
+  return true;
+}
@@ -0,0 +1,120 @@
+#ifndef HUES_SIMULATION_H_
+#define HUES_SIMULATION_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <audio_renderer.hpp>
+#include <clock.hpp>
+#include <common.hpp>
+#include <video_renderer.hpp>
+
+/**
+ * An AudioRenderer that plays nothing, but reports loop progress as if the queued audio were being
+ * played in real time on the given clock, with zero latency.
+ *
+ * It models the way HuesLogic uses a renderer for a single song: a looping segment loops forever if
+ * it's the last thing queued, and plays through once otherwise.
+ */
+class NullAudioRenderer : public AudioRenderer {
+  DISALLOW_COPY_AND_ASSIGN(NullAudioRenderer)
+
+  public:
+
+    explicit NullAudioRenderer(const Clock *clock) : clock(clock) {}
+    ~NullAudioRenderer() {}
+
+    bool Init(const int channels, const int sample_rate) override;
+    void SetThreadPolicy(const ThreadPolicy& policy) override {}
+    uint64_t PlayLoop(const uint8_t* const pcm_data, const size_t len,
+        const size_t loop_begin, const size_t loop_end) override;
+
+    void SetTempo(const float tempo) override { this->tempo = tempo; }
+    float GetTempo() const override { return this->tempo; }
+    void SetVolume(const float volume) override {}
+    void SetSongGain(const float gain) override {}
+
+    uint64_t GetLoopCount() const override;
+    int64_t GetOutputLatencyUsec() const override { return 0; }
+    int64_t GetLoopStartDelayUsec() const override;
+    uint64_t GetSegmentCount() const override;
+    int64_t GetSegmentStartDelayUsec() const override;
+    const AudioClock& GetClock() const override { return this->audio_clock; }
+    const AudioStats& GetStats() const override { return this->stats; }
+
+  private:
+
+    /**
+     * Works out where playback is: how many loop iterations have started, and the stream byte
+     * offset at which the latest one started.
+     *
+     * @return the stream byte offset being played right now.
+     */
+    double GetPlaybackPosition(uint64_t *loop_count, double *loop_start) const;
+
+    /**
+     * Works out which buffer is playing, and the stream byte offset at which it started.
+     *
+     * @return the number of buffers started so far.
+     */
+    uint64_t GetSegmentStart(double *segment_start) const;
+
+    const Clock *clock;
+    AudioStats stats;
+    // Nothing is played, so this never moves.
+    AudioClock audio_clock;
+
+    double bytes_per_second = 0.;
+    float tempo = 1.f;
+
+    std::vector<PcmSegment> segments;
+    int64_t start_usec = 0;
+};
+
+/** A VideoRenderer that draws nothing, but checks and counts what it's asked to draw. */
+class NullVideoRenderer : public VideoRenderer {
+  DISALLOW_COPY_AND_ASSIGN(NullVideoRenderer)
+
+  public:
+
+    NullVideoRenderer() {}
+    ~NullVideoRenderer() {}
+
+    void ApplyBeat(const BeatEvent& beat) override;
+    bool QueueUpcomingBeat(const BeatEvent& beat) override;
+    void SetSpectrumAnalyzer(const SpectrumAnalyzer *spectrum) override {}
+
+    uint64_t GetImageChanges() const { return this->image_changes; }
+    uint64_t GetColorChanges() const { return this->color_changes; }
+    /**
+     * Returns the number of requests that made no sense, like an image change on a color beat, or a
+     * beat applied without having been queued up first.
+     */
+    uint64_t GetAnomalies() const { return this->anomalies; }
+
+  private:
+
+    uint64_t upcoming_count = 0;
+    uint64_t image_changes = 0;
+    uint64_t color_changes = 0;
+    uint64_t anomalies = 0;
+};
+
+namespace Simulation {
+
+/**
+ * Whether heap allocations are counted. Counting replaces the global allocator, so it's only built
+ * in when configured with -DHUES_COUNT_ALLOCATIONS=ON.
+ */
+#ifdef HUES_COUNT_ALLOCATIONS
+static const bool kCountsAllocations = true;
+#else
+static const bool kCountsAllocations = false;
+#endif
+
+/** Returns the number of heap allocations the process has made so far; 0 if not counting. */
+uint64_t GetAllocationCount();
+
+}
+
+#endif // HUES_SIMULATION_H_
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <spectrum_analyzer.hpp>
+
+using namespace std;
+
+/** Frequency range covered by the bands, in Hz. */
+static const float kLowestBandHz = 40.f;
+static const float kHighestBandHz = 16000.f;
+
+/** Level range mapped onto [0,1]. */
+static const float kFloorDb = -60.f;
+
+/** Band levels are multiplied by this every Analyze() call when the audio gets quieter. */
+static const float kLevelDecay = 0.85f;
+
+SpectrumAnalyzer::SpectrumAnalyzer(const int sample_rate) {
+  int bits = 0;
+  while ((1 << bits) < kFftSize) {
+    bits++;
+  }
+
+  for (int i = 0; i < kFftSize; i++) {
+    this->window[i] = 0.5f - 0.5f * cos(2 * M_PI * i / (kFftSize - 1));
+
+    int reversed = 0;
+    for (int bit = 0; bit < bits; bit++) {
+      reversed |= ((i >> bit) & 1) << (bits - 1 - bit);
+    }
+    this->bit_reverse[i] = reversed;
+  }
+
+  // The stage that combines pairs of half-size h transforms uses twiddles [h - 1, 2h - 1).
+  for (int half = 1; half < kFftSize; half <<= 1) {
+    for (int k = 0; k < half; k++) {
+      this->twiddle_re[half - 1 + k] = cos(-M_PI * k / half);
+      this->twiddle_im[half - 1 + k] = sin(-M_PI * k / half);
+    }
+  }
+
+  float highest_hz = min(kHighestBandHz, sample_rate / 2.f);
+  for (int band = 0; band <= kBandCount; band++) {
+    float hz = kLowestBandHz * pow(highest_hz / kLowestBandHz, (float) band / kBandCount);
+    int bin = (int) (hz * kFftSize / sample_rate);
+    bin = max(bin, band ? this->band_edges[band - 1] + 1 : 1);
+    this->band_edges[band] = min(bin, kFftSize / 2);
+  }
+
+  for (auto& level : this->band_levels) {
+    level.store(0.f, memory_order_relaxed);
+  }
+}
+
+void SpectrumAnalyzer::Analyze(const int16_t *pcm, const size_t frame_count,
+    const size_t position) {
+  int64_t start_usec = MonotonicTimeUsec();
+
+  // Mix down to mono, window, and load into bit-reversed order for the FFT.
+  size_t end = min(position, frame_count);
+  size_t begin = end >= (size_t) kFftSize ? end - kFftSize : 0;
+  for (int i = 0; i < kFftSize; i++) {
+    size_t frame = begin + i;
+    float sample = frame < end ? (pcm[frame * 2] + pcm[frame * 2 + 1]) * (0.5f / 32768.f) : 0.f;
+    this->re[this->bit_reverse[i]] = sample * this->window[i];
+    this->im[this->bit_reverse[i]] = 0.f;
+  }
+
+  this->Transform();
+
+  // A full scale sine through a Hann window peaks at N/4 in its bin.
+  const float full_scale = (kFftSize / 4.f) * (kFftSize / 4.f);
+  for (int band = 0; band < kBandCount; band++) {
+    float energy = 0.f;
+    for (int bin = this->band_edges[band]; bin < this->band_edges[band + 1]; bin++) {
+      energy += this->re[bin] * this->re[bin] + this->im[bin] * this->im[bin];
+    }
+
+    float db = 10.f * log10(energy / full_scale + 1e-12f);
+    float level = min(max((db - kFloorDb) / -kFloorDb, 0.f), 1.f);
+    float decayed = this->band_levels[band].load(memory_order_relaxed) * kLevelDecay;
+    this->band_levels[band].store(max(level, decayed), memory_order_relaxed);
+  }
+
+  int64_t elapsed_usec = MonotonicTimeUsec() - start_usec;
+  this->analyze_count.fetch_add(1, memory_order_relaxed);
+  this->analyze_total_usec.fetch_add(elapsed_usec, memory_order_relaxed);
+  if (elapsed_usec > this->analyze_max_usec.load(memory_order_relaxed)) {
+    this->analyze_max_usec.store(elapsed_usec, memory_order_relaxed);
+  }
+}
+
+void SpectrumAnalyzer::Transform() {
+  for (int half = 1; half < kFftSize; half <<= 1) {
+    const float *w_re = this->twiddle_re + half - 1;
+    const float *w_im = this->twiddle_im + half - 1;
+
+    for (int block = 0; block < kFftSize; block += 2 * half) {
+      float *a_re = this->re + block;
+      float *a_im = this->im + block;
+      float *b_re = a_re + half;
+      float *b_im = a_im + half;
+
+      int k = 0;
+#ifdef __SSE__
+      // Four butterflies at a time once the blocks are wide enough.
+      for (; k + 4 <= half; k += 4) {
+        __m128 wr = _mm_loadu_ps(w_re + k);
+        __m128 wi = _mm_loadu_ps(w_im + k);
+        __m128 br = _mm_loadu_ps(b_re + k);
+        __m128 bi = _mm_loadu_ps(b_im + k);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+        __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+        __m128 ar = _mm_loadu_ps(a_re + k);
+        __m128 ai = _mm_loadu_ps(a_im + k);
+        _mm_storeu_ps(b_re + k, _mm_sub_ps(ar, tr));
+        _mm_storeu_ps(b_im + k, _mm_sub_ps(ai, ti));
+        _mm_storeu_ps(a_re + k, _mm_add_ps(ar, tr));
+        _mm_storeu_ps(a_im + k, _mm_add_ps(ai, ti));
+      }
+#endif
+      for (; k < half; k++) {
+        float tr = b_re[k] * w_re[k] - b_im[k] * w_im[k];
+        float ti = b_re[k] * w_im[k] + b_im[k] * w_re[k];
+        b_re[k] = a_re[k] - tr;
+        b_im[k] = a_im[k] - ti;
+        a_re[k] += tr;
+        a_im[k] += ti;
+      }
+    }
+  }
+}
+
+float SpectrumAnalyzer::GetAverageLevel(const int first, const int last) const {
+  float sum = 0.f;
+  for (int band = first; band < last; band++) {
+    sum += this->GetBandLevel(band);
+  }
+  return last > first ? sum / (last - first) : 0.f;
+}
+
+int64_t SpectrumAnalyzer::GetAverageAnalyzeUsec() const {
+  uint64_t count = this->GetAnalyzeCount();
+  return count ? this->analyze_total_usec.load(memory_order_relaxed) / (int64_t) count : 0;
+}
@@ -0,0 +1,87 @@
+#ifndef HUES_SPECTRUM_ANALYZER_H_
+#define HUES_SPECTRUM_ANALYZER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * Computes per-band energies of the audio around the current playback position, for audio-reactive
+ * visuals.
+ *
+ * One thread calls Analyze() (at most once per video frame; each call is one fixed-size FFT, so its
+ * cost is bounded). Any thread may call GetBandLevel() at any time; band levels are published
+ * through atomics and never block.
+ */
+class SpectrumAnalyzer {
+  DISALLOW_COPY_AND_ASSIGN(SpectrumAnalyzer)
+
+  public:
+
+    /** FFT size in frames. 1024 frames is ~23ms at 44.1kHz. */
+    static const int kFftSize = 1024;
+    /** Number of logarithmically spaced bands we report. */
+    static const int kBandCount = 8;
+
+    /** The bass bands, for things that should pump with the kick. */
+    static const int kBassBands = 2;
+
+    explicit SpectrumAnalyzer(const int sample_rate);
+    ~SpectrumAnalyzer() {}
+
+    /**
+     * Analyzes the kFftSize frames of 16-bit interleaved stereo PCM leading up to a position, and
+     * publishes the new band levels.
+     *
+     * @param pcm the start of the PCM buffer.
+     * @param frame_count the number of frames in the buffer.
+     * @param position the frame currently being played.
+     */
+    void Analyze(const int16_t *pcm, const size_t frame_count, const size_t position);
+
+    /**
+     * Returns the level of a band, in [0,1]: 0 is -60dBFS or quieter, 1 is full scale. Levels rise
+     * instantly and fall off smoothly.
+     */
+    float GetBandLevel(const int band) const {
+      return this->band_levels[band].load(std::memory_order_relaxed);
+    }
+    /** Returns the average level of the bands in [first, last). */
+    float GetAverageLevel(const int first, const int last) const;
+
+    /** Returns the number of Analyze() calls so far. */
+    uint64_t GetAnalyzeCount() const { return this->analyze_count.load(std::memory_order_relaxed); }
+    /** Returns the average and worst-case cost of an Analyze() call. */
+    int64_t GetAverageAnalyzeUsec() const;
+    int64_t GetMaxAnalyzeUsec() const {
+      return this->analyze_max_usec.load(std::memory_order_relaxed);
+    }
+
+  private:
+
+    /** In-place radix-2 FFT over this->re and this->im. */
+    void Transform();
+
+    // Hann window, bit reversal permutation, and per-stage twiddle factors laid out contiguously so
+    // that the butterflies run over unit-stride arrays.
+    float window[kFftSize];
+    int bit_reverse[kFftSize];
+    float twiddle_re[kFftSize];
+    float twiddle_im[kFftSize];
+
+    // First FFT bin of each band; band i covers [band_edges[i], band_edges[i + 1]).
+    int band_edges[kBandCount + 1];
+
+    alignas(16) float re[kFftSize];
+    alignas(16) float im[kFftSize];
+
+    std::atomic<float> band_levels[kBandCount];
+
+    std::atomic<uint64_t> analyze_count{0};
+    std::atomic<int64_t> analyze_total_usec{0};
+    std::atomic<int64_t> analyze_max_usec{0};
+};
+
+#endif // HUES_SPECTRUM_ANALYZER_H_
@@ -0,0 +1,385 @@
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <filesystem.hpp>
+#include <texel_cache.hpp>
+
+static const char kMagic[8] = { 'H', 'U', 'E', 'S', 'T', 'E', 'X', '2' };
+static const char kRecordMagic[8] = { 'H', 'U', 'E', 'S', 'R', 'E', 'F', '1' };
+
+/** Texels start this far into an entry, which keeps them cache line aligned once mapped. */
+static const size_t kTexelOffset = 64;
+
+/** Rows of texels are padded to a multiple of this, as GL_UNPACK_ALIGNMENT expects by default. */
+static const uint32_t kRowAlignment = 4;
+
+/**
+ * Size of the header at the start of each entry: the magic, the key, the width, height and
+ * channels, the row alignment and size, and the texels' offset and size.
+ */
+static const size_t kHeaderSize = 8 + 8 + 4 + 4 + 4 + 4 + 4 + 8 + 8;
+static_assert(kHeaderSize <= kTexelOffset, "The header should fit ahead of the texels.");
+
+/**
+ * Size of the start of each record, ahead of the path it's for: the magic, the file's size and
+ * modification time, its hash, and the length of the path.
+ */
+static const size_t kRecordHeaderSize = 8 + 8 + 8 + 8 + 4;
+
+template<typename T> static uint8_t* Put(uint8_t *out, const T value) {
+  memcpy(out, &value, sizeof(T));
+  return out + sizeof(T);
+}
+
+template<typename T> static const uint8_t* Get(const uint8_t *in, T *value) {
+  memcpy(value, in, sizeof(T));
+  return in + sizeof(T);
+}
+
+/** Mixes whole words into a hash, each with a multiply and a shift. */
+static uint64_t MixWords(uint64_t h, const uint8_t *words, const size_t size) {
+  for (size_t offset = 0; offset < size; offset += sizeof(uint64_t)) {
+    uint64_t word;
+    Get(words + offset, &word);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+/** Finishes off a hash with the length (splitmix64's finalizer), so that trailing zeros count. */
+static uint64_t FinishHash(uint64_t h, const uint64_t total) {
+  h ^= total;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+static size_t GetRowBytes(const int width, const int channels) {
+  return ((size_t) width * channels + kRowAlignment - 1) / kRowAlignment * kRowAlignment;
+}
+
+/**
+ * Gets a file's size and modification time, in nanoseconds (100ns units on Windows) since
+ * whenever the system counts from.
+ */
+static bool GetFileStamp(const string& path, uint64_t *size, uint64_t *mtime) {
+#ifdef WIN32
+  WIN32_FILE_ATTRIBUTE_DATA info;
+  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info)) {
+    return false;
+  }
+  *size = ((uint64_t) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  *mtime = ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32)
+      | info.ftLastWriteTime.dwLowDateTime;
+  return true;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return false;
+  }
+#ifdef __APPLE__
+  const struct timespec& modified = info.st_mtimespec;
+#else
+  const struct timespec& modified = info.st_mtim;
+#endif
+  *size = (uint64_t) info.st_size;
+  *mtime = (uint64_t) modified.tv_sec * 1000 * 1000 * 1000 + (uint64_t) modified.tv_nsec;
+  return true;
+#endif
+}
+
+/**
+ * Maps a whole file into memory, read only. Where the system can, it's read in up front, so that
+ * whoever reads it later (the render thread, uploading texels) doesn't fault it in page by page.
+ */
+static bool MapFile(const string& path, void **base, size_t *size) {
+#ifdef WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  HANDLE mapping = NULL;
+  *base = NULL;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  }
+  if (mapping) {
+    *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    *size = (size_t) file_size.QuadPart;
+    CloseHandle(mapping);
+  }
+  CloseHandle(file);
+  return *base != NULL;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  *base = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    *size = (size_t) info.st_size;
+#ifdef MAP_POPULATE
+    *base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+    *base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+  }
+  close(fd);
+  return *base != MAP_FAILED;
+#endif
+}
+
+static void UnmapFile(void *base, const size_t size) {
+#ifdef WIN32
+  UnmapViewOfFile(base);
+#else
+  munmap(base, size);
+#endif
+}
+
+/** Moves a file over another, which readers see happen all at once. */
+static bool MoveIntoPlace(const string& from, const string& to) {
+#ifdef WIN32
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static unsigned long GetOwnProcessId() {
+#ifdef WIN32
+  return GetCurrentProcessId();
+#else
+  return (unsigned long) getpid();
+#endif
+}
+
+string TexelCache::GetDefaultDirectory() {
+#ifdef WIN32
+  const char *local_app_data = getenv("LOCALAPPDATA");
+  return local_app_data && *local_app_data
+      ? string(local_app_data) + "\\0x40hues\\textures" : "";
+#else
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home && *cache_home) {
+    return string(cache_home) + "/0x40hues/textures";
+  }
+  const char *home = getenv("HOME");
+  return home && *home ? string(home) + "/.cache/0x40hues/textures" : "";
+#endif
+}
+
+bool TexelCache::Init(const string& directory) {
+  if (directory.empty() || !FileSystem::MakeDirectories(directory)) {
+    ERR("Couldn't create texture cache directory [" + directory + "]; not caching textures.");
+    return false;
+  }
+
+  this->directory = directory;
+  LOG("Caching decoded textures in [" + directory + "].");
+  return true;
+}
+
+bool TexelCache::HashFile(const string& path, uint64_t *hash) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  // This only needs to tell images apart, not stand up to anyone making collisions on purpose.
+  static const size_t kChunkSize = 1 << 16;
+  static_assert(kChunkSize % sizeof(uint64_t) == 0, "Chunks should be whole words.");
+  vector<uint8_t> chunk(kChunkSize);
+  uint64_t h = 0;
+  uint64_t total = 0;
+  size_t read;
+  while ((read = fread(chunk.data(), 1, kChunkSize, file)) > 0) {
+    // Pad a short last word with zeros.
+    memset(chunk.data() + read, 0, min(kChunkSize - read, sizeof(uint64_t)));
+    h = MixWords(h, chunk.data(), read);
+    total += read;
+  }
+  bool ok = !ferror(file);
+  fclose(file);
+
+  *hash = FinishHash(h, total);
+  return ok;
+}
+
+bool TexelCache::GetKey(const string& path, uint64_t *key) {
+  // Stat before hashing: if the file changes in between, its new time makes the record stale.
+  uint64_t size, mtime;
+  if (!GetFileStamp(path, &size, &mtime)) {
+    return false;
+  }
+  const string record_path = this->GetRecordPath(path);
+  if (ReadRecord(record_path, path, size, mtime, key)) {
+    return true;
+  }
+
+  if (!HashFile(path, key)) {
+    return false;
+  }
+  this->files_hashed.fetch_add(1, memory_order_relaxed);
+
+  uint8_t header[kRecordHeaderSize];
+  memcpy(header, kRecordMagic, sizeof(kRecordMagic));
+  uint8_t *out = Put(header + sizeof(kRecordMagic), size);
+  out = Put(out, mtime);
+  out = Put(out, *key);
+  Put(out, (uint32_t) path.size());
+  this->WriteFile(record_path, header, sizeof(header),
+      reinterpret_cast<const uint8_t*>(path.data()), path.size());
+  return true;
+}
+
+bool TexelCache::ReadRecord(const string& record_path, const string& path, const uint64_t size,
+    const uint64_t mtime, uint64_t *key) {
+  FILE *file = fopen(record_path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  uint8_t header[kRecordHeaderSize];
+  string record_for;
+  bool ok = fread(header, sizeof(header), 1, file) == 1
+      && !memcmp(header, kRecordMagic, sizeof(kRecordMagic));
+  uint64_t record_size = 0, record_mtime = 0, record_key = 0;
+  uint32_t path_size = 0;
+  if (ok) {
+    const uint8_t *in = Get(header + sizeof(kRecordMagic), &record_size);
+    in = Get(in, &record_mtime);
+    in = Get(in, &record_key);
+    Get(in, &path_size);
+    ok = path_size == path.size();
+  }
+  if (ok) {
+    record_for.resize(path_size);
+    ok = fread(&record_for[0], 1, path_size, file) == path_size;
+  }
+  fclose(file);
+
+  // Another path that happens to share the record's name, or a file that's changed since, means
+  // hashing it again.
+  if (!ok || record_for != path || record_size != size || record_mtime != mtime) {
+    return false;
+  }
+  *key = record_key;
+  return true;
+}
+
+string TexelCache::GetRecordPath(const string& path) const {
+  // Pad the path to whole words, as HashFile() does the file.
+  vector<uint8_t> words((path.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t)
+      * sizeof(uint64_t));
+  memcpy(words.data(), path.data(), path.size());
+  char name[16 + 1];
+  snprintf(name, sizeof(name), "%016llx",
+      (unsigned long long) FinishHash(MixWords(0, words.data(), words.size()), path.size()));
+  return this->directory + "/" + name + ".ref";
+}
+
+string TexelCache::GetEntryPath(const uint64_t key, const int channels) const {
+  char name[16 + 1 + 11 + 1];
+  snprintf(name, sizeof(name), "%016llx-%d", (unsigned long long) key, channels);
+  return this->directory + "/" + name + ".tex";
+}
+
+bool TexelCache::Map(const uint64_t key, const int channels, Mapping *mapping) {
+  void *base;
+  size_t size;
+  if (!MapFile(this->GetEntryPath(key, channels), &base, &size)) {
+    this->misses.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+
+  // Anything that doesn't add up, like an entry from another version or a write cut short, is
+  // treated as missing; storing the image again replaces it.
+  const uint8_t *in = static_cast<const uint8_t*>(base);
+  uint64_t entry_key = 0;
+  uint32_t width = 0, height = 0, entry_channels = 0, row_alignment = 0, row_bytes = 0;
+  uint64_t texel_offset = 0, texel_size = 0;
+  if (size >= kHeaderSize && !memcmp(in, kMagic, sizeof(kMagic))) {
+    in = Get(in + sizeof(kMagic), &entry_key);
+    in = Get(in, &width);
+    in = Get(in, &height);
+    in = Get(in, &entry_channels);
+    in = Get(in, &row_alignment);
+    in = Get(in, &row_bytes);
+    in = Get(in, &texel_offset);
+    Get(in, &texel_size);
+  }
+  if (entry_key != key || entry_channels != (uint32_t) channels || row_alignment != kRowAlignment
+      || !width || !height || row_bytes != GetRowBytes(width, channels)
+      || texel_size != (uint64_t) row_bytes * height || texel_offset != kTexelOffset
+      || size < texel_offset + texel_size) {
+    UnmapFile(base, size);
+    this->misses.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+
+  *mapping = Mapping { base, size, static_cast<const png_byte*>(base) + texel_offset,
+      (size_t) texel_size, (int) width, (int) height };
+  this->hits.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+void TexelCache::Unmap(const Mapping& mapping) {
+  if (mapping.base) {
+    UnmapFile(mapping.base, mapping.size);
+  }
+}
+
+void TexelCache::Store(const uint64_t key, const png_byte *texels, const int width,
+    const int height, const int channels) {
+  const size_t row_bytes = GetRowBytes(width, channels);
+  uint8_t header[kTexelOffset] = {};
+  memcpy(header, kMagic, sizeof(kMagic));
+  uint8_t *out = Put(header + sizeof(kMagic), key);
+  out = Put(out, (uint32_t) width);
+  out = Put(out, (uint32_t) height);
+  out = Put(out, (uint32_t) channels);
+  out = Put(out, kRowAlignment);
+  out = Put(out, (uint32_t) row_bytes);
+  out = Put(out, (uint64_t) kTexelOffset);
+  Put(out, (uint64_t) row_bytes * height);
+
+  this->WriteFile(this->GetEntryPath(key, channels), header, sizeof(header), texels,
+      row_bytes * height);
+}
+
+void TexelCache::WriteFile(const string& path, const uint8_t *header, const size_t header_size,
+    const uint8_t *body, const size_t body_size) {
+  // Write the file under a name of its own, then move it into place, so that nobody ever reads
+  // half of one.
+  const string temp_path = path + "." + to_string(GetOwnProcessId()) + "."
+      + to_string(this->stores.fetch_add(1, memory_order_relaxed)) + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    ERR("Couldn't create texture cache file [" + temp_path + "].");
+    return;
+  }
+  bool ok = fwrite(header, header_size, 1, file) == 1
+      && (!body_size || fwrite(body, body_size, 1, file) == 1);
+  ok = fclose(file) == 0 && ok;
+  if (!ok || !MoveIntoPlace(temp_path, path)) {
+    ERR("Couldn't write texture cache file [" + path + "].");
+    remove(temp_path.c_str());
+  }
+}
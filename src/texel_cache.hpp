@@ -0,0 +1,121 @@
+#ifndef HUES_TEXEL_CACHE_H_
+#define HUES_TEXEL_CACHE_H_
+
+#include <png.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <common.hpp>
+
+using namespace std;
+
+/**
+ * An on-disk cache of decoded images, so that each PNG only goes through libpng once. Entries are
+ * keyed by a hash of the PNG file's contents and the number of channels, and hold the image's
+ * texels exactly as they're uploaded (8bpc, bottom row first, rows 4-byte aligned) after a header
+ * giving their layout. Reading an entry is just mapping it into memory.
+ *
+ * The hash of each PNG is remembered too, in a small record by path along with the file's size
+ * and modification time, so that a PNG that hasn't changed since isn't read at all.
+ *
+ * Safe to use from several threads at once, and from several processes sharing a directory.
+ */
+class TexelCache {
+  DISALLOW_COPY_AND_ASSIGN(TexelCache)
+
+  public:
+
+    /** A cache entry mapped into memory. */
+    struct Mapping {
+      // What to unmap; NULL if nothing is mapped.
+      void *base;
+      size_t size;
+      const png_byte *texels;
+      size_t texel_size;
+      int width;
+      int height;
+    };
+
+    TexelCache() {}
+    ~TexelCache() {}
+
+    /**
+     * Returns where the cache goes by default: the user's cache directory (under $XDG_CACHE_HOME,
+     * ~/.cache, or %LOCALAPPDATA% on Windows), or "" if there isn't one.
+     */
+    static string GetDefaultDirectory();
+
+    /**
+     * Keeps the cache in the given directory, creating it if need be.
+     *
+     * @return <code>true</code> if the cache can be used, <code>false</code> otherwise.
+     */
+    bool Init(const string& directory);
+
+    bool IsInitialized() const { return !this->directory.empty(); }
+
+    /**
+     * Gets the key for a file: the hash of its contents, remembered from the last time it was
+     * hashed if its size and modification time haven't changed since, or hashed now otherwise.
+     *
+     * @return <code>true</code> if the file could be read, <code>false</code> otherwise.
+     */
+    bool GetKey(const string& path, uint64_t *key);
+
+    /**
+     * Maps the entry for a key into memory.
+     *
+     * @param channels bytes per texel: 4 for RGBA, 1 for luminance.
+     * @return <code>true</code> if there's a valid entry, <code>false</code> otherwise.
+     */
+    bool Map(const uint64_t key, const int channels, Mapping *mapping);
+
+    /** Unmaps an entry mapped by Map(). */
+    static void Unmap(const Mapping& mapping);
+
+    /**
+     * Stores an image's texels under a key. Failures are logged, and otherwise ignored.
+     *
+     * @param texels 8bpc, bottom row first, rows 4-byte aligned.
+     * @param channels bytes per texel: 4 for RGBA, 1 for luminance.
+     */
+    void Store(const uint64_t key, const png_byte *texels, const int width, const int height,
+        const int channels);
+
+    uint64_t GetHitCount() const { return this->hits.load(memory_order_relaxed); }
+    uint64_t GetMissCount() const { return this->misses.load(memory_order_relaxed); }
+    /** Returns the number of files GetKey() had to read and hash. */
+    uint64_t GetHashCount() const { return this->files_hashed.load(memory_order_relaxed); }
+
+  private:
+
+    /** Hashes a file's contents. */
+    static bool HashFile(const string& path, uint64_t *hash);
+    /**
+     * Reads the key a record remembers for a file.
+     *
+     * @return <code>true</code> if the record is for this path, size and modification time,
+     *         <code>false</code> otherwise.
+     */
+    static bool ReadRecord(const string& record_path, const string& path, const uint64_t size,
+        const uint64_t mtime, uint64_t *key);
+    /** Writes a file in the cache all at once, as far as readers can tell. */
+    void WriteFile(const string& path, const uint8_t *header, const size_t header_size,
+        const uint8_t *body, const size_t body_size);
+
+    string GetRecordPath(const string& path) const;
+    string GetEntryPath(const uint64_t key, const int channels) const;
+
+    string directory;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> files_hashed{0};
+    // Keeps temporary file names unique within the process.
+    std::atomic<uint32_t> stores{0};
+};
+
+#endif // HUES_TEXEL_CACHE_H_
@@ -0,0 +1,127 @@
+#include <texture_uploader.hpp>
+
+using namespace std;
+
+TextureUploader::~TextureUploader() {
+  this->DeleteBuffers();
+}
+
+void TextureUploader::DeleteBuffers() {
+  for (Buffer& buffer : this->buffers) {
+    if (buffer.fence) {
+      glDeleteSync(buffer.fence);
+    }
+    // Deleting a buffer unmaps it.
+    glDeleteBuffers(1, &buffer.id);
+  }
+  this->buffers.clear();
+}
+
+void TextureUploader::Init(const int buffer_count, const size_t buffer_size) {
+  this->buffer_size = buffer_size;
+  this->persistent = GLEW_ARB_buffer_storage;
+  this->buffers.resize(buffer_count);
+
+  for (Buffer& buffer : this->buffers) {
+    buffer = Buffer { 0, NULL, State::FREE, NULL };
+    glGenBuffers(1, &buffer.id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.id);
+    if (this->persistent) {
+      // Coherent, so that whatever a worker wrote is visible to the copy as soon as it's queued.
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, buffer_size, NULL, flags);
+      buffer.mapped = static_cast<uint8_t*>(
+          glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, buffer_size, flags));
+    } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  LOG("Texture uploads: [" + to_string(buffer_count) + "] buffers of [" + to_string(buffer_size)
+      + "] bytes, " + (this->persistent ? "persistently mapped." : "mapped on demand."));
+}
+
+TextureUploader::Buffer* TextureUploader::Find(const uint8_t *mapped) {
+  for (Buffer& buffer : this->buffers) {
+    if (buffer.mapped == mapped && buffer.state == State::FILLING) {
+      return &buffer;
+    }
+  }
+  return NULL;
+}
+
+bool TextureUploader::Reclaim(Buffer *buffer) {
+  GLenum result = glClientWaitSync(buffer->fence, 0, 0);
+  if (result == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+  if (result == GL_WAIT_FAILED) {
+    ERR("Waiting for a texture upload failed; reusing its buffer anyway.");
+  }
+
+  glDeleteSync(buffer->fence);
+  buffer->fence = NULL;
+  buffer->state = State::FREE;
+  return true;
+}
+
+uint8_t* TextureUploader::Acquire() {
+  Buffer *acquired = NULL;
+  for (Buffer& buffer : this->buffers) {
+    if (buffer.state == State::FREE
+        || (buffer.state == State::UPLOADING && this->Reclaim(&buffer))) {
+      acquired = &buffer;
+      break;
+    }
+  }
+  if (!acquired) {
+    return NULL;
+  }
+
+  if (!acquired->mapped) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, acquired->id);
+    acquired->mapped = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+        this->buffer_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!acquired->mapped) {
+      ERR("Couldn't map a texture upload buffer.");
+      return NULL;
+    }
+  }
+  acquired->state = State::FILLING;
+  return acquired->mapped;
+}
+
+void TextureUploader::UploadToTextureArray(uint8_t *buffer, const GLuint texture,
+    const GLint layer, const GLsizei width, const GLsizei height, const GLenum format) {
+  Buffer *uploading = this->Find(buffer);
+  if (!uploading) {
+    ERR("Not an acquired texture upload buffer.");
+    return;
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploading->id);
+  if (!this->persistent) {
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    uploading->mapped = NULL;
+  }
+
+  // With a buffer bound, the pixels "pointer" is an offset into it.
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, /* level of detail number */ 0, 0, 0, layer, width, height,
+      /* depth */ 1, format, GL_UNSIGNED_BYTE, NULL);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  uploading->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  uploading->state = State::UPLOADING;
+}
+
+void TextureUploader::Release(uint8_t *buffer) {
+  Buffer *released = this->Find(buffer);
+  if (released) {
+    // Stays mapped, ready for the next Acquire().
+    released->state = State::FREE;
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef HUES_TEXTURE_UPLOADER_H_
+#define HUES_TEXTURE_UPLOADER_H_
+
+#include <glew.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <common.hpp>
+
+/**
+ * Streams pixels into textures through a ring of pixel buffer objects. Uploading from a PBO only
+ * queues a copy for the GPU to make alongside rendering, where uploading from client memory makes
+ * the render thread wait for the driver to copy the pixels out first.
+ *
+ * A buffer is acquired, filled (from any thread), then uploaded from, and can be acquired again
+ * once a fence says the GPU has finished copying out of it. With GL_ARB_buffer_storage, the
+ * buffers are mapped once, persistently; otherwise each one is mapped while it's out being filled.
+ *
+ * Core profile only. Everything but filling the buffers happens on the render thread.
+ */
+class TextureUploader {
+  DISALLOW_COPY_AND_ASSIGN(TextureUploader)
+
+  public:
+
+    TextureUploader() {}
+    /** Deletes the buffers, if DeleteBuffers() hasn't already. */
+    ~TextureUploader();
+
+    /**
+     * Creates the buffers. Must be called before anything else, with a GL context current.
+     *
+     * @param buffer_count how many uploads can be on the go at once.
+     * @param buffer_size the biggest upload, in bytes.
+     */
+    void Init(const int buffer_count, const size_t buffer_size);
+
+    /**
+     * Deletes the buffers, unmapping them, with the GL context current. Whatever was filling them
+     * must be done with them by then.
+     */
+    void DeleteBuffers();
+
+    bool IsInitialized() const { return !this->buffers.empty(); }
+    size_t GetBufferSize() const { return this->buffer_size; }
+
+    /**
+     * Takes a buffer to fill, without waiting for the GPU to finish with one.
+     *
+     * @return the buffer's memory, or NULL if none is free yet.
+     */
+    uint8_t* Acquire();
+
+    /**
+     * Uploads a filled buffer into a layer of a texture array, and recycles the buffer once the
+     * GPU is done with it.
+     *
+     * @param buffer what Acquire() returned.
+     * @param format what's in the buffer, e.g. GL_RGBA or GL_RED, at a byte per channel.
+     */
+    void UploadToTextureArray(uint8_t *buffer, const GLuint texture, const GLint layer,
+        const GLsizei width, const GLsizei height, const GLenum format);
+
+    /** Hands back an acquired buffer without uploading from it. */
+    void Release(uint8_t *buffer);
+
+  private:
+
+    enum class State {
+      FREE,
+      // Acquired, and being filled.
+      FILLING,
+      // Being copied out of by the GPU, until the fence is signalled.
+      UPLOADING
+    };
+
+    struct Buffer {
+      GLuint id;
+      // NULL while unmapped.
+      uint8_t *mapped;
+      State state;
+      GLsync fence;
+    };
+
+    /** Returns the buffer with the given memory. */
+    Buffer* Find(const uint8_t *mapped);
+    /**
+     * Frees a buffer whose upload is done, without waiting for it to be.
+     *
+     * @return <code>true</code> if the buffer is free now, <code>false</code> otherwise.
+     */
+    bool Reclaim(Buffer *buffer);
+
+    std::vector<Buffer> buffers;
+    size_t buffer_size = 0;
+    bool persistent = false;
+};
+
+#endif // HUES_TEXTURE_UPLOADER_H_
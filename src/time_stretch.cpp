@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <time_stretch.hpp>
+
+using namespace std;
+
+/** Returns the dot product of two float arrays. */
+static float DotProduct(const float *a, const float *b, const int len) {
+  int i = 0;
+  float sum = 0.f;
+#ifdef __SSE__
+  __m128 sum4 = _mm_setzero_ps();
+  for (; i + 4 <= len; i += 4) {
+    sum4 = _mm_add_ps(sum4, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, sum4);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < len; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+/** dst[i] += window[i] * src[i] */
+static void WindowedAdd(float *dst, const float *src, const float *window, const int len) {
+  int i = 0;
+#ifdef __SSE__
+  for (; i + 4 <= len; i += 4) {
+    __m128 product = _mm_mul_ps(_mm_loadu_ps(src + i), _mm_loadu_ps(window + i));
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), product));
+  }
+#endif
+  for (; i < len; i++) {
+    dst[i] += window[i] * src[i];
+  }
+}
+
+/**
+ * The least energy a candidate window counts as having in the search, so that near-silence doesn't
+ * divide by almost nothing: about one LSB per frame.
+ */
+static const double kMinSearchEnergy = TimeStretch::kHopFrames;
+
+static int16_t ClipSample(const float sample) {
+  return (int16_t) lrintf(min(max(sample, -32768.f), 32767.f));
+}
+
+TimeStretch::TimeStretch() {
+  // A periodic Hann window sums to exactly one at 50% overlap.
+  for (int i = 0; i < kWindowFrames; i++) {
+    float s = sin(M_PI * i / kWindowFrames);
+    this->window[i] = s * s;
+  }
+  memset(this->overlap_left, 0, sizeof(this->overlap_left));
+  memset(this->overlap_right, 0, sizeof(this->overlap_right));
+}
+
+void TimeStretch::PutInput(const int16_t *pcm, const size_t frame_count) {
+  float *left = this->input_left + this->input_frames;
+  float *right = this->input_right + this->input_frames;
+  float *mono = this->input_mono + this->input_frames;
+
+  for (size_t i = 0; i < frame_count; i++) {
+    left[i] = pcm[i * 2];
+    right[i] = pcm[i * 2 + 1];
+    mono[i] = left[i] + right[i];
+  }
+  this->input_frames += frame_count;
+}
+
+size_t TimeStretch::GetOutput(int16_t *pcm, const size_t frame_count) {
+  size_t produced = 0;
+  while (produced < frame_count) {
+    if (this->output_read == this->output_frames && !this->ProcessHop()) {
+      break;
+    }
+
+    size_t len = min(frame_count - produced, this->output_frames - this->output_read);
+    memcpy(pcm + produced * 2, this->output + this->output_read * 2, len * 2 * sizeof(int16_t));
+    this->output_read += len;
+    produced += len;
+  }
+  return produced;
+}
+
+size_t TimeStretch::Drain(int16_t *pcm, const size_t frame_count) {
+  size_t produced = 0;
+  for (;;) {
+    // Whatever was already stretched or crossfaded goes first.
+    size_t len = min(frame_count - produced, this->output_frames - this->output_read);
+    memcpy(pcm + produced * 2, this->output + this->output_read * 2, len * 2 * sizeof(int16_t));
+    this->output_read += len;
+    produced += len;
+    if (produced == frame_count || this->draining) {
+      break;
+    }
+
+    // The last window's second half faded out over input that hasn't been played yet; fade that
+    // input back in under it, as the next window would at a tempo of 1, then carry on from there.
+    // The last window was all in the buffer, so this is too.
+    this->draining = true;
+    if (this->previous_position >= 0) {
+      const size_t next = this->previous_position + kHopFrames;
+      for (int i = 0; i < kHopFrames; i++) {
+        this->output[i * 2] = ClipSample(
+            this->overlap_left[i] + this->window[i] * this->input_left[next + i]);
+        this->output[i * 2 + 1] = ClipSample(
+            this->overlap_right[i] + this->window[i] * this->input_right[next + i]);
+      }
+      this->output_read = 0;
+      this->output_frames = kHopFrames;
+      this->drain_position = next + kHopFrames;
+    }
+  }
+
+  if (this->draining && this->output_read == this->output_frames) {
+    for (; produced < frame_count && this->drain_position < this->input_frames; produced++) {
+      pcm[produced * 2] = ClipSample(this->input_left[this->drain_position]);
+      pcm[produced * 2 + 1] = ClipSample(this->input_right[this->drain_position]);
+      this->drain_position++;
+    }
+    if (this->drain_position >= this->input_frames) {
+      this->Reset();
+    }
+  }
+  return produced;
+}
+
+void TimeStretch::Reset() {
+  this->input_frames = 0;
+  this->nominal_position = 0;
+  this->previous_position = -1;
+  memset(this->overlap_left, 0, sizeof(this->overlap_left));
+  memset(this->overlap_right, 0, sizeof(this->overlap_right));
+  this->output_read = 0;
+  this->output_frames = 0;
+  this->draining = false;
+  this->drain_position = 0;
+}
+
+size_t TimeStretch::GetLatencyFrames() const {
+  double buffered = max(this->input_frames - this->nominal_position, 0.);
+  return (size_t) (buffered / this->GetTempo()) + (this->output_frames - this->output_read);
+}
+
+bool TimeStretch::ProcessHop() {
+  long nominal = lround(this->nominal_position);
+  long first = max(nominal - kSeekFrames, 0L);
+  long last = nominal + kSeekFrames;
+  if (last + kWindowFrames > (long) this->input_frames) {
+    return false;
+  }
+
+  // Find the window start whose first half best continues the second half of the previous window.
+  // The correlation is divided by the candidate's own level, so that louder stretches of input
+  // don't win just for being loud. Its energy slides along with it, a frame at a time.
+  long best = nominal;
+  if (this->previous_position >= 0) {
+    const float *reference = this->input_mono + this->previous_position + kHopFrames;
+    const float *mono = this->input_mono;
+    double energy = DotProduct(mono + first, mono + first, kHopFrames);
+    double best_score = -INFINITY;
+    for (long candidate = first; candidate <= last; candidate++) {
+      if (candidate > first) {
+        energy += (double) mono[candidate + kHopFrames - 1] * mono[candidate + kHopFrames - 1]
+            - (double) mono[candidate - 1] * mono[candidate - 1];
+      }
+      double score = DotProduct(reference, mono + candidate, kHopFrames)
+          / sqrt(max(energy, kMinSearchEnergy));
+      if (score > best_score) {
+        best_score = score;
+        best = candidate;
+      }
+    }
+  }
+
+  WindowedAdd(this->overlap_left, this->input_left + best, this->window, kWindowFrames);
+  WindowedAdd(this->overlap_right, this->input_right + best, this->window, kWindowFrames);
+
+  // The first hop of the overlap buffer won't be touched by any later window, so it's done.
+  for (int i = 0; i < kHopFrames; i++) {
+    this->output[i * 2] = ClipSample(this->overlap_left[i]);
+    this->output[i * 2 + 1] = ClipSample(this->overlap_right[i]);
+  }
+  this->output_read = 0;
+  this->output_frames = kHopFrames;
+
+  const size_t tail = (kWindowFrames - kHopFrames) * sizeof(float);
+  memmove(this->overlap_left, this->overlap_left + kHopFrames, tail);
+  memmove(this->overlap_right, this->overlap_right + kHopFrames, tail);
+  memset(this->overlap_left + kWindowFrames - kHopFrames, 0, kHopFrames * sizeof(float));
+  memset(this->overlap_right + kWindowFrames - kHopFrames, 0, kHopFrames * sizeof(float));
+
+  this->previous_position = best;
+  this->nominal_position += kHopFrames * this->GetTempo();
+
+  // Throw away input that no future window or search can reach.
+  long consumed = min(this->previous_position, lround(this->nominal_position) - kSeekFrames);
+  if (consumed > 0) {
+    size_t remaining = (this->input_frames - consumed) * sizeof(float);
+    memmove(this->input_left, this->input_left + consumed, remaining);
+    memmove(this->input_right, this->input_right + consumed, remaining);
+    memmove(this->input_mono, this->input_mono + consumed, remaining);
+    this->input_frames -= consumed;
+    this->previous_position -= consumed;
+    this->nominal_position -= consumed;
+  }
+
+  return true;
+}
@@ -0,0 +1,110 @@
+#ifndef HUES_TIME_STRETCH_H_
+#define HUES_TIME_STRETCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <common.hpp>
+
+/**
+ * A streaming WSOLA (waveform similarity overlap-add) time stretcher for 16-bit interleaved stereo
+ * PCM. It changes tempo without changing pitch, by overlap-adding windows of the input at a
+ * different rate than they are read, nudging each window to where it best lines up with the
+ * previous one.
+ *
+ * All buffers are fixed-size members, so nothing is allocated once constructed; it's meant to run
+ * on the audio device thread. SetTempo() may be called from any thread.
+ */
+class TimeStretch {
+  DISALLOW_COPY_AND_ASSIGN(TimeStretch)
+
+  public:
+
+    /** Overlap-add window, ~23ms at 44.1kHz. */
+    static const int kWindowFrames = 1024;
+    /** Output hop; windows overlap by half. */
+    static const int kHopFrames = kWindowFrames / 2;
+    /** How far either side of the nominal position we search for the best match. */
+    static const int kSeekFrames = 256;
+    /** Input frames we can hold on to. */
+    static const int kInputCapacity = 8192;
+
+    TimeStretch();
+    ~TimeStretch() {}
+
+    /** Sets the playback speed: 1.05 plays 5% faster. */
+    void SetTempo(const float tempo) { this->tempo.store(tempo, std::memory_order_relaxed); }
+    float GetTempo() const { return this->tempo.load(std::memory_order_relaxed); }
+
+    /** Returns the number of input frames PutInput() can accept right now. */
+    size_t GetInputSpace() const { return kInputCapacity - this->input_frames; }
+
+    /** Appends input frames. frame_count must not exceed GetInputSpace(). */
+    void PutInput(const int16_t *pcm, const size_t frame_count);
+
+    /**
+     * Produces up to frame_count stretched frames.
+     *
+     * @return the number of frames produced; fewer than asked for if more input is needed.
+     */
+    size_t GetOutput(int16_t *pcm, const size_t frame_count);
+
+    /**
+     * Returns roughly how many output frames will be produced before the next input frame passed to
+     * PutInput() comes out.
+     */
+    size_t GetLatencyFrames() const;
+
+    /**
+     * Hands back everything still buffered as plain, unstretched audio: the last window crossfaded
+     * into the input that follows it, then the rest of the input as it is. Once it's all out, the
+     * stretcher is empty again, and the source can be played straight on from where it was last
+     * read without a seam. Meant for when the tempo goes back to 1, or when the input runs out and
+     * the last window's tail would otherwise wait for more; call it until IsDraining() returns
+     * false, without calling PutInput() or GetOutput() in between.
+     *
+     * @return the number of frames produced, up to frame_count.
+     */
+    size_t Drain(int16_t *pcm, const size_t frame_count);
+
+    /** Returns whether Drain() has started handing back audio, and not finished yet. */
+    bool IsDraining() const { return this->draining; }
+
+    /** Returns whether there's no buffered audio left in here. */
+    bool IsEmpty() const { return !this->input_frames && this->output_read == this->output_frames; }
+
+  private:
+
+    /** Overlap-adds one more window and fills the output buffer with one hop's worth of frames. */
+    bool ProcessHop();
+
+    /** Forgets all buffered audio. */
+    void Reset();
+
+    std::atomic<float> tempo{1.f};
+
+    // Input history, deinterleaved, plus a mono mix for the similarity search.
+    alignas(16) float input_left[kInputCapacity];
+    alignas(16) float input_right[kInputCapacity];
+    alignas(16) float input_mono[kInputCapacity];
+    size_t input_frames = 0;
+
+    // Where the next window would start without any nudging, and where the last one did start.
+    double nominal_position = 0;
+    long previous_position = -1;
+
+    alignas(16) float window[kWindowFrames];
+    alignas(16) float overlap_left[kWindowFrames];
+    alignas(16) float overlap_right[kWindowFrames];
+
+    int16_t output[kHopFrames * 2];
+    size_t output_read = 0;
+    size_t output_frames = 0;
+
+    // While draining, the next input frame to hand back as it is.
+    bool draining = false;
+    size_t drain_position = 0;
+};
+
+#endif // HUES_TIME_STRETCH_H_
@@ -1,5 +1,7 @@
 #include <assert.h>
 
+#include <algorithm>
+
 #include <common.hpp>
 #include <video_renderer.hpp>
 
@@ -8,28 +10,123 @@
 #else
 #include <GL/glut.h>
 #endif
+#ifdef FREEGLUT
+#include <GL/freeglut_ext.h>
+#endif
+#ifdef WIN32
+#include <wglew.h>
+#elif !defined(__APPLE__)
+#include <glxew.h>
+#endif
 
 using namespace std;
 
+/** Taps on each side of the centre of the blur kernel. Each pass fetches 1 + 2 * ceil(this / 2). */
+static constexpr int kBlurTaps = 7;
+/** The standard deviation of the blur kernel, in taps. */
+static constexpr double kBlurSigma = kBlurTaps / 2.8;
+/** Fetches on each side of the centre, plus the centre. */
+static constexpr int kBlurSamples = 1 + (kBlurTaps + 1) / 2;
+/** The most fetches a resample pass makes per texel, each averaging about two source texels. */
+static constexpr int kMaxResampleFetches = 64;
+/** The framebuffer wider blurs shrink the image into first. */
+static constexpr int kBlurScratch = 2;
+
+/** e^x, by its Taylor series, so that the kernel can be worked out at compile time. */
+static constexpr double Exp(const double x, const int n = 1, const double term = 1.,
+    const double sum = 1.) {
+  return n > 60 ? sum : Exp(x, n + 1, term * x / n, sum + term * x / n);
+}
+
+static constexpr double Gaussian(const int tap) {
+  return tap > kBlurTaps ? 0. : Exp(-tap * tap / (2 * kBlurSigma * kBlurSigma));
+}
+
+/** Sums the kernel from tap outwards, counting both sides. */
+static constexpr double GaussianSum(const int tap) {
+  return tap > kBlurTaps ? 0. : (tap ? 2 : 1) * Gaussian(tap) + GaussianSum(tap + 1);
+}
+
+static constexpr double TapWeight(const int tap) { return Gaussian(tap) / GaussianSum(0); }
+
+/** Sample 0 is the centre tap; sample i > 0 stands in for taps 2i - 1 and 2i. */
+static constexpr double SampleWeight(const int sample) {
+  return sample ? TapWeight(2 * sample - 1) + TapWeight(2 * sample) : TapWeight(0);
+}
+static constexpr double SampleOffset(const int sample) {
+  return sample ? ((2 * sample - 1) * TapWeight(2 * sample - 1)
+      + 2 * sample * TapWeight(2 * sample)) / SampleWeight(sample) : 0.;
+}
+
+struct BlurKernel {
+  GLfloat weights[kBlurSamples];
+  GLfloat offsets[kBlurSamples];
+};
+
+template<int... I> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> Type; };
+
+template<int... I> static constexpr BlurKernel MakeBlurKernel(Indices<I...>) {
+  return BlurKernel { { (GLfloat) SampleWeight(I)... }, { (GLfloat) SampleOffset(I)... } };
+}
+
+static constexpr BlurKernel kBlurKernel = MakeBlurKernel(MakeIndices<kBlurSamples>::Type());
+static_assert(2 * (kBlurSamples - 1) >= kBlurTaps, "Every tap needs a sample to stand in for it.");
+// GL 2 only promises 64 fragment uniform components, and drivers may give every float in an array
+// a vec4's worth. The blur shader has three vec2s besides the kernel.
+static_assert(4 * (3 + 2 * kBlurSamples) <= 64, "The blur kernel won't fit the shader's uniforms.");
+
+// The shaders below are written against these preludes, so that the same source builds as GLSL
+// 1.10 for the fixed-function path and as GLSL 3.30 for the core profile, where the vertex comes
+// from our fullscreen triangle VBO and the projection from a uniform.
+const char *VideoRenderer::kLegacyVertexPrelude = R"END(
+#define VARYING varying
+#define TRANSFORMED_POSITION ftransform()
+)END";
+
+const char *VideoRenderer::kLegacyFragmentPrelude = R"END(
+#define VARYING varying
+#define SAMPLE texture2D
+#define FRAG_COLOR gl_FragColor
+#define IMAGE_SAMPLER sampler2D
+#define SAMPLE_IMAGE(image, coord, layer) texture2D(image, coord)
+)END";
+
+const char *VideoRenderer::kCoreVertexPrelude = R"END(#version 330 core
+#define VARYING out
+uniform mat4 Projection;
+layout(location = 0) in vec2 Position;
+#define TRANSFORMED_POSITION (Projection * vec4(Position, 0.0, 1.0))
+)END";
+
+const char *VideoRenderer::kCoreFragmentPrelude = R"END(#version 330 core
+#define VARYING in
+#define SAMPLE texture
+out vec4 FragColor;
+#define FRAG_COLOR FragColor
+#define IMAGE_SAMPLER sampler2DArray
+#define SAMPLE_IMAGE(image, coord, layer) texture(image, vec3(coord, layer))
+)END";
+
 const char *VideoRenderer::kPassThroughVertexShader = R"END(
-varying vec2 v_texCoord;
+VARYING vec2 v_texCoord;
 
 void main() {
-  gl_Position = ftransform();
+  gl_Position = TRANSFORMED_POSITION;
   v_texCoord = gl_Position.xy * vec2(0.5) + vec2(0.5);
 }
 )END";
 
 const char *VideoRenderer::kHardLightFragmentShader = R"END(
-uniform sampler2D BaseImage;
+uniform IMAGE_SAMPLER BaseImage;
+// Where the image is within BaseImage: its layer, and how much of the layer it covers.
+uniform float BaseLayer;
+uniform vec2 BaseScale;
 uniform vec4 BlendColor;
+uniform float BlendOpacity;
 
-varying vec2 v_texCoord;
-
-// Apply alpha channel to the texture by blending with white.
-void applyAlpha(in vec4 base, out vec3 result) {
-  result = mix(vec3(1.0), base.rgb, vec3(base.a));
-}
+VARYING vec2 v_texCoord;
 
 // Alpha-unaware hard light blend function.
 void hardLight(in vec3 base, in vec3 blend, out vec3 result) {
@@ -45,118 +142,242 @@ void hardLight(in vec3 base, in vec3 blend, out vec3 result) {
 }
 
 void main() {
-  vec3 base;
+  // Images are composited onto white when they're loaded.
+  vec3 base = SAMPLE_IMAGE(BaseImage, v_texCoord * BaseScale, BaseLayer).rgb;
   vec3 blend = vec3(BlendColor);
   vec3 result;
 
-  // Apply hard light blend with .7 opacity.
-  applyAlpha(texture2D(BaseImage, v_texCoord), base);
+  // Apply hard light blend (usually with .7 opacity).
   hardLight(base, blend, result);
-  result = mix(base, result, vec3(.7));
-  gl_FragColor = vec4(result, 1);
+  result = mix(base, result, vec3(BlendOpacity));
+  FRAG_COLOR = vec4(result, 1);
 }
 )END";
 
-const char *VideoRenderer::kGaussianXVertexShader = R"END(
-// From [0, .5]. Provided example was .028
-uniform float BlurRadius;
+// One pass of a separable Gaussian blur, along BlurStep. Each sample after the first stands in
+// for two neighbouring taps of the kernel: it's placed between them, in proportion to their
+// weights, so that bilinear filtering does the weighting and one fetch does the work of two. That
+// only holds with taps at most a texel apart, so wider blurs read from a shrunk copy of the image.
+const char *VideoRenderer::kGaussianFragmentShader = R"END(
+uniform sampler2D Image;
+// The distance between two taps of the kernel, in texture coordinates.
+uniform vec2 BlurStep;
+// How much of Image the picture takes up, from its origin, and the furthest it's sampled: the
+// centre of its last texel, so that nothing past it bleeds in.
+uniform vec2 SourceScale;
+uniform vec2 SourceMax;
+uniform float Weights[BLUR_SAMPLES];
+uniform float Offsets[BLUR_SAMPLES];
 
-varying vec2 v_texCoord;
-varying vec2 v_blurTexCoords[14];
+VARYING vec2 v_texCoord;
 
 void main()
 {
-    gl_Position = ftransform();
-    v_texCoord = gl_Position.xy * vec2(0.5) + vec2(0.5);
-
-    float radiusStep = BlurRadius / 7;
-    v_blurTexCoords[ 0] = vec2(max(0, v_texCoord.x + -7 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 1] = vec2(max(0, v_texCoord.x + -6 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 2] = vec2(max(0, v_texCoord.x + -5 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 3] = vec2(max(0, v_texCoord.x + -4 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 4] = vec2(max(0, v_texCoord.x + -3 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 5] = vec2(max(0, v_texCoord.x + -2 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 6] = vec2(max(0, v_texCoord.x + -1 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 7] = vec2(min(1, v_texCoord.x +  1 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 8] = vec2(min(1, v_texCoord.x +  2 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[ 9] = vec2(min(1, v_texCoord.x +  3 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[10] = vec2(min(1, v_texCoord.x +  4 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[11] = vec2(min(1, v_texCoord.x +  5 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[12] = vec2(min(1, v_texCoord.x +  6 * radiusStep), v_texCoord.y);
-    v_blurTexCoords[13] = vec2(min(1, v_texCoord.x +  7 * radiusStep), v_texCoord.y);
+  vec2 coord = v_texCoord * SourceScale;
+  vec4 color = SAMPLE(Image, min(coord, SourceMax)) * Weights[0];
+  for (int i = 1; i < BLUR_SAMPLES; i++) {
+    vec2 offset = BlurStep * Offsets[i];
+    color += SAMPLE(Image, min(coord - offset, SourceMax)) * Weights[i];
+    color += SAMPLE(Image, min(coord + offset, SourceMax)) * Weights[i];
+  }
+  FRAG_COLOR = color;
 }
 )END";
 
-const char *VideoRenderer::kGaussianYVertexShader = R"END(
-uniform float BlurRadius;
+// Stretches or shrinks part of an image to cover the target. Shrinking averages whatever each texel
+// of the result covers along the axis being shrunk: the fetches are spread evenly over that
+// footprint, about two texels apart, so that bilinear filtering averages pairs of texels.
+const char *VideoRenderer::kResampleFragmentShader = R"END(
+uniform sampler2D Image;
+// As for the blur: how much of Image the picture takes up, and the furthest it's sampled.
+uniform vec2 SourceScale;
+uniform vec2 SourceMax;
+// What one texel of the result covers, along the axis being shrunk, in texture coordinates.
+uniform vec2 Footprint;
+uniform int FetchCount;
 
-varying vec2 v_texCoord;
-varying vec2 v_blurTexCoords[14];
+VARYING vec2 v_texCoord;
 
 void main()
 {
-    gl_Position = ftransform();
-    v_texCoord = gl_Position.xy * vec2(0.5) + vec2(0.5);
-
-    float radiusStep = BlurRadius / 7;
-    v_blurTexCoords[ 0] = vec2(v_texCoord.x, max(0, v_texCoord.y + -7 * radiusStep));
-    v_blurTexCoords[ 1] = vec2(v_texCoord.x, max(0, v_texCoord.y + -6 * radiusStep));
-    v_blurTexCoords[ 2] = vec2(v_texCoord.x, max(0, v_texCoord.y + -5 * radiusStep));
-    v_blurTexCoords[ 3] = vec2(v_texCoord.x, max(0, v_texCoord.y + -4 * radiusStep));
-    v_blurTexCoords[ 4] = vec2(v_texCoord.x, max(0, v_texCoord.y + -3 * radiusStep));
-    v_blurTexCoords[ 5] = vec2(v_texCoord.x, max(0, v_texCoord.y + -2 * radiusStep));
-    v_blurTexCoords[ 6] = vec2(v_texCoord.x, max(0, v_texCoord.y + -1 * radiusStep));
-    v_blurTexCoords[ 7] = vec2(v_texCoord.x, min(1, v_texCoord.y +  1 * radiusStep));
-    v_blurTexCoords[ 8] = vec2(v_texCoord.x, min(1, v_texCoord.y +  2 * radiusStep));
-    v_blurTexCoords[ 9] = vec2(v_texCoord.x, min(1, v_texCoord.y +  3 * radiusStep));
-    v_blurTexCoords[10] = vec2(v_texCoord.x, min(1, v_texCoord.y +  4 * radiusStep));
-    v_blurTexCoords[11] = vec2(v_texCoord.x, min(1, v_texCoord.y +  5 * radiusStep));
-    v_blurTexCoords[12] = vec2(v_texCoord.x, min(1, v_texCoord.y +  6 * radiusStep));
-    v_blurTexCoords[13] = vec2(v_texCoord.x, min(1, v_texCoord.y +  7 * radiusStep));
+  vec2 coord = v_texCoord * SourceScale;
+  vec4 color = vec4(0.0);
+  for (int i = 0; i < MAX_FETCHES; i++) {
+    if (i >= FetchCount) {
+      break;
+    }
+    vec2 offset = Footprint * ((float(i) + 0.5) / float(FetchCount) - 0.5);
+    color += SAMPLE(Image, min(coord + offset, SourceMax));
+  }
+  FRAG_COLOR = color / float(FetchCount);
 }
 )END";
 
-const char *VideoRenderer::kGaussianFragmentShader = R"END(
-precision mediump float;
+// TODO: tune this parameter.
+const float VideoRenderer::kFullStrengthBlurRadius = 0.1;
 
-uniform sampler2D Image;
+/** Images are grouped into texture arrays by size, rounded up to a multiple of this. */
+static const int kSizeClassGranularity = 64;
 
-varying vec2 v_texCoord;
-varying vec2 v_blurTexCoords[14];
+/** The texture unit images are drawn from. The blur passes use unit 0. */
+static const int kImageTextureUnit = 1;
 
-void main()
-{
-  gl_FragColor = vec4(0.0);
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 0]) * 0.0044299121055113265;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 1]) * 0.00895781211794;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 2]) * 0.0215963866053;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 3]) * 0.0443683338718;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 4]) * 0.0776744219933;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 5]) * 0.115876621105;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 6]) * 0.147308056121;
-  gl_FragColor += texture2D(Image, v_texCoord         ) * 0.159576912161;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 7]) * 0.147308056121;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 8]) * 0.115876621105;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[ 9]) * 0.0776744219933;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[10]) * 0.0443683338718;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[11]) * 0.0215963866053;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[12]) * 0.00895781211794;
-  gl_FragColor += texture2D(Image, v_blurTexCoords[13]) * 0.0044299121055113265;
+/**
+ * The most layers a texture array gets. A size class's first array has one, and each one after
+ * that twice as many as the last, up to this: rare sizes don't tie up unused layers.
+ */
+static const GLsizei kMaxLayersPerArray = 4;
+
+/** Threads decoding images as upcoming beats call for them. */
+static const unsigned int kDecodeThreads = 2;
+
+/** Pixel buffers for streaming texture uploads, per decoding thread. */
+static const int kUploadBuffersPerThread = 2;
+
+/** Pixel buffers lent to the decode pool at a time, for images that aren't in the cache. */
+static const unsigned int kLentUploadBuffers = kDecodeThreads;
+
+const size_t VideoRenderer::kDefaultTextureBudget = 256 << 20;
+
+static int RoundUpToSizeClass(const int size) {
+  return (size + kSizeClassGranularity - 1) / kSizeClassGranularity * kSizeClassGranularity;
 }
 
-)END";
+/** Texture memory taken up by an array, at a byte per texel. */
+static size_t TextureArrayBytes(const int width, const int height, const GLsizei layers) {
+  return (size_t) width * height * layers;
+}
 
-// TODO: tune this parameter.
-const float VideoRenderer::kFullStrengthBlurRadius = 0.1;
+/** Layers for the next array of a size class that already has array_count of them. */
+static GLsizei NextArrayLayers(const size_t array_count) {
+  GLsizei layers = 1;
+  for (size_t i = 0; i < array_count && layers < kMaxLayersPerArray; i++) {
+    layers *= 2;
+  }
+  return layers;
+}
+
+/** Texture memory taken up by an image on the legacy path, at a byte per texel. */
+static size_t LegacyTextureBytes(const int width, const int height) {
+  return (size_t) width * height;
+}
+
+/** Opacity of the color blended over the image, when there is no music to react to. */
+const float VideoRenderer::kDefaultBlendOpacity = 0.7f;
 
-/** blur_x and blur_y are divided by this factor every decay tick. */
-const float VideoRenderer::kBlurDecayFactorPerTick = 1.3f;
+/** Time for a blur to fade to 1/e of full strength: the same as dividing it by 1.3 at 60fps. */
+const int64_t VideoRenderer::kBlurDecayUsec = 63500;
 
-/** 60 ticks per second. */
-const clock_t VideoRenderer::kBlurDecayTick = CLOCKS_PER_SEC / 60;
+/** Time constant of the fade to black on a blackout beat. */
+const int64_t VideoRenderer::kBlackoutFadeUsec = 40 * 1000;
+
+/** How long a short blackout stays black. */
+const int64_t VideoRenderer::kShortBlackoutUsec = 100 * 1000;
+
+/** How often to look for something to draw, when there's nothing to draw. */
+const int VideoRenderer::kIdlePollMsec = 2;
+
+/** How long to leave between frames when we can't wait for vblank instead; about 60fps. */
+const int VideoRenderer::kUnsyncedFrameMsec = 16;
+
+/** Frames drawn back to back to time, to tell whether swaps really wait for vblank. */
+static const int kVsyncCheckFrames = 30;
+
+/** Frames drawn faster than this on average can't have waited for vblank: that'd be 500 Hz. */
+static const int64_t kMinSyncedFrameUsec = 2000;
 
 VideoRenderer *VideoRenderer::instance = NULL;
 
+/** Loads the GL entry points for the current context, or exits if it can't. */
+static void InitGlew() {
+  // Core profiles don't list extensions the old way, so GLEW needs telling to load everything
+  // anyway (and leaves behind a harmless GL_INVALID_ENUM while at it).
+  glewExperimental = GL_TRUE;
+  GLenum err = glewInit();
+  if (err != GLEW_OK) {
+    ERR("GLEW initialization failed! Failure reason on next line.");
+    ERR(glewGetErrorString(err));
+    exit(EXIT_FAILURE);
+  }
+  glGetError();
+}
+
+#if defined(FREEGLUT) && !defined(WIN32) && !defined(__APPLE__)
+/** Keeps Xlib from exiting when the driver turns down a context. */
+static int IgnoreXError(Display *display, XErrorEvent *event) {
+  return 0;
+}
+#endif
+
+#ifdef FREEGLUT
+/**
+ * Asks the driver for a GL 3.3 core context, then throws it away. Needs a current context to look
+ * up the extensions with, but not of any particular version: Mesa caps compatibility contexts
+ * below 3.3 and makes core ones anyway.
+ *
+ * @return <code>true</code> if the driver made one.
+ */
+static bool CanCreateCoreContext() {
+#ifdef WIN32
+  if (!WGLEW_ARB_create_context || !WGLEW_ARB_create_context_profile) {
+    return false;
+  }
+  const int attribs[] = {
+    WGL_CONTEXT_MAJOR_VERSION_ARB, 3,
+    WGL_CONTEXT_MINOR_VERSION_ARB, 3,
+    WGL_CONTEXT_PROFILE_MASK_ARB, WGL_CONTEXT_CORE_PROFILE_BIT_ARB,
+    0
+  };
+  HGLRC context = wglCreateContextAttribsARB(wglGetCurrentDC(), NULL, attribs);
+  if (!context) {
+    return false;
+  }
+  wglDeleteContext(context);
+  return true;
+#elif !defined(__APPLE__)
+  if (!GLXEW_ARB_create_context || !GLXEW_ARB_create_context_profile) {
+    return false;
+  }
+  Display *display = glXGetCurrentDisplay();
+  const int config_attribs[] = {
+    GLX_RENDER_TYPE, GLX_RGBA_BIT,
+    GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
+    GLX_DOUBLEBUFFER, True,
+    None
+  };
+  int config_count = 0;
+  GLXFBConfig *configs =
+      glXChooseFBConfig(display, DefaultScreen(display), config_attribs, &config_count);
+  if (!configs) {
+    return false;
+  }
+  const int context_attribs[] = {
+    GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
+    GLX_CONTEXT_MINOR_VERSION_ARB, 3,
+    GLX_CONTEXT_PROFILE_MASK_ARB, GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
+    None
+  };
+
+  // A context the driver can't make is an X error rather than just NULL.
+  XSync(display, False);
+  int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(IgnoreXError);
+  GLXContext context = config_count > 0
+      ? glXCreateContextAttribsARB(display, configs[0], NULL, True, context_attribs) : NULL;
+  XSync(display, False);
+  XSetErrorHandler(old_handler);
+  XFree(configs);
+
+  if (!context) {
+    return false;
+  }
+  glXDestroyContext(display, context);
+  return true;
+#else
+  return GLEW_VERSION_3_3;
+#endif
+}
+#endif
+
 void VideoRenderer::DrawFrameCallback() {
   instance->DrawFrame();
 }
@@ -167,10 +388,10 @@ void VideoRenderer::ResizeCallback(const int width, const int height) {
 
 void VideoRenderer::TimerCallback(int ignored) {
   instance->HandleTimerTick();
-  glutPostRedisplay();
+}
 
-  // Cap at 500fps, I guess.
-  glutTimerFunc(2, TimerCallback, 0);
+void VideoRenderer::CloseCallback() {
+  instance->ReleaseGl();
 }
 
 VideoRenderer::VideoRenderer() {
@@ -183,25 +404,60 @@ VideoRenderer::~VideoRenderer() {
   pthread_rwlock_destroy(&this->render_lock);
   pthread_mutex_destroy(&this->load_mutex);
   pthread_cond_destroy(&this->load_cv);
+}
+
+bool VideoRenderer::Stop() {
+  this->stop_requested = true;
+#ifdef FREEGLUT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void VideoRenderer::ReleaseGl() {
+  if (!this->gl_initialized) {
+    return;
+  }
+
+  // The decoders may be writing into the upload buffers, which are about to go.
+  this->decode_pool.Stop();
+
+  // Unload whatever images are still loaded.
+  for (auto const& size_class : this->size_classes) {
+    for (auto const& array : size_class.second.arrays) {
+      glDeleteTextures(1, &array.first);
+    }
+  }
+  if (!this->core_profile) {
+    for (PackImage *image : this->lru) {
+      glDeleteTextures(1, &image->texture.id);
+    }
+  }
 
-  for (auto const& kv : this->textures) {
-    glDeleteTextures(1, &kv.second);
+  for (auto const& framebuffer : this->blur_fb) {
+    if (framebuffer.tex_id != 0) {
+      glDeleteTextures(1, &framebuffer.tex_id);
+    }
+    glDeleteFramebuffers(1, &framebuffer.id);
   }
 
-  if (this->blur_fb.tex_id != 0) {
-    glDeleteTextures(1, &this->blur_fb.tex_id);
+  if (this->core_profile) {
+    glDeleteVertexArrays(1, &this->fullscreen_vao);
+    glDeleteBuffers(1, &this->fullscreen_vbo);
   }
-  glDeleteFramebuffers(1, &this->blur_fb.id);
 
   glDeleteShader(this->pass_through_vertex_shader);
   glDeleteShader(this->hard_light_fragment_shader);
   glDeleteProgram(this->image_blend_shaderprogram.id);
 
-  glDeleteShader(this->gaussian_x_vertex_shader);
-  glDeleteShader(this->gaussian_y_vertex_shader);
   glDeleteShader(this->gaussian_fragment_shader);
-  glDeleteProgram(this->blur_x_shaderprogram.id);
-  glDeleteProgram(this->blur_y_shaderprogram.id);
+  glDeleteProgram(this->blur_shaderprogram.id);
+  glDeleteShader(this->resample_fragment_shader);
+  glDeleteProgram(this->resample_shaderprogram.id);
+
+  this->texture_uploader.DeleteBuffers();
+  this->gl_initialized = false;
 }
 
 void VideoRenderer::Init(int argc, char *argv[]) {
@@ -213,24 +469,51 @@ void VideoRenderer::Init(int argc, char *argv[]) {
 
   // Create the OpenGL context and window.
   glutCreateWindow("0x40 Hues");
+  InitGlew();
+
+#ifdef FREEGLUT
+  // Ask for a core profile context first: the default one can report an older version than the
+  // driver does core. freeglut exits if it can't make a context of the version asked for, so try
+  // one out on the side before swapping in a window with it. If that fails, keep this one and
+  // draw the legacy way.
+  if (!this->legacy_gl && CanCreateCoreContext()) {
+    int probe_window = glutGetWindow();
+    glutInitContextVersion(3, 3);
+    glutInitContextProfile(GLUT_CORE_PROFILE);
+    int window = glutCreateWindow("0x40 Hues");
+    glutDestroyWindow(probe_window);
+    glutSetWindow(window);
+    InitGlew();
+  }
+#endif
 
-  // Initialize GLEW.
-  GLenum err = glewInit();
-  if (err != GLEW_OK) {
-    ERR("GLEW initialization failed! Failure reason on next line.");
-    ERR(glewGetErrorString(err));
-    exit(EXIT_FAILURE);
+  this->vsync = this->EnableVsync();
+  this->core_profile = !this->legacy_gl && GLEW_VERSION_3_3;
+  LOG("OpenGL [" + string(reinterpret_cast<const char*>(glGetString(GL_VERSION))) + "], using the ["
+      + (this->core_profile ? "core profile" : "legacy") + "] renderer, vsync ["
+      + (this->vsync ? "on" : "off") + "].");
+  if (this->core_profile) {
+    this->InitFullscreenTriangle();
   }
 
   // Compile shaders.
   this->CompileShaders();
 
   // Create framebuffer object.
-  glGenFramebuffers(1, &this->blur_fb.id);
+  for (auto& framebuffer : this->blur_fb) {
+    glGenFramebuffers(1, &framebuffer.id);
+  }
+  this->gl_initialized = true;
 
   // Set callback functions.
   glutDisplayFunc(DrawFrameCallback);
   glutReshapeFunc(ResizeCallback);
+#ifdef FREEGLUT
+  // Come back out of the loop when the window goes, rather than exiting under everyone's feet.
+  glutCloseFunc(CloseCallback);
+  glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+#endif
+  this->last_tick_usec = MonotonicTimeUsec();
   glutTimerFunc(0, TimerCallback, 0);
 
   // Clear the window and display a solid color.
@@ -249,8 +532,10 @@ void VideoRenderer::DoGlutLoop() {
   // Actually call the main loop.
   glutMainLoop();
 
-  // I don't know how we can ever get here but whatever.
+  // Only freeglut ever gets here: after Stop(), or once the window is closed. Either way, the
+  // window is gone, and CloseCallback() released everything on the GPU on its way out.
   VideoRenderer::instance = NULL;
+  this->loop_returned = true;
 }
 
 void VideoRenderer::CompileShaders() {
@@ -269,48 +554,96 @@ void VideoRenderer::CompileShaders() {
       glGetUniformLocation(this->image_blend_shaderprogram.id, "BaseImage");
   this->image_blend_shaderprogram.BlendColor =
       glGetUniformLocation(this->image_blend_shaderprogram.id, "BlendColor");
+  this->image_blend_shaderprogram.BlendOpacity =
+      glGetUniformLocation(this->image_blend_shaderprogram.id, "BlendOpacity");
+  this->image_blend_shaderprogram.BaseLayer =
+      glGetUniformLocation(this->image_blend_shaderprogram.id, "BaseLayer");
+  this->image_blend_shaderprogram.BaseScale =
+      glGetUniformLocation(this->image_blend_shaderprogram.id, "BaseScale");
+  this->image_blend_shaderprogram.Projection =
+      glGetUniformLocation(this->image_blend_shaderprogram.id, "Projection");
+
+  // Images are always drawn from the same unit.
+  glUseProgram(this->image_blend_shaderprogram.id);
+  glUniform1i(this->image_blend_shaderprogram.BaseImage, kImageTextureUnit);
+  glUseProgram(0);
+
+  // Compile the Gaussian blur shader, which does either axis, and link it with the same vertex
+  // shader. The kernel never changes, so it only needs uploading once.
+  this->gaussian_fragment_shader = this->CompileShader(VideoRenderer::kGaussianFragmentShader,
+      GL_FRAGMENT_SHADER, "#define BLUR_SAMPLES " + to_string(kBlurSamples) + "\n");
+
+  this->blur_shaderprogram.id = glCreateProgram();
+  glAttachShader(this->blur_shaderprogram.id, this->pass_through_vertex_shader);
+  glAttachShader(this->blur_shaderprogram.id, this->gaussian_fragment_shader);
+  glLinkProgram(this->blur_shaderprogram.id);
+  this->blur_shaderprogram.BlurStep =
+      glGetUniformLocation(this->blur_shaderprogram.id, "BlurStep");
+  this->blur_shaderprogram.Image =
+      glGetUniformLocation(this->blur_shaderprogram.id, "Image");
+  this->blur_shaderprogram.SourceScale =
+      glGetUniformLocation(this->blur_shaderprogram.id, "SourceScale");
+  this->blur_shaderprogram.SourceMax =
+      glGetUniformLocation(this->blur_shaderprogram.id, "SourceMax");
+  this->blur_shaderprogram.Projection =
+      glGetUniformLocation(this->blur_shaderprogram.id, "Projection");
+
+  glUseProgram(this->blur_shaderprogram.id);
+  glUniform1fv(glGetUniformLocation(this->blur_shaderprogram.id, "Weights"), kBlurSamples,
+      kBlurKernel.weights);
+  glUniform1fv(glGetUniformLocation(this->blur_shaderprogram.id, "Offsets"), kBlurSamples,
+      kBlurKernel.offsets);
+  glUseProgram(0);
+
+  // The resampling shader shrinks the image ahead of blurs too wide for the kernel to reach, and
+  // stretches the blurred copy back afterwards.
+  this->resample_fragment_shader = this->CompileShader(
+      VideoRenderer::kResampleFragmentShader, GL_FRAGMENT_SHADER,
+      "#define MAX_FETCHES " + to_string(kMaxResampleFetches) + "\n");
+
+  this->resample_shaderprogram.id = glCreateProgram();
+  glAttachShader(this->resample_shaderprogram.id, this->pass_through_vertex_shader);
+  glAttachShader(this->resample_shaderprogram.id, this->resample_fragment_shader);
+  glLinkProgram(this->resample_shaderprogram.id);
+  this->resample_shaderprogram.SourceScale =
+      glGetUniformLocation(this->resample_shaderprogram.id, "SourceScale");
+  this->resample_shaderprogram.SourceMax =
+      glGetUniformLocation(this->resample_shaderprogram.id, "SourceMax");
+  this->resample_shaderprogram.Footprint =
+      glGetUniformLocation(this->resample_shaderprogram.id, "Footprint");
+  this->resample_shaderprogram.FetchCount =
+      glGetUniformLocation(this->resample_shaderprogram.id, "FetchCount");
+  this->resample_shaderprogram.Image =
+      glGetUniformLocation(this->resample_shaderprogram.id, "Image");
+  this->resample_shaderprogram.Projection =
+      glGetUniformLocation(this->resample_shaderprogram.id, "Projection");
+}
 
-  // Compile the shaders for gaussian blur, then link two separate programs.
-  this->gaussian_x_vertex_shader =
-      this->CompileShader(VideoRenderer::kGaussianXVertexShader, GL_VERTEX_SHADER);
-  this->gaussian_y_vertex_shader =
-      this->CompileShader(VideoRenderer::kGaussianYVertexShader, GL_VERTEX_SHADER);
-  this->gaussian_fragment_shader =
-      this->CompileShader(VideoRenderer::kGaussianFragmentShader, GL_FRAGMENT_SHADER);
-
-  this->blur_x_shaderprogram.id = glCreateProgram();
-  glAttachShader(this->blur_x_shaderprogram.id, this->gaussian_x_vertex_shader);
-  glAttachShader(this->blur_x_shaderprogram.id, this->gaussian_fragment_shader);
-  glLinkProgram(this->blur_x_shaderprogram.id);
-  this->blur_x_shaderprogram.BlurRadius =
-      glGetUniformLocation(this->blur_x_shaderprogram.id, "BlurRadius");
-  this->blur_x_shaderprogram.Image =
-      glGetUniformLocation(this->blur_x_shaderprogram.id, "Image");
-
-  this->blur_y_shaderprogram.id = glCreateProgram();
-  glAttachShader(this->blur_y_shaderprogram.id, this->gaussian_y_vertex_shader);
-  glAttachShader(this->blur_y_shaderprogram.id, this->gaussian_fragment_shader);
-  glLinkProgram(this->blur_y_shaderprogram.id);
-  this->blur_y_shaderprogram.BlurRadius =
-      glGetUniformLocation(this->blur_y_shaderprogram.id, "BlurRadius");
-  this->blur_y_shaderprogram.Image =
-      glGetUniformLocation(this->blur_y_shaderprogram.id, "Image");
-}
-
-GLuint VideoRenderer::CompileShader(const char *&shader_text, GLenum shader_type) {
+GLuint VideoRenderer::CompileShader(const char *&shader_text, GLenum shader_type,
+    const string& defines) {
   GLuint shader;
   GLint shaderOpSuccess;
 
+  const char *sources[3];
+  if (shader_type == GL_VERTEX_SHADER) {
+    sources[0] = this->core_profile ? kCoreVertexPrelude : kLegacyVertexPrelude;
+  } else {
+    sources[0] = this->core_profile ? kCoreFragmentPrelude : kLegacyFragmentPrelude;
+  }
+  sources[1] = defines.c_str();
+  sources[2] = shader_text;
+
+  // The ARB_shader_objects entry points don't exist in core profiles, so stick to the GL 2.0 ones.
   shader = glCreateShader(shader_type);
-  glShaderSourceARB(shader, 1, &shader_text, NULL);
-  glCompileShaderARB(shader);
-  glGetObjectParameterivARB(shader, GL_COMPILE_STATUS, &shaderOpSuccess);
+  glShaderSource(shader, 3, sources, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &shaderOpSuccess);
   if (!shaderOpSuccess) {
     GLint log_len = 0;
     glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
     if (log_len > 1) {
       GLchar* log = new GLchar[log_len];
-      glGetInfoLogARB(shader, log_len, NULL, log);
+      glGetShaderInfoLog(shader, log_len, NULL, log);
       ERR("Error compiling shader! Output on next lines.");
       cout << log;
       delete[] log;
@@ -328,47 +661,51 @@ void VideoRenderer::LoadTextures(const ResourcePack &respack) {
   this->textures_loaded = false;
   pthread_mutex_unlock(&this->load_mutex);
 
+  int64_t start_usec = MonotonicTimeUsec();
   vector<ImageResource*> images;
   respack.GetAllImages(images);
 
-  for(ImageResource *image : images) {
+  // Only read the headers for now: that's enough to sort the images into size classes on the core
+  // path, and to size the upload buffers.
+  size_t max_image_size = 0;
+  for (ImageResource *image : images) {
     int width;
     int height;
-    int color_type;
-
-    DEBUG("Loading [" + image->GetName() + "] into texture memory.");
-    png_byte *image_bytes = image->ReadAndDecode(&width, &height, &color_type);
-
-    GLint texture_format;
-    switch(color_type) {
-      case PNG_COLOR_TYPE_RGB_ALPHA:
-        texture_format = GL_RGBA;
-        break;
-      default:
-        ERR("Unsupported libpng color type: [" + to_string(color_type) + "].");
-        delete[] image_bytes;
-        return;
+    if (!image->ReadSize(&width, &height)) {
+      continue;
     }
 
-    GLuint texture;
-    glActiveTexture(GL_TEXTURE0);
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, /* level of detail number */0, GL_LUMINANCE_ALPHA,
-        width, height, /* border */ 0, texture_format, GL_UNSIGNED_BYTE, image_bytes);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-    glBindTexture(GL_TEXTURE_2D, (GLuint) NULL);
-
-    delete[] image_bytes;
+    TextureSizeClass *size_class = NULL;
+    if (this->core_profile) {
+      const int class_width = RoundUpToSizeClass(width);
+      const int class_height = RoundUpToSizeClass(height);
+      size_class = &this->size_classes[make_pair(class_width, class_height)];
+      size_class->width = class_width;
+      size_class->height = class_height;
+    }
+    this->pack_images[image->GetName()] = PackImage { image, width, height, size_class,
+        Residency::UNLOADED, 0, ImageTexture { 0, 0, { 1, 1 } }, this->lru.end() };
+    // Decoded images are a byte per pixel, with rows padded to 4 bytes.
+    max_image_size = max(max_image_size, (size_t) (width + 3) / 4 * 4 * height);
+  }
 
-    texture_name_list.push_back(image->GetName());
-    this->images[image->GetName()] = image;
-    this->textures[image->GetName()] = texture;
+  // On the core path, images are decoded straight into pixel buffers, which the GPU copies into
+  // place alongside whatever else it's doing.
+  if (this->core_profile && max_image_size && !this->texture_uploader.IsInitialized()) {
+    this->texture_uploader.Init(kUploadBuffersPerThread * kDecodeThreads, max_image_size);
+  }
+  if (!this->texel_cache.IsInitialized()
+      && this->texel_cache.Init(TexelCache::GetDefaultDirectory())) {
+    this->decode_pool.SetTexelCache(&this->texel_cache);
   }
+  this->decode_pool.SetFormat(ImageResource::Format::LUMINANCE);
+  this->decode_pool.Start(kDecodeThreads,
+      this->texture_uploader.IsInitialized() ? this->texture_uploader.GetBufferSize() : 0);
+
+  LOG("Found [" + to_string(this->pack_images.size()) + "] images in ["
+      + to_string((MonotonicTimeUsec() - start_usec) / 1000) + "] ms, in ["
+      + to_string(this->size_classes.size()) + "] size classes; loading them on demand, within ["
+      + (this->texture_budget ? to_string(this->texture_budget >> 20) + "] MB." : "no] limit."));
 
   pthread_mutex_lock(&this->load_mutex);
   this->textures_loaded = true;
@@ -376,6 +713,234 @@ void VideoRenderer::LoadTextures(const ResourcePack &respack) {
   pthread_mutex_unlock(&this->load_mutex);
 }
 
+void VideoRenderer::LoadTexture(const DecodedImage& decoded, PackImage *image) {
+  const size_t bytes = LegacyTextureBytes(decoded.width, decoded.height);
+  this->MakeRoomForTexture(bytes, NULL);
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, /* level of detail number */0, GL_LUMINANCE,
+      decoded.width, decoded.height, /* border */ 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, decoded.bytes);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, (GLuint) NULL);
+  this->texture_bytes.fetch_add(bytes, memory_order_relaxed);
+
+  image->texture = ImageTexture { texture, 0, { 1, 1 } };
+  image->residency = Residency::LOADED;
+  this->TouchTexture(image);
+  this->texture_loads.fetch_add(1, memory_order_relaxed);
+}
+
+void VideoRenderer::UploadToTextureArray(const DecodedImage& decoded, PackImage *image) {
+  TextureSizeClass *size_class = image->size_class;
+  const GLsizei layers = NextArrayLayers(size_class->arrays.size());
+  const size_t bytes = TextureArrayBytes(size_class->width, size_class->height, layers);
+  this->MakeRoomForTexture(bytes, size_class);
+
+  if (size_class->free_layers.empty()) {
+    // There's no luminance format in core profiles: keep a single red channel, and have the
+    // texture unit read it as luminance so images look the same as on the legacy path.
+    static const GLint kLuminanceSwizzle[] { GL_RED, GL_RED, GL_RED, GL_ONE };
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, /* level of detail number */ 0, GL_R8,
+        size_class->width, size_class->height, layers, /* border */ 0, GL_RED,
+        GL_UNSIGNED_BYTE, NULL);
+    glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, kLuminanceSwizzle);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    this->texture_bytes.fetch_add(bytes, memory_order_relaxed);
+
+    size_class->arrays[texture] = make_pair(layers, 0);
+    for (GLint layer = layers - 1; layer >= 0; layer--) {
+      size_class->free_layers.push_back(make_pair(texture, layer));
+    }
+  }
+  const pair<GLuint, GLint> slot = size_class->free_layers.back();
+  size_class->free_layers.pop_back();
+  size_class->arrays[slot.first].second++;
+
+  // Each image goes in the bottom left corner of its layer; the rest of the layer is never
+  // sampled. Images decoded into one of the uploader's buffers are copied from there.
+  if (decoded.buffer) {
+    this->texture_uploader.UploadToTextureArray(decoded.buffer, slot.first, slot.second,
+        decoded.width, decoded.height, GL_RED);
+  } else {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, slot.first);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, /* level of detail number */ 0, 0, 0, slot.second,
+        decoded.width, decoded.height, /* depth */ 1, GL_RED, GL_UNSIGNED_BYTE, decoded.bytes);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  }
+
+  image->texture = ImageTexture { slot.first, (GLfloat) slot.second,
+      { (GLfloat) decoded.width / size_class->width,
+        (GLfloat) decoded.height / size_class->height } };
+  image->residency = Residency::LOADED;
+  this->TouchTexture(image);
+  this->texture_loads.fetch_add(1, memory_order_relaxed);
+}
+
+void VideoRenderer::RequestTexture(PackImage *image) {
+  image->residency = Residency::DECODING;
+  this->images_decoding.fetch_add(1, memory_order_relaxed);
+  this->decode_pool.Request(image->image);
+}
+
+void VideoRenderer::LendUploadBuffers() {
+  // Images read from the cache don't take a buffer, so whatever's lent stays lent until an image
+  // that needs decoding comes along; only the ones decoded into since need replacing.
+  while (this->texture_uploader.IsInitialized()
+      && this->lent_upload_buffers < kLentUploadBuffers) {
+    uint8_t *buffer = this->texture_uploader.Acquire();
+    if (!buffer) {
+      return;
+    }
+    this->decode_pool.AddBuffer(buffer);
+    this->lent_upload_buffers++;
+  }
+}
+
+void VideoRenderer::TakeDecodedImages() {
+  DecodedImage decoded;
+  while (this->decode_pool.TryNext(&decoded)) {
+    PackImage *image = &this->pack_images.find(decoded.image->GetName())->second;
+    image->residency = Residency::FAILED;
+    if (decoded.buffer) {
+      this->lent_upload_buffers--;
+    }
+
+    if (!decoded.bytes) {
+      // Already logged by the decoder.
+    } else if (decoded.color_type != PNG_COLOR_TYPE_GRAY) {
+      ERR("Unsupported libpng color type: [" + to_string(decoded.color_type) + "].");
+    } else if (decoded.width != image->width || decoded.height != image->height) {
+      ERR("Image [" + decoded.image->GetName() + "] doesn't match its PNG header.");
+    } else if (this->core_profile) {
+      this->UploadToTextureArray(decoded, image);
+    } else {
+      this->LoadTexture(decoded, image);
+    }
+
+    if (decoded.buffer && image->residency != Residency::LOADED) {
+      this->texture_uploader.Release(decoded.buffer);
+    }
+    ImageDecodePool::Free(decoded);
+    this->images_decoding.fetch_sub(1, memory_order_release);
+
+    // An image that was wanted before it was ready can be shown now.
+    if (image == this->wanted_image) {
+      this->dirty.store(true, memory_order_release);
+    }
+  }
+}
+
+void VideoRenderer::TouchTexture(PackImage *image) {
+  if (image->lru_position == this->lru.end()) {
+    this->lru.push_front(image);
+    image->lru_position = this->lru.begin();
+  } else {
+    this->lru.splice(this->lru.begin(), this->lru, image->lru_position);
+  }
+}
+
+void VideoRenderer::MakeRoomForTexture(const size_t bytes, const TextureSizeClass *size_class) {
+  if (!this->texture_budget) {
+    return;
+  }
+
+  while ((!size_class || size_class->free_layers.empty())
+      && this->texture_bytes.load(memory_order_relaxed) + bytes > this->texture_budget) {
+    if (!this->EvictTexture(size_class)) {
+      // Everything left is showing or about to, or shares an array with something that is: better
+      // to go over budget than not show it, or to unload images that are needed sooner than this.
+      DEBUG("Going over the texture budget.");
+      return;
+    }
+  }
+}
+
+bool VideoRenderer::EvictTexture(const TextureSizeClass *size_class) {
+  int64_t now_usec = MonotonicTimeUsec();
+  for (auto candidate = this->lru.rbegin(); candidate != this->lru.rend(); ++candidate) {
+    PackImage *image = *candidate;
+    if (!this->IsEvictable(image, now_usec)) {
+      continue;
+    }
+
+    // A layer in another size class is no use here, and freeing it frees no bytes unless it's the
+    // last one in use in its array. Take the whole array then, or leave it be.
+    if (image->size_class && image->size_class != size_class) {
+      vector<PackImage*> tenants;
+      bool evictable = true;
+      for (PackImage *tenant : this->lru) {
+        if (tenant->size_class == image->size_class && tenant->texture.id == image->texture.id) {
+          tenants.push_back(tenant);
+          evictable = evictable && this->IsEvictable(tenant, now_usec);
+        }
+      }
+      if (!evictable) {
+        continue;
+      }
+      for (PackImage *tenant : tenants) {
+        this->UnloadTexture(tenant);
+      }
+      return true;
+    }
+
+    this->UnloadTexture(image);
+    return true;
+  }
+  return false;
+}
+
+bool VideoRenderer::IsEvictable(const PackImage *image, const int64_t now_usec) const {
+  return image != this->wanted_image && image != this->shown_image && image->due_usec <= now_usec;
+}
+
+void VideoRenderer::UnloadTexture(PackImage *image) {
+  this->lru.erase(image->lru_position);
+  image->lru_position = this->lru.end();
+  image->residency = Residency::UNLOADED;
+
+  // On the core path, only the layer is freed, unless it was the last one in use in its array.
+  GLuint texture = image->texture.id;
+  TextureSizeClass *size_class = image->size_class;
+  if (size_class && --size_class->arrays[texture].second > 0) {
+    size_class->free_layers.push_back(make_pair(texture, (GLint) image->texture.layer));
+  } else {
+    if (size_class) {
+      this->texture_bytes.fetch_sub(TextureArrayBytes(size_class->width, size_class->height,
+          size_class->arrays[texture].first), memory_order_relaxed);
+      size_class->arrays.erase(texture);
+      size_class->free_layers.erase(remove_if(size_class->free_layers.begin(),
+          size_class->free_layers.end(),
+          [texture](const pair<GLuint, GLint>& layer) { return layer.first == texture; }),
+          size_class->free_layers.end());
+    } else {
+      this->texture_bytes.fetch_sub(LegacyTextureBytes(image->width, image->height),
+          memory_order_relaxed);
+    }
+
+    // Deleting a bound texture unbinds it, and its name may come back for another one.
+    glDeleteTextures(1, &texture);
+    if (texture == this->bound_image_texture) {
+      this->bound_image_texture = 0;
+    }
+  }
+
+  this->texture_evictions.fetch_add(1, memory_order_relaxed);
+  DEBUG("Unloaded [" + image->image->GetName() + "].");
+}
+
 void VideoRenderer::WaitForTextureLoad() {
   pthread_mutex_lock(&this->load_mutex);
   if (this->textures_loaded) {
@@ -387,27 +952,40 @@ void VideoRenderer::WaitForTextureLoad() {
   pthread_mutex_unlock(&this->load_mutex);
 }
 
-bool VideoRenderer::SetImage(const string& image_name, const AudioResource::Beat transition) {
+bool VideoRenderer::SetImage(const string& image_name, const AudioResource::Beat transition,
+    const int64_t start_usec) {
   pthread_rwlock_wrlock(&this->render_lock);
 
-  if (this->images.find(image_name) == this->images.end()) {
-    ERR("Render image [" + image_name + "] failed: not loaded!");
+  auto image = this->pack_images.find(image_name);
+  if (image == this->pack_images.end()) {
+    ERR("Render image [" + image_name + "] failed: not in the pack!");
     pthread_rwlock_unlock(&this->render_lock);
     return false;
   }
 
-  this->current_image = this->images[image_name];
+  this->current_image = &image->second;
 
+  // Animations run from when the beat was due, so that applying it late doesn't put the whole
+  // transition late too; the frames drawn from here on work out where they've got to.
+  int64_t from_usec = min(start_usec, MonotonicTimeUsec());
   string transition_type = "";
   switch(transition) {
     case AudioResource::Beat::VERTICAL_BLUR:
-      this->blur_y = 1.f;
+      this->blur_y.Start(Animation::Shape::DECAY, from_usec, VideoRenderer::kBlurDecayUsec);
       transition_type = ", type: [Y_BLUR]";
       break;
     case AudioResource::Beat::HORIZONTAL_BLUR:
-      this->blur_x = 1.f;
+      this->blur_x.Start(Animation::Shape::DECAY, from_usec, VideoRenderer::kBlurDecayUsec);
       transition_type = ", type: [X_BLUR]";
       break;
+    case AudioResource::Beat::BLACKOUT:
+      this->blackout.Start(Animation::Shape::RISE, from_usec, VideoRenderer::kBlackoutFadeUsec);
+      transition_type = ", type: [BLACKOUT]";
+      break;
+    case AudioResource::Beat::SHORT_BLACKOUT:
+      this->blackout.Start(Animation::Shape::PULSE, from_usec, VideoRenderer::kShortBlackoutUsec);
+      transition_type = ", type: [SHORT_BLACKOUT]";
+      break;
     case AudioResource::Beat::NO_BLUR:
       transition_type = ", type: [PLAIN]";
       break;
@@ -417,7 +995,13 @@ bool VideoRenderer::SetImage(const string& image_name, const AudioResource::Beat
     default: break;
   }
 
-  glutPostRedisplay();
+  // Any other transition brings the image back out of a blackout.
+  if (transition != AudioResource::Beat::BLACKOUT
+      && transition != AudioResource::Beat::SHORT_BLACKOUT) {
+    this->blackout.Stop();
+  }
+
+  this->dirty.store(true, memory_order_release);
   pthread_rwlock_unlock(&this->render_lock);
 
   LOG("Transition in: [" + image_name + "]" + transition_type);
@@ -426,93 +1010,293 @@ bool VideoRenderer::SetImage(const string& image_name, const AudioResource::Beat
 
 bool VideoRenderer::SetColor(const int color_index) {
   this->current_color = (color_index < 0) ? 0 : (color_index % 0x40);
+  this->dirty.store(true, memory_order_release);
   return true;
 }
 
-void VideoRenderer::SetImage(const AudioResource::Beat transition) {
-  this->SetImage(this->texture_name_list[rand() %this->texture_name_list.size()], transition);
+void VideoRenderer::ApplyBeat(const BeatEvent& beat) {
+  if (beat.actions & BeatTimeline::kChangeColor) {
+    this->SetColor(beat.color_index);
+  }
+  if ((beat.actions & BeatTimeline::kChangeImage) && beat.image) {
+    this->SetImage(beat.image->GetName(), beat.transition, beat.due_usec);
+  }
+}
+
+bool VideoRenderer::QueueUpcomingBeat(const BeatEvent& beat) {
+  return this->upcoming_beats.Push(beat);
+}
+
+bool VideoRenderer::HasLoadedUpcomingImages(const uint64_t beat_count) const {
+  return this->upcoming_beats_taken.load(memory_order_acquire) >= beat_count
+      && this->images_decoding.load(memory_order_acquire) == 0;
+}
+
+void VideoRenderer::PrepareUpcomingBeats() {
+  BeatEvent beat;
+  uint64_t taken = this->upcoming_beats_taken.load(memory_order_relaxed);
+  while (this->upcoming_beats.Pop(&beat)) {
+    taken = beat.sequence + 1;
+    if (!(beat.actions & BeatTimeline::kChangeImage) || !beat.image) {
+      continue;
+    }
+
+    auto image = this->pack_images.find(beat.image->GetName());
+    if (image == this->pack_images.end()) {
+      ERR("Upcoming image [" + beat.image->GetName() + "] is not in the pack!");
+      continue;
+    }
+
+    // Start loading images that aren't, and keep the ones that are from going before their beat.
+    image->second.due_usec = max(image->second.due_usec, beat.due_usec);
+    if (image->second.residency == Residency::UNLOADED) {
+      this->RequestTexture(&image->second);
+    } else if (image->second.residency == Residency::LOADED) {
+      this->TouchTexture(&image->second);
+    }
+  }
+
+  // Only once their images are counted as decoding, so that they're waited for.
+  this->upcoming_beats_taken.store(taken, memory_order_release);
+}
+
+void VideoRenderer::SetSpectrumAnalyzer(const SpectrumAnalyzer *spectrum) {
+  pthread_rwlock_wrlock(&this->render_lock);
+  this->spectrum = spectrum;
+  this->dirty.store(true, memory_order_release);
+  pthread_rwlock_unlock(&this->render_lock);
+}
+
+void VideoRenderer::SetBeatTrace(BeatTrace *beat_trace) {
+  pthread_rwlock_wrlock(&this->render_lock);
+  this->beat_trace = beat_trace;
+  pthread_rwlock_unlock(&this->render_lock);
+}
+
+void VideoRenderer::DumpFrameStats() {
+  int64_t now_usec = MonotonicTimeUsec();
+  uint64_t frames = this->frames_drawn.load(memory_order_relaxed);
+  int64_t idle_usec = this->idle_usec.load(memory_order_relaxed);
+  int64_t elapsed_usec = now_usec - this->last_dump_usec;
+
+  // Nothing to say if the render loop isn't running, or only just started.
+  if (this->last_dump_usec && elapsed_usec > 0 && (frames || idle_usec)) {
+    LOG("Video: [" + to_string((frames - this->last_dump_frames) * 1000. * 1000. / elapsed_usec)
+        + "] fps, idle [" + to_string(100. * (idle_usec - this->last_dump_idle_usec) / elapsed_usec)
+        + "]%, [" + to_string(frames) + "] frames drawn.");
+    LOG("Textures: [" + to_string(this->texture_bytes.load(memory_order_relaxed) >> 20)
+        + "] MB loaded, [" + to_string(this->texture_hits.load(memory_order_relaxed))
+        + "] hits, [" + to_string(this->texture_misses.load(memory_order_relaxed))
+        + "] misses, [" + to_string(this->texture_loads.load(memory_order_relaxed))
+        + "] loads ([" + to_string(this->texel_cache.GetHitCount()) + "] from the cache, ["
+        + to_string(this->texel_cache.GetHashCount()) + "] PNGs hashed), ["
+        + to_string(this->texture_evictions.load(memory_order_relaxed)) + "] evictions.");
+  }
+  this->last_dump_usec = now_usec;
+  this->last_dump_frames = frames;
+  this->last_dump_idle_usec = idle_usec;
+}
+
+bool VideoRenderer::EnableVsync() {
+  // Read the interval back where we can, as drivers may not take it.
+#ifdef WIN32
+  if (WGLEW_EXT_swap_control) {
+    return wglSwapIntervalEXT(1) && wglGetSwapIntervalEXT() == 1;
+  }
+#elif !defined(__APPLE__)
+  if (GLXEW_EXT_swap_control) {
+    Display *display = glXGetCurrentDisplay();
+    GLXDrawable drawable = glXGetCurrentDrawable();
+    unsigned int interval = 0;
+    glXSwapIntervalEXT(display, drawable, 1);
+    glXQueryDrawable(display, drawable, GLX_SWAP_INTERVAL_EXT, &interval);
+    return interval == 1;
+  }
+  if (GLXEW_MESA_swap_control) {
+    return glXSwapIntervalMESA(1) == 0 && glXGetSwapIntervalMESA() == 1;
+  }
+  if (GLXEW_SGI_swap_control) {
+    return glXSwapIntervalSGI(1) == 0;
+  }
+#endif
+  return false;
+}
+
+void VideoRenderer::CheckVsync(const int64_t now_usec) {
+  // The driver can still be told to ignore the swap interval, and then a swap doesn't wait for
+  // anything: ticking straight after it would spin. Time the first frames drawn back to back.
+  if (!this->vsync || this->vsync_checked) {
+    return;
+  }
+  if (this->vsync_check_frames++ == 0) {
+    this->vsync_check_start_usec = now_usec;
+    return;
+  }
+  if (this->vsync_check_frames <= kVsyncCheckFrames) {
+    return;
+  }
+
+  this->vsync_checked = true;
+  if (now_usec - this->vsync_check_start_usec < kVsyncCheckFrames * kMinSyncedFrameUsec) {
+    LOG("Swaps don't wait for vblank after all; timing frames instead.");
+    this->vsync = false;
+  }
 }
-void VideoRenderer::SetColor() {
-  this->SetColor(rand());
+
+bool VideoRenderer::NeedsRedraw(const int64_t now_usec) {
+  pthread_rwlock_rdlock(&this->render_lock);
+  bool redraw = this->dirty.load(memory_order_acquire)
+      || this->blur_x.GetValue(now_usec) != this->drawn_blur_x
+      || this->blur_y.GetValue(now_usec) != this->drawn_blur_y
+      || this->blackout.GetValue(now_usec) != this->drawn_blackout
+      || (this->spectrum && this->spectrum->GetAnalyzeCount() != this->drawn_analyze_count);
+  pthread_rwlock_unlock(&this->render_lock);
+  return redraw;
 }
 
 void VideoRenderer::DrawFrame() {
   pthread_rwlock_rdlock(&this->render_lock);
 
+  // Anything that changes from here on needs another frame.
+  this->dirty.store(false, memory_order_relaxed);
+  this->drawn_analyze_count = this->spectrum ? this->spectrum->GetAnalyzeCount() : 0;
+
+  // Work out where the animations have got to.
+  int64_t now_usec = MonotonicTimeUsec();
+  this->drawn_blur_x = this->blur_x.GetValue(now_usec);
+  this->drawn_blur_y = this->blur_y.GetValue(now_usec);
+  this->drawn_blackout = this->blackout.GetValue(now_usec);
+
+  // Show the image the beats asked for once it's loaded, and the last one until then.
+  if (this->current_image != this->wanted_image) {
+    this->wanted_image = this->current_image;
+    if (!this->wanted_image) {
+      // Nothing to show.
+    } else if (this->wanted_image->residency == Residency::LOADED) {
+      this->texture_hits.fetch_add(1, memory_order_relaxed);
+    } else {
+      this->texture_misses.fetch_add(1, memory_order_relaxed);
+      if (this->wanted_image->residency == Residency::UNLOADED) {
+        this->RequestTexture(this->wanted_image);
+      }
+    }
+  }
+  if (this->wanted_image && this->wanted_image->residency == Residency::LOADED
+      && this->wanted_image != this->shown_image) {
+    this->shown_image = this->wanted_image;
+    this->TouchTexture(this->shown_image);
+  }
+
+  // Beats are recorded after they're applied, so every beat counted here is in this frame.
+  uint64_t beats_drawn = this->beat_trace ? this->beat_trace->GetRecordedCount() : 0;
+  int64_t drawn_usec = MonotonicTimeUsec();
+
   // Calculate the color based on the index, normalized to [0,1].
   float red = (this->current_color & 0b11) / 3.f;
   float green = ((this->current_color & 0b1100) >> 2) / 3.f;
   float blue = ((this->current_color & 0b110000) >> 4) / 3.f;
   glClear(GL_COLOR_BUFFER_BIT);
 
-  // Make sure we have a image to draw, first.
-  if (this->current_image) {
+  // Pump the blur with the bass and the color with the overall loudness, if we can hear the music.
+  float blur_strength = 1.f;
+  float blend_opacity = VideoRenderer::kDefaultBlendOpacity;
+  if (this->spectrum) {
+    blur_strength = 0.5f + this->spectrum->GetAverageLevel(0, SpectrumAnalyzer::kBassBands);
+    blend_opacity =
+        0.5f + 0.4f * this->spectrum->GetAverageLevel(0, SpectrumAnalyzer::kBandCount);
+  }
+
+  // Make sure we have a image to draw, and that it isn't blacked out, first.
+  if (this->shown_image && this->drawn_blackout < 1) {
+    const ImageTexture& texture = this->shown_image->texture;
+
     // Render to texture if we want to blur.
-    if (this->blur_x > 0 || this->blur_y > 0) {
-      this->MarkRenderToTexture();
+    bool blurring = this->drawn_blur_x > 0 || this->drawn_blur_y > 0;
+    if (blurring) {
+      this->MarkRenderToTexture(0);
     }
 
     // Set image blend program.
     glUseProgram(this->image_blend_shaderprogram.id);
 
-    // Set shader program uniforms.
-    GLuint texture = this->textures[this->current_image->GetName()];
-    glUniform1i(this->image_blend_shaderprogram.BaseImage, 0);
+    // Set shader program uniforms. Switching between images in the same texture array is just
+    // a matter of pointing at another layer.
+    glUniform1f(this->image_blend_shaderprogram.BaseLayer, texture.layer);
+    glUniform2fv(this->image_blend_shaderprogram.BaseScale, 1, texture.scale);
     glUniform4f(this->image_blend_shaderprogram.BlendColor, red, green, blue, 1);
+    glUniform1f(this->image_blend_shaderprogram.BlendOpacity, blend_opacity);
 
-    // Bind the texture and draw a rectangle.
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glBegin(GL_QUADS);
-        glVertex2f(0, 0);
-        glVertex2f(this->window_width, 0);
-        glVertex2f(this->window_width, this->window_height);
-        glVertex2f(0, this->window_height);
-    glEnd();
-
-    // Now handle drawing the blurred image to screen.
-    if (this->blur_x > 0 || this->blur_y > 0) {
-      // Not ideal, but there needs to be a way to pick the blur direction active when they're both
-      // above zero? Maybe?
-      struct blurprogram *prog =
-          (this->blur_x > this->blur_y) ? &this->blur_x_shaderprogram : &this->blur_y_shaderprogram;
-      float blur = (this->blur_x > this->blur_y) ? this->blur_x : this->blur_y;
-
-      this->MarkRenderToScreen();
-      glUseProgram(prog->id);
-      glUniform1i(prog->Image, 0);
-      glUniform1f(prog->BlurRadius, VideoRenderer::kFullStrengthBlurRadius * blur);
-
+    // Images keep their unit to themselves, so the texture only needs binding when it changes.
+    if (texture.id != this->bound_image_texture) {
+      glActiveTexture(GL_TEXTURE0 + kImageTextureUnit);
+      glBindTexture(this->core_profile ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D, texture.id);
       glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, this->blur_fb.tex_id);
-      glBegin(GL_QUADS);
-          glVertex2f(0, 0);
-          glVertex2f(this->window_width, 0);
-          glVertex2f(this->window_width, this->window_height);
-          glVertex2f(0, this->window_height);
-      glEnd();
+      this->bound_image_texture = texture.id;
+    }
+
+    // Cover the window with the image, darkened by however far into a blackout we are. The blur
+    // is linear, so darkening before it is the same as after.
+    if (this->drawn_blackout > 0) {
+      glEnable(GL_BLEND);
+      glBlendColor(0, 0, 0, 1 - this->drawn_blackout);
+      glBlendFunc(GL_CONSTANT_ALPHA, GL_ZERO);
+    }
+    this->DrawFullscreen(this->image_blend_shaderprogram.Projection);
+    glDisable(GL_BLEND);
+
+    // Now blur one axis at a time, bouncing between the framebuffers, with whichever pass comes
+    // last drawing to the screen.
+    if (blurring) {
+      float tap_step = VideoRenderer::kFullStrengthBlurRadius * blur_strength / kBlurTaps;
+      int source = 0;
+      if (this->drawn_blur_x > 0) {
+        this->DrawBlurPass(source, this->drawn_blur_y > 0 ? 1 : -1,
+            tap_step * this->drawn_blur_x, 0);
+        source = 1;
+      }
+      if (this->drawn_blur_y > 0) {
+        this->DrawBlurPass(source, -1, 0, tap_step * this->drawn_blur_y);
+      }
     }
   }
 
-  // Render.
+  // Render. With vsync on, this waits for vblank, which is what paces the frames.
   glutSwapBuffers();
+  this->frames_drawn.fetch_add(1, memory_order_relaxed);
+  if (this->beat_trace) {
+    this->beat_trace->RecordPresented(beats_drawn, drawn_usec, MonotonicTimeUsec());
+  }
 
   pthread_rwlock_unlock(&this->render_lock);
 }
 
 void VideoRenderer::HandleResize(const int width, const int height) {
-  // Set up a 2D projection. This is mostly black magic.
+  this->dirty.store(true, memory_order_release);
   glViewport(0, 0, width, height);
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0, width, height, 0, 0, 1);
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-
   // 3D is for scrubs.
   glDisable(GL_DEPTH_TEST);
-  glDisable(GL_LIGHTING);
-  glEnable(GL_TEXTURE_2D);
+
+  if (this->core_profile) {
+    // Same as the legacy projection below, for a triangle measured in window widths and heights
+    // rather than pixels. Column-major, as GL wants it.
+    const GLfloat projection[16] {
+      2, 0, 0, 0,
+      0, -2, 0, 0,
+      0, 0, -2, 0,
+      -1, 1, -1, 1,
+    };
+    copy(projection, projection + 16, this->projection);
+  } else {
+    // Set up a 2D projection. This is mostly black magic.
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, width, height, 0, 0, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_2D);
+  }
 
   this->window_width = width;
   this->window_height = height;
@@ -521,52 +1305,199 @@ void VideoRenderer::HandleResize(const int width, const int height) {
 }
 
 void VideoRenderer::InitFramebuffer() {
-  // We need to bind the framebuffer before doing anything related to it, it seems.
-  glBindFramebuffer(GL_FRAMEBUFFER, this->blur_fb.id);
+  for (auto& framebuffer : this->blur_fb) {
+    // We need to bind the framebuffer before doing anything related to it, it seems.
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.id);
+
+    // Delete the previous texture if there was one.
+    if (framebuffer.tex_id != 0) {
+      glDeleteTextures(1, &framebuffer.tex_id);
+      framebuffer.tex_id = 0;
+    }
 
-  // Delete the previous texture if there was one.
-  if (this->blur_fb.tex_id != 0) {
-    glDeleteTextures(1, &this->blur_fb.tex_id);
-    this->blur_fb.tex_id = 0;
+    // Generate a texture and set parameters. The blur relies on linear filtering, and on taps past
+    // the edges repeating the edge rather than wrapping around.
+    glGenTextures(1, &framebuffer.tex_id);
+    glBindTexture(GL_TEXTURE_2D, framebuffer.tex_id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, this->window_width, this->window_height, 0,
+        GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+        framebuffer.tex_id, 0);
+
+    // Tell the framebuffer to draw to the attached color buffer.
+    static GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
+    glDrawBuffers(1, DrawBuffers);
   }
 
-  // Generate a texture and set parameters.
-  glGenTextures(1, &this->blur_fb.tex_id);
-  glBindTexture(GL_TEXTURE_2D, this->blur_fb.tex_id);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, this->window_width, this->window_height, 0,
-      GL_RGBA, GL_UNSIGNED_BYTE, 0);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-      this->blur_fb.tex_id, 0);
-
-  // Tell the framebuffer to draw to the attached color buffer.
-  static GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
-  glDrawBuffers(1, DrawBuffers);
-
   // Unbind the current texture and framebuffer.
   glBindTexture(GL_TEXTURE_2D, 0);
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void VideoRenderer::HandleTimerTick() {
-  if ((this->blur_x > 0 || this->blur_y > 0)
-        && (clock() - this->last_blur_decay_tick >= VideoRenderer::kBlurDecayTick)) {
-    this->blur_x /= VideoRenderer::kBlurDecayFactorPerTick;
-    this->blur_y /= VideoRenderer::kBlurDecayFactorPerTick;
+  if (this->stop_requested) {
+#ifdef FREEGLUT
+    glutLeaveMainLoop();
+#endif
+    // Plain GLUT can't leave its loop; stop ticking, at least.
+    return;
+  }
+
+  // Keep images loading ahead of the beats that show them.
+  this->PrepareUpcomingBeats();
+  this->TakeDecodedImages();
+  this->LendUploadBuffers();
+
+  int64_t now_usec = MonotonicTimeUsec();
+
+  // Time since the last tick was idle if we had nothing to draw then.
+  if (!this->redrawing) {
+    this->idle_usec.fetch_add(now_usec - this->last_tick_usec, memory_order_relaxed);
+  }
+  this->last_tick_usec = now_usec;
+  this->redrawing = this->NeedsRedraw(now_usec);
+
+  // If there's a frame to draw, come straight back once it's been swapped: the swap waits for
+  // vblank, so that's the next frame's turn. Otherwise just check back for changes shortly.
+  if (this->redrawing) {
+    this->CheckVsync(now_usec);
+    glutPostRedisplay();
+    glutTimerFunc(this->vsync ? 0 : VideoRenderer::kUnsyncedFrameMsec, TimerCallback, 0);
+  } else {
+    this->vsync_check_frames = 0;
+    glutTimerFunc(VideoRenderer::kIdlePollMsec, TimerCallback, 0);
+  }
+}
+
+void VideoRenderer::InitFullscreenTriangle() {
+  // One triangle big enough to cover the window, in window widths and heights: no diagonal seam,
+  // and no pixels shaded twice.
+  static const GLfloat kVertices[] {
+    0, 0,
+    2, 0,
+    0, 2,
+  };
+
+  glGenVertexArrays(1, &this->fullscreen_vao);
+  glBindVertexArray(this->fullscreen_vao);
+  glGenBuffers(1, &this->fullscreen_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, this->fullscreen_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(kVertices), kVertices, GL_STATIC_DRAW);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    this->last_blur_decay_tick = clock();
+void VideoRenderer::DrawFullscreen(const GLint projection_location) {
+  if (this->core_profile) {
+    glUniformMatrix4fv(projection_location, 1, GL_FALSE, this->projection);
+    glBindVertexArray(this->fullscreen_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    return;
   }
 
-  this->blur_x = this->blur_x < .001 ? 0 : this->blur_x;
-  this->blur_y = this->blur_y < .001 ? 0 : this->blur_y;
+  glBegin(GL_QUADS);
+      glVertex2f(0, 0);
+      glVertex2f(this->window_width, 0);
+      glVertex2f(this->window_width, this->window_height);
+      glVertex2f(0, this->window_height);
+  glEnd();
 }
 
-void VideoRenderer::MarkRenderToTexture() {
-  glBindFramebuffer(GL_FRAMEBUFFER, this->blur_fb.id);
+void VideoRenderer::DrawBlurPass(const int source, const int target, float step_x,
+    float step_y) {
+  // The kernel only adds up with its taps at most a texel apart, fetched at texel centres. If
+  // they're further apart than that, shrink the image along the blur until they're a texel apart
+  // in the copy, blur the copy at its own size, and stretch the result back over the window.
+  float texels_x = step_x * this->window_width;
+  float texels_y = step_y * this->window_height;
+  if (texels_x <= 1 && texels_y <= 1) {
+    this->MarkRenderToTarget(target);
+    this->DrawKernelPass(source, this->window_width, this->window_height, step_x, step_y);
+    return;
+  }
+
+  int width = this->window_width;
+  int height = this->window_height;
+  if (texels_x > 1) {
+    width = max(1, (int) lround(this->window_width / texels_x));
+    step_x = 1.f / this->window_width;
+  } else {
+    height = max(1, (int) lround(this->window_height / texels_y));
+    step_y = 1.f / this->window_height;
+  }
+  this->MarkRenderToTexture(kBlurScratch);
+  this->DrawResamplePass(source, this->window_width, this->window_height, width, height);
+
+  // The source has been read by now, so its corner can hold the blurred copy.
+  this->MarkRenderToTexture(source);
+  this->DrawKernelPass(kBlurScratch, width, height, step_x, step_y);
+
+  this->MarkRenderToTarget(target);
+  this->DrawResamplePass(source, width, height, this->window_width, this->window_height);
+}
+
+void VideoRenderer::DrawKernelPass(const int source, const int width, const int height,
+    const float step_x, const float step_y) {
+  glViewport(0, 0, width, height);
+
+  float scale_x = (float) width / this->window_width;
+  float scale_y = (float) height / this->window_height;
+  glUseProgram(this->blur_shaderprogram.id);
+  glUniform1i(this->blur_shaderprogram.Image, 0);
+  glUniform2f(this->blur_shaderprogram.BlurStep, step_x, step_y);
+  glUniform2f(this->blur_shaderprogram.SourceScale, scale_x, scale_y);
+  glUniform2f(this->blur_shaderprogram.SourceMax, scale_x - 0.5f / this->window_width,
+      scale_y - 0.5f / this->window_height);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, this->blur_fb[source].tex_id);
+  this->DrawFullscreen(this->blur_shaderprogram.Projection);
+  glViewport(0, 0, this->window_width, this->window_height);
+}
+
+void VideoRenderer::DrawResamplePass(const int source, const int source_width,
+    const int source_height, const int width, const int height) {
+  glViewport(0, 0, width, height);
+
+  // Each texel of the result covers this many of the source's, along whichever axis shrinks.
+  float texels_x = (float) source_width / width;
+  float texels_y = (float) source_height / height;
+  int fetch_count = min((int) ceil(max(texels_x, texels_y) / 2), kMaxResampleFetches);
+  float scale_x = (float) source_width / this->window_width;
+  float scale_y = (float) source_height / this->window_height;
+  glUseProgram(this->resample_shaderprogram.id);
+  glUniform1i(this->resample_shaderprogram.Image, 0);
+  glUniform2f(this->resample_shaderprogram.SourceScale, scale_x, scale_y);
+  glUniform2f(this->resample_shaderprogram.SourceMax, scale_x - 0.5f / this->window_width,
+      scale_y - 0.5f / this->window_height);
+  glUniform2f(this->resample_shaderprogram.Footprint,
+      texels_x > 1 ? texels_x / this->window_width : 0,
+      texels_y > 1 ? texels_y / this->window_height : 0);
+  glUniform1i(this->resample_shaderprogram.FetchCount, max(1, fetch_count));
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, this->blur_fb[source].tex_id);
+  this->DrawFullscreen(this->resample_shaderprogram.Projection);
+  glViewport(0, 0, this->window_width, this->window_height);
+}
+
+void VideoRenderer::MarkRenderToTexture(const int index) {
+  glBindFramebuffer(GL_FRAMEBUFFER, this->blur_fb[index].id);
   glClear(GL_COLOR_BUFFER_BIT);
 }
 void VideoRenderer::MarkRenderToScreen() {
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
   glClear(GL_COLOR_BUFFER_BIT);
 }
+void VideoRenderer::MarkRenderToTarget(const int target) {
+  if (target < 0) {
+    this->MarkRenderToScreen();
+  } else {
+    this->MarkRenderToTexture(target);
+  }
+}
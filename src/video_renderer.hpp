@@ -4,11 +4,22 @@
 #include <glew.h>
 #include <pthread.h>
 
+#include <atomic>
 #include <cmath>
+#include <list>
+#include <map>
 #include <unordered_map>
+#include <vector>
 
+#include <animation.hpp>
+#include <beat_events.hpp>
+#include <beat_trace.hpp>
 #include <common.hpp>
+#include <image_decode_pool.hpp>
 #include <respack.hpp>
+#include <spectrum_analyzer.hpp>
+#include <texel_cache.hpp>
+#include <texture_uploader.hpp>
 
 // VideoRenderer class.
 class VideoRenderer {
@@ -22,11 +33,32 @@ class VideoRenderer {
     VideoRenderer();
 
     /**
-     * Clean up the window before closing.
+     * Frees whatever is left. Everything on the GPU is gone by then: see Stop().
      */
-    ~VideoRenderer();
+    virtual ~VideoRenderer();
 
-    /** Initializes GLUT and other OpenGL state. */
+    /** The default for SetTextureBudget(). */
+    static const size_t kDefaultTextureBudget;
+
+    /**
+     * Makes Init() stick to the fixed-function pipeline and GLSL 1.10, rather than asking for a
+     * GL 3.3 core profile context. Must be called before Init().
+     */
+    void SetLegacyGl(const bool legacy_gl) { this->legacy_gl = legacy_gl; }
+
+    /**
+     * Sets how much texture memory images may take up, in bytes. Once it's full, the least
+     * recently shown images are unloaded to make room. It's only exceeded when the images for the
+     * beats coming up don't fit in it. Must be called before LoadTextures().
+     *
+     * @param texture_budget the budget, or 0 for no limit.
+     */
+    void SetTextureBudget(const size_t texture_budget) { this->texture_budget = texture_budget; }
+
+    /**
+     * Initializes GLUT and other OpenGL state. Uses a GL 3.3 core profile if the driver has one,
+     * and the legacy fixed-function path otherwise.
+     */
     void Init(int argc, char *argv[]);
 
     /**
@@ -36,14 +68,27 @@ class VideoRenderer {
     void DoGlutLoop();
 
     /**
-     * Loads into memory all images contained in the given resource pack.
+     * Makes DoGlutLoop() release everything on the GPU, stop the image decoders and return, at its
+     * next tick. Can be called from any thread.
+     *
+     * @return <code>true</code> if DoGlutLoop() is going to return. Plain GLUT can't leave its
+     *         loop, so without freeglut it only stops drawing.
+     */
+    bool Stop();
+
+    /** Returns whether DoGlutLoop() has returned: after Stop(), or because the window closed. */
+    bool HasStopped() const { return this->loop_returned; }
+
+    /**
+     * Gets ready to load the images contained in the given resource pack. Only their headers are
+     * read here; each image is decoded and uploaded when a beat coming up calls for it.
      *
      * @param respack the resource pack to load image textures from.
      */
     void LoadTextures(const ResourcePack &respack);
 
     /**
-     * Blocks until all textures are loaded into memory.
+     * Blocks until images can be loaded on demand.
      */
     void WaitForTextureLoad();
 
@@ -52,17 +97,13 @@ class VideoRenderer {
      *
      * @param image_name the name of the next image to show.
      * @param transition the type of beat transition to draw.
+     * @param start_usec when the transition's animation starts, on the monotonic clock, if that's
+     *                   already past: normally when its beat was due.
      * @return <code>true</code> if the image exists, and was successfully marked for redraw.
-     *         <code>false</code> otherwise.
+     *         <code>false</code> otherwise. The image is drawn once it's loaded, if it isn't yet.
      */
-    bool SetImage(const string& image_name, const AudioResource::Beat transition);
-
-    /**
-     * Set an Image for the next DrawFrame(). The Image is randomly chosen among all loaded images.
-     *
-     * @param transition the type of beat transition to draw.
-     */
-    void SetImage(const AudioResource::Beat transition);
+    bool SetImage(const string& image_name, const AudioResource::Beat transition,
+        const int64_t start_usec);
 
     /**
      * Set a color for the next DrawFrame()
@@ -74,99 +115,402 @@ class VideoRenderer {
      */
     bool SetColor(const int color_index);
 
-     /**
-     * Set a color for the next DrawFrame(). The color is randomly chosen.
+    /**
+     * Draws a beat resolved by the logic thread: changes the color and/or image as it says.
+     *
+     * @param beat the beat that's due now.
+     */
+    virtual void ApplyBeat(const BeatEvent& beat);
+
+    /**
+     * Tells the renderer about a beat that's coming up, so it can get ready before it's due. Beats
+     * must be queued in order, ahead of being applied, all from the same thread; the render thread
+     * picks them up without blocking it.
+     *
+     * @return <code>false</code> if too many beats are already waiting, <code>true</code>
+     *         otherwise.
+     */
+    virtual bool QueueUpcomingBeat(const BeatEvent& beat);
+
+    /**
+     * Returns whether the render thread has taken the given number of upcoming beats off the
+     * queue, and has every image they call for loaded (or known not to load). Can be called from
+     * any thread.
+     *
+     * @param beat_count how many beats have been queued, counting by BeatEvent::sequence.
+     */
+    bool HasLoadedUpcomingImages(const uint64_t beat_count) const;
+
+    /**
+     * Makes the visuals react to the music. The analyzer is only read from, and must outlive this
+     * renderer (or be unset by passing NULL).
+     *
+     * @param spectrum the analyzer tracking the song that's currently playing.
+     */
+    virtual void SetSpectrumAnalyzer(const SpectrumAnalyzer *spectrum);
+
+    /**
+     * Stamps beats with the time the first frame showing them was swapped. The trace must outlive
+     * this renderer (or be unset by passing NULL).
      */
-    void SetColor();
+    void SetBeatTrace(BeatTrace *beat_trace);
+
+    /**
+     * Logs the frame rate achieved, and how much of the time there was nothing to redraw, since
+     * the last call, along with how well images were kept loaded ahead of being shown. Must always
+     * be called from the same thread.
+     */
+    void DumpFrameStats();
 
   private:
 
+    // Where an image lives in texture memory: the texture, the layer within it (core profile
+    // only), and the part of the layer it covers.
+    struct ImageTexture {
+      GLuint id;
+      GLfloat layer;
+      GLfloat scale[2];
+    };
+
+    // Texture arrays for one size class (core profile only). They're created as images are
+    // loaded, bigger the more the class has, and deleted once every layer is unloaded again.
+    struct TextureSizeClass {
+      int width;
+      int height;
+      // Each array, by texture: how many layers it has, and how many are in use.
+      map<GLuint, pair<GLsizei, int>> arrays;
+      vector<pair<GLuint, GLint>> free_layers;
+    };
+
+    enum class Residency {
+      UNLOADED,
+      // Requested from the decode pool.
+      DECODING,
+      LOADED,
+      // Couldn't be decoded or uploaded: not asked for again.
+      FAILED
+    };
+
+    // An image in the pack, and where its texture is if it's loaded. Only the render thread
+    // touches anything but the image, once LoadTextures() is done.
+    struct PackImage {
+      const ImageResource *image;
+      // From the PNG header.
+      int width;
+      int height;
+      // Core profile only.
+      TextureSizeClass *size_class;
+      Residency residency;
+      // When the last beat coming up that shows it is due, on the monotonic clock. It isn't
+      // unloaded before then.
+      int64_t due_usec;
+      // Valid while loaded, along with its place in the recently used list.
+      ImageTexture texture;
+      list<PackImage*>::iterator lru_position;
+    };
+
     static void DrawFrameCallback();
     static void ResizeCallback(const int, const int);
     static void TimerCallback(int);
+    static void CloseCallback();
+
+    /**
+     * Deletes every GL object we made, after stopping the image decoders that fill the upload
+     * buffers. Called with the context current, just before the window goes.
+     */
+    void ReleaseGl();
 
-    /** Compiles our hard light (and eventually Gaussian blur) shaders. */
+    /** Compiles our hard light and Gaussian blur shaders. */
     void CompileShaders();
-    /** Compiles a shader. Boilerplate sucks. */
-    GLuint CompileShader(const char *&shader_text, GLenum shader_type);
+    /**
+     * Compiles a shader. Boilerplate sucks.
+     *
+     * @param defines preprocessor lines to put ahead of the shader's source.
+     */
+    GLuint CompileShader(const char *&shader_text, GLenum shader_type,
+        const string& defines = "");
 
     /** Draws a frame based on the parameters currently set in this class instance. */
     void DrawFrame();
     /** Updates class info based on a window resize event. */
     void HandleResize(const int width, const int height);
-    /** Handle a GLUT timer event */
+    /** Handle a GLUT timer event: asks for a frame if one is due, and schedules the next tick. */
     void HandleTimerTick();
+    /** Returns whether what's on screen differs from what should be there at now_usec. */
+    bool NeedsRedraw(const int64_t now_usec);
+    /**
+     * Asks the driver to swap buffers in sync with vblank.
+     *
+     * @return <code>true</code> if it will, <code>false</code> otherwise.
+     */
+    bool EnableVsync();
+    /**
+     * Times the first frames drawn back to back with vsync on, and turns it off if they came
+     * faster than any display refreshes.
+     */
+    void CheckVsync(const int64_t now_usec);
+
+    /** Loads an image into a texture of its own, for the legacy path. */
+    void LoadTexture(const DecodedImage& decoded, PackImage *image);
+    /** Loads an image into a free layer of a texture array, for the core path. */
+    void UploadToTextureArray(const DecodedImage& decoded, PackImage *image);
 
-    /** (Re-)Initializes a FBO to the current screen dimensions. */
+    /** Takes upcoming beats off the queue, and starts loading their images. */
+    void PrepareUpcomingBeats();
+    /** Asks the decode pool for an image that isn't loaded. */
+    void RequestTexture(PackImage *image);
+    /**
+     * Lends the decode pool free upload buffers to decode into, until it has kLentUploadBuffers
+     * of them.
+     */
+    void LendUploadBuffers();
+    /** Uploads the images the decode pool has finished with so far. */
+    void TakeDecodedImages();
+    /** Marks an image as just used, so it's the last to be unloaded. */
+    void TouchTexture(PackImage *image);
+    /**
+     * Unloads the least recently used images until there's room in the budget for more bytes of
+     * texture, or (core profile only) a layer is free in a size class.
+     *
+     * @param size_class where a free layer would do instead, or NULL.
+     */
+    void MakeRoomForTexture(const size_t bytes, const TextureSizeClass *size_class);
+    /**
+     * Unloads the least recently used image, other than the one showing, or any a beat coming up
+     * is going to show. On the core path, an image outside the given size class only goes along
+     * with every other image in its array, so that what's unloaded either frees a layer that
+     * will do or frees bytes.
+     *
+     * @param size_class where a free layer would do, or NULL.
+     * @return <code>true</code> if anything was unloaded, <code>false</code> otherwise.
+     */
+    bool EvictTexture(const TextureSizeClass *size_class);
+    /** Whether an image can be unloaded: it isn't showing, wanted, or due to be shown. */
+    bool IsEvictable(const PackImage *image, const int64_t now_usec) const;
+    /** Unloads an image, freeing its layer, or its texture if nothing else is using it. */
+    void UnloadTexture(PackImage *image);
+
+    /** (Re-)Initializes the FBOs to the current screen dimensions. */
     void InitFramebuffer();
 
-    void MarkRenderToTexture();
-    void MarkRenderToScreen();
+    /** Creates the VAO and static VBO for DrawFullscreen() on the core profile path. */
+    void InitFullscreenTriangle();
+    /**
+     * Covers the window with the current program and texture.
+     *
+     * @param projection_location where the current program wants the projection (core only).
+     */
+    void DrawFullscreen(const GLint projection_location);
+
+    /**
+     * Blurs one framebuffer's texture along one axis. Blurs too wide for the kernel go through the
+     * scratch framebuffer, and leave the source framebuffer's contents behind.
+     *
+     * @param source the index of the framebuffer to blur.
+     * @param target the index of the framebuffer to draw into, or -1 for the screen.
+     * @param step_x the distance between taps along x, in texture coordinates. Either this or
+     *     step_y should be 0.
+     */
+    void DrawBlurPass(const int source, const int target, float step_x, float step_y);
+
+    /**
+     * Runs the blur kernel over the corner of one framebuffer's texture, into the same corner of
+     * the bound framebuffer.
+     *
+     * @param source the index of the framebuffer to blur.
+     * @param width the width of the corner, in texels.
+     * @param height likewise, its height.
+     * @param step_x the distance between taps along x, in texture coordinates; at most a texel.
+     * @param step_y likewise, along y.
+     */
+    void DrawKernelPass(const int source, const int width, const int height, const float step_x,
+        const float step_y);
+
+    /**
+     * Stretches or shrinks the corner of one framebuffer's texture into the corner of the bound
+     * framebuffer.
+     *
+     * @param source the index of the framebuffer to resample.
+     * @param source_width the width of the corner to read, in texels.
+     * @param source_height likewise, its height.
+     * @param width the width of the corner to draw, in texels.
+     * @param height likewise, its height.
+     */
+    void DrawResamplePass(const int source, const int source_width, const int source_height,
+        const int width, const int height);
 
-    vector<string> texture_name_list;
-    unordered_map<string, GLuint> textures;
-    unordered_map<string, ImageResource*> images;
+    void MarkRenderToTexture(const int index);
+    void MarkRenderToScreen();
+    void MarkRenderToTarget(const int target);
+
+    // Every image in the pack, by name. Fixed once LoadTextures() is done.
+    unordered_map<string, PackImage> pack_images;
+    // By rounded up width and height.
+    map<pair<int, int>, TextureSizeClass> size_classes;
+    // Loaded images, most recently used first.
+    list<PackImage*> lru;
+    size_t texture_budget = kDefaultTextureBudget;
+    // Texture memory taken up by images. Written by the render thread only.
+    std::atomic<size_t> texture_bytes{0};
+    // Streams images into the texture arrays (core profile only).
+    TextureUploader texture_uploader;
+    // Upload buffers lent to the decode pool and not yet back in a decoded image. Render thread
+    // only.
+    unsigned int lent_upload_buffers = 0;
+    // Decoded images from earlier runs, so that loading an image is mostly just mapping a file.
+    TexelCache texel_cache;
+    // Decodes images as they're requested. Declared after the uploader and the cache, so that no
+    // worker is still using either when they go.
+    ImageDecodePool decode_pool;
+    // The texture bound to the image unit. Render thread only.
+    GLuint bound_image_texture = 0;
+
+    // Texture stats: image changes whose image was or wasn't loaded in time to be drawn, and
+    // images loaded and unloaded. Written by the render thread and read by DumpFrameStats().
+    std::atomic<uint64_t> texture_hits{0};
+    std::atomic<uint64_t> texture_misses{0};
+    std::atomic<uint64_t> texture_loads{0};
+    std::atomic<uint64_t> texture_evictions{0};
 
     bool textures_loaded = false;
+    // Whether Init() created a GL context, and so there are GL objects to clean up.
+    bool gl_initialized = false;
+    bool legacy_gl = false;
+    // Whether we're drawing with GL 3.3 core features only, rather than the fixed-function path.
+    bool core_profile = false;
+    // Whether swaps wait for vblank.
+    bool vsync = false;
+    // Whether CheckVsync() has timed enough frames to be sure of that, and how far it's got.
+    bool vsync_checked = false;
+    int vsync_check_frames = 0;
+    int64_t vsync_check_start_usec = 0;
+
+    // Core profile only: the fullscreen triangle, and the projection to draw it with.
+    GLuint fullscreen_vao = 0;
+    GLuint fullscreen_vbo = 0;
+    GLfloat projection[16] = {};
 
     int window_height = -1;
     int window_width = -1;
 
-    ImageResource *current_image = NULL;
+    // The image beats last asked for. Guarded by render_lock.
+    PackImage *current_image = NULL;
+    // Render thread only: the image the last frame wanted, and the one it showed, which is the
+    // last one to have been loaded in time. Neither is unloaded.
+    PackImage *wanted_image = NULL;
+    PackImage *shown_image = NULL;
     int current_color = 0;
 
-    // A number, in [0,1], that determines what portion of the full strength blur radius we use.
-    // Clamped to the nearest thousandth.
-    float blur_x = 0.f;
-    float blur_y = 0.f;
-    clock_t last_blur_decay_tick;
+    const SpectrumAnalyzer *spectrum = NULL;
+    BeatTrace *beat_trace = NULL;
+
+    BeatEventQueue upcoming_beats;
+    // Written by the render thread, for HasLoadedUpcomingImages(): how many upcoming beats it has
+    // taken off the queue, and how many images it has asked the decode pool for and not got back.
+    std::atomic<uint64_t> upcoming_beats_taken{0};
+    std::atomic<unsigned int> images_decoding{0};
+
+    // Set when something the frame shows changes, cleared when a frame starts drawing.
+    std::atomic<bool> dirty{true};
+    // The spectrum analysis the last frame was drawn with. Render thread only.
+    uint64_t drawn_analyze_count = 0;
+
+    // Frame scheduling, on the render thread only: when the timer last ticked, and whether it
+    // asked for a frame then.
+    int64_t last_tick_usec = 0;
+    bool redrawing = false;
+
+    // Frame stats, written by the render thread and read by DumpFrameStats().
+    std::atomic<uint64_t> frames_drawn{0};
+    std::atomic<int64_t> idle_usec{0};
+    int64_t last_dump_usec = 0;
+    uint64_t last_dump_frames = 0;
+    int64_t last_dump_idle_usec = 0;
+
+    // Portions, in [0,1], of the full strength blur radius we use, and of the image that's
+    // blacked out.
+    Animation blur_x;
+    Animation blur_y;
+    Animation blackout;
+    // Where the animations were at in the last frame. Render thread only.
+    float drawn_blur_x = 0.f;
+    float drawn_blur_y = 0.f;
+    float drawn_blackout = 0.f;
 
     GLuint pass_through_vertex_shader;
     GLuint hard_light_fragment_shader;
 
-    GLuint gaussian_x_vertex_shader;
-    GLuint gaussian_y_vertex_shader;
     GLuint gaussian_fragment_shader;
 
     // Stores the shader program for blending the image with the color.
     struct {
       GLuint id;
       GLuint BaseImage;
+      GLint BaseLayer;
+      GLint BaseScale;
       GLuint BlendColor;
+      GLuint BlendOpacity;
+      GLint Projection;
     } image_blend_shaderprogram;
 
-    // Stores the shader program for blurring the image in the x direction.
-    struct blurprogram {
+    // Stores the shader program for blurring the image along either axis.
+    struct {
       GLuint id;
-      GLuint BlurRadius;
+      GLint BlurStep;
       GLuint Image;
-    } blur_x_shaderprogram;
+      GLint SourceScale;
+      GLint SourceMax;
+      GLint Projection;
+    } blur_shaderprogram;
 
-    // Stores the shader program for blurring the image in the y direction.
-    struct blurprogram blur_y_shaderprogram;
+    GLuint resample_fragment_shader;
 
-    // Stores texture and framebuffer info when rendering to texture for Gaussian blur.
+    // Stores the shader program for shrinking the image ahead of a wide blur, and stretching back.
+    struct {
+      GLuint id;
+      GLint SourceScale;
+      GLint SourceMax;
+      GLint Footprint;
+      GLint FetchCount;
+      GLuint Image;
+      GLint Projection;
+    } resample_shaderprogram;
+
+    // Stores texture and framebuffer info when rendering to texture for Gaussian blur. The image
+    // is drawn into the first, and blur passes bounce between the first two. The third holds the
+    // image shrunk ahead of a blur too wide to do at full size.
     struct {
       GLuint id;
       GLuint tex_id;
-    } blur_fb;
+    } blur_fb[3];
 
     pthread_rwlock_t render_lock;
     pthread_mutex_t load_mutex;
     pthread_cond_t load_cv;
 
+    // Set by Stop(), and by DoGlutLoop() on its way out.
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> loop_returned{false};
+
     // THIS IS HELL AND YOU ARE THE DEVIL.
     static VideoRenderer *instance;
 
     static const float kFullStrengthBlurRadius;
-    static const float kBlurDecayFactorPerTick;
-    static const clock_t kBlurDecayTick;
-
+    static const float kDefaultBlendOpacity;
+    static const int64_t kBlurDecayUsec;
+    static const int64_t kBlackoutFadeUsec;
+    static const int64_t kShortBlackoutUsec;
+    static const int kIdlePollMsec;
+    static const int kUnsyncedFrameMsec;
+
+    static const char *kLegacyVertexPrelude;
+    static const char *kLegacyFragmentPrelude;
+    static const char *kCoreVertexPrelude;
+    static const char *kCoreFragmentPrelude;
     static const char *kPassThroughVertexShader;
     static const char *kHardLightFragmentShader;
-    static const char *kGaussianXVertexShader;
-    static const char *kGaussianYVertexShader;
     static const char *kGaussianFragmentShader;
+    static const char *kResampleFragmentShader;
 };
 
 #endif